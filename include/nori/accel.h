@@ -19,40 +19,22 @@
 #pragma once
 
 #include <nori/mesh.h>
+#include <nori/raystats.h>
 
 NORI_NAMESPACE_BEGIN
 
-/// todo: encapsulate the BVH and KD-TREE
-static constexpr uint32_t MAX_TRIANGLES_PER_NODE = 15;
-static constexpr uint32_t MAX_RECURSION_DEPTH = 10;
-static constexpr uint32_t MAX_NUM_MESHES = 32;
-
 /**
  * \brief Acceleration data structure for ray intersection queries
  *
- * The current implementation falls back to a brute force loop
- * through the geometry.
-// */
-class Accel {
-
-    struct Node {
-        uint32_t num_triangles = 0;
-        BoundingBox3f bbox;
-        Node* next = nullptr;
-        Node* child = nullptr;
-        uint32_t* triangle_indices = nullptr;
-        uint32_t* mesh_indices = nullptr;
-
-        ~Node() {
-            delete[] triangle_indices;
-            delete[] mesh_indices;
-            delete next;
-            delete child;
-        }
-    };
-
+ * This is the abstract interface shared by all acceleration structures
+ * (octree, BVH, ..). It keeps track of the registered meshes and turns the
+ * closest triangle hit reported by a subclass into a detailed
+ * \ref Intersection record. Subclasses are selected in the scene
+ * description using the <tt>&lt;accel type=".."/&gt;</tt> tag.
+ */
+class Accel : public NoriObject {
 public:
-    ~Accel() { delete m_root; }
+    Accel();
 
     /**
      * \brief Register a triangle mesh for inclusion in the acceleration
@@ -62,12 +44,78 @@ public:
      */
     void addMesh(Mesh* mesh);
 
-    /// Build the acceleration data structure (currently a no-op)
-    void build();
+    /// Build the acceleration data structure
+    virtual void build() = 0;
+
+    /**
+     * \brief Create an empty acceleration structure of the same type and
+     * with the same parameters
+     *
+     * Used for the per-mesh bottom-level structures of instanced geometry
+     */
+    virtual Accel* createBottomLevel() const = 0;
+
+    /**
+     * \brief Update the acceleration data structure after the vertex
+     * positions of the registered meshes changed
+     *
+     * The topology of the meshes has to stay the same. The default
+     * implementation simply rebuilds the structure from scratch.
+     */
+    virtual void refit();
 
     /// Return an axis-aligned box that bounds the scene
     const BoundingBox3f& getBoundingBox() const { return m_bbox; }
 
+    /// Return the total number of triangles of the registered meshes
+    uint32_t getPrimitiveCount() const { return m_prim_offsets.back(); }
+
+    /**
+     * \brief Look up the mesh and the triangle of a global primitive id
+     *
+     * The triangles of all registered meshes are numbered consecutively,
+     * in the order in which the meshes were added, so the mesh follows
+     * from a binary search over the per-mesh offsets.
+     */
+    void resolvePrimitive(uint32_t prim_id, uint32_t& mesh_idx, uint32_t& triangle_idx) const {
+        mesh_idx = (uint32_t) (std::upper_bound(m_prim_offsets.begin() + 1, m_prim_offsets.end(), prim_id)
+            - m_prim_offsets.begin()) - 1;
+        triangle_idx = prim_id - m_prim_offsets[mesh_idx];
+    }
+
+    /**
+     * \brief Resolves the primitive ids of a leaf one after another
+     *
+     * The triangles of a leaf almost always belong to the same mesh, so
+     * the binary search of \ref resolvePrimitive() only runs when an id
+     * falls outside the mesh of the previous one, instead of once per
+     * tested triangle.
+     */
+    class PrimitiveCursor {
+    public:
+        PrimitiveCursor(const Accel& accel) : m_accel(accel) { }
+
+        /// Return the mesh of a global primitive id and the triangle index within it
+        const Mesh* resolve(uint32_t prim_id, uint32_t& triangle_idx) {
+            /* Ids below m_first wrap around and fail the test as well */
+            if (prim_id - m_first >= m_count) {
+                uint32_t mesh_idx;
+                m_accel.resolvePrimitive(prim_id, mesh_idx, triangle_idx);
+                m_first = m_accel.m_prim_offsets[mesh_idx];
+                m_count = m_accel.m_prim_offsets[mesh_idx + 1] - m_first;
+                m_mesh = m_accel.m_meshes[mesh_idx];
+            }
+            triangle_idx = prim_id - m_first;
+            return m_mesh;
+        }
+
+    private:
+        const Accel& m_accel;
+        uint32_t m_first = 0;           ///< Global id of the first triangle of the current mesh
+        uint32_t m_count = 0;           ///< Triangle count of the current mesh
+        const Mesh* m_mesh = nullptr;   ///< Mesh of the previous id
+    };
+
     /**
      * \brief Intersect a ray against all triangles stored in the scene and
      * return detailed intersection information
@@ -89,23 +137,105 @@ public:
      */
     bool rayIntersect(const Ray3f& ray, Intersection& its, bool shadowRay) const;
 
-private:
-    Node* buildRecursive(const BoundingBox3f& bbox, std::vector<uint32_t>& triangle_indices,
-        std::vector<uint32_t>& mesh_indices, uint32_t recursion_depth);
-    bool traverseRecursive(const Node& node, Ray3f& ray, Intersection& its, bool shadowRay, uint32_t& hit_idx) const;
-    static void subdivideBBox(const BoundingBox3f& parent, BoundingBox3f* bboxes);
+    /**
+     * \brief Find the closest triangle along a ray without computing any
+     * surface information
+     *
+     * Only fills in the minimal hit record; pass it to
+     * \ref computeSurfaceInteraction() if the full \ref Intersection is
+     * needed later.
+     *
+     * \return \c true if an intersection was found
+     */
+    bool rayIntersect(const Ray3f& ray, RayHit& hit) const;
+
+    /**
+     * \brief Fill in the surface information (position, texture
+     * coordinates, frames) of a hit found by this structure
+     */
+    virtual void computeSurfaceInteraction(const RayHit& hit, Intersection& its) const;
+
+    /// Largest number of rays traced together by \ref rayIntersectPacket()
+    static constexpr uint32_t MAX_PACKET_SIZE = 16;
+
+    /**
+     * \brief Find the closest intersections of a packet of up to
+     * \ref MAX_PACKET_SIZE rays
+     *
+     * Meant for coherent rays, such as the camera rays of neighboring
+     * pixels. \c hits[i] tells whether ray \c i hit the scene, in which
+     * case \c its[i] is filled in like by \ref rayIntersect(). The default
+     * implementation traces the rays one by one.
+     */
+    virtual void rayIntersectPacket(const Ray3f* rays, uint32_t count, Intersection* its, bool* hits) const;
+
+    /**
+     * \brief Find the closest intersections of a batch of (possibly
+     * incoherent) rays
+     *
+     * The rays are sorted by direction octant and then by the Morton code
+     * of their origin, and every thread traces contiguous runs of the
+     * sorted rays, so that consecutive queries touch similar parts of the
+     * hierarchy. The results are stored in the original order, like for
+     * \ref rayIntersectPacket().
+     */
+    void intersectBatch(const Ray3f* rays, size_t count, Intersection* its, bool* hits) const;
+
+    /**
+     * \brief Check whether any triangle blocks a ray segment
+     *
+     * This is the query behind shadow rays. The traversal stops at the
+     * first triangle it finds, visits children in no particular order and
+     * does not fill in an intersection record. Unless disabled with the
+     * <tt>occluderCache</tt> property, the triangle that blocked the last
+     * occluded ray of the calling thread is tested before the traversal,
+     * which usually succeeds for neighboring shadow rays.
+     */
+    bool occluded(const Ray3f& ray) const;
 
-    Mesh* m_meshes[MAX_NUM_MESHES]; ///< Meshes (up to MAX_NUM_MESHES meshes)
+    /**
+     * \brief Return the type of object (i.e. Mesh/BSDF/etc.)
+     * provided by this instance
+     * */
+    EClassType getClassType() const { return EAccel; }
+
+protected:
+    friend class TwoLevelAccel;
+
+    /**
+     * \brief Find the closest triangle along a ray (or any triangle for
+     * shadow rays)
+     *
+     * Implementations shorten \c ray.maxt as hits are found, and store the
+     * closest hit in \c hit.
+     */
+    virtual bool traverse(Ray3f& ray, RayHit& hit, bool shadowRay) const = 0;
+
+    /**
+     * \brief Find any triangle that blocks a ray segment and return it
+     * through \c occluder
+     *
+     * Only the mesh, triangle and instance of \c occluder are set. The
+     * default implementation runs \ref traverse() as a shadow ray query
+     * and does not report the triangle.
+     */
+    virtual bool traverseOccluded(const Ray3f& ray, RayHit& occluder) const;
+
+    /// Check whether a triangle reported by \ref traverseOccluded() blocks a ray
+    virtual bool testOccluder(const Ray3f& ray, const RayHit& occluder) const;
+
+    /// Recompute \ref m_bbox from the bounding boxes of the registered meshes
+    void updateBoundingBox();
+
+    /// Recompute \ref m_prim_offsets from the triangle counts of the registered meshes
+    void updatePrimitiveOffsets();
+
+    std::vector<Mesh*> m_meshes;    ///< Registered meshes
     BoundingBox3f m_bbox;           ///< Bounding box of the entire scene
-    Node* m_root = nullptr; ///< Root node of Octree
     uint32_t      m_num_meshes = 0; ///< number of meshes in accel
-
-    // only statistics
-    uint32_t m_num_nonempty_leaf_nodes = 0;
-    uint32_t m_num_leaf_nodes = 0;
-    uint32_t m_num_nodes = 0;
-    uint32_t m_recursion_depth = 0;
-    uint32_t m_num_triangles_saved = 0;
+    std::vector<uint32_t> m_prim_offsets; ///< Global id of the first triangle of every mesh, followed by the total
+    bool m_occluder_cache = true;   ///< Test the last occluder of each thread first
+    uint64_t m_id;                  ///< Unique identifier, tags the per-thread occluder cache
 };
 
 NORI_NAMESPACE_END
@@ -0,0 +1,50 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <nori/common.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Counts the heap allocations made by each thread
+ *
+ * Ray queries and \ref Integrator::Li() must not allocate: the render loop
+ * reports allocations made while tracing a sample, and the Student's
+ * t-test fails any scene whose integrator allocates.
+ *
+ * Counting is compiled into debug builds only (CMake defines
+ * <tt>NORI_COUNT_ALLOCATIONS</tt>). It replaces the global
+ * <tt>operator new</tt> and <tt>operator delete</tt>, so memory obtained
+ * directly through \c malloc (e.g. by Eigen for dynamically sized
+ * temporaries) is not seen. In other builds \ref local() always returns 0.
+ */
+struct AllocationCounter {
+#if defined(NORI_COUNT_ALLOCATIONS)
+    static constexpr bool enabled = true;
+#else
+    static constexpr bool enabled = false;
+#endif
+
+    /// Return the number of allocations made by the calling thread so far
+    static uint64_t local();
+};
+
+NORI_NAMESPACE_END
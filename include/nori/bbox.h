@@ -341,6 +341,7 @@ template <typename _PointType> struct TBoundingBox {
 
                 if (t1 > t2)
                     std::swap(t1, t2);
+                t2 *= 1 + 2 * roundingError(3);
 
                 nearT = std::max(t1, nearT);
                 farT = std::min(t2, farT);
@@ -371,6 +372,7 @@ template <typename _PointType> struct TBoundingBox {
 
                 if (t1 > t2)
                     std::swap(t1, t2);
+                t2 *= 1 + 2 * roundingError(3);
 
                 nearT = std::max(t1, nearT);
                 farT = std::min(t2, farT);
@@ -383,6 +385,39 @@ template <typename _PointType> struct TBoundingBox {
         return true;
     }
 
+    /**
+     * \brief Slab test against the ray segment [mint, maxt]
+     *
+     * Picks the near and far plane of every axis from the sign of the
+     * reciprocal direction, so that no special case is needed for zero
+     * direction components, and returns the distance at which the ray
+     * enters the box in \c nearT. Acceleration structures use it to cull
+     * nodes that lie behind the closest hit found so far.
+     *
+     * The exit distance is enlarged by its worst-case rounding error (see
+     * PBRT, section 3.9.2), so that rays grazing a vertex or edge on the
+     * boundary of the box can not miss it.
+     */
+    bool raySegmentIntersect(const Ray3f &ray, float &nearT) const {
+        float farT = ray.maxt;
+        nearT = ray.mint;
+
+        for (int i=0; i<3; i++) {
+            bool negative = ray.dRcp[i] < 0;
+            float t1 = ((negative ? max[i] : min[i]) - ray.o[i]) * ray.dRcp[i];
+            float t2 = ((negative ? min[i] : max[i]) - ray.o[i]) * ray.dRcp[i] * (1 + 2 * roundingError(3));
+
+            /* NaNs (an axis-parallel ray starting exactly on a slab
+               plane) fail both comparisons and are ignored */
+            if (t1 > nearT)
+                nearT = t1;
+            if (t2 < farT)
+                farT = t2;
+        }
+
+        return nearT <= farT;
+    }
+
     PointType min; ///< Component-wise minimum 
     PointType max; ///< Component-wise maximum 
 };
@@ -0,0 +1,378 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <nori/accel.h>
+#include <nori/mappedfile.h>
+#include <tbb/cache_aligned_allocator.h>
+#include <unordered_map>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Bounding volume hierarchy built with the binned surface area heuristic
+ *
+ * The builder follows "On fast Construction of SAH-based Bounding Volume
+ * Hierarchies" by Ingo Wald (2007): triangle centroids are sorted into a
+ * fixed number of bins along each axis, and the bin boundary with the lowest
+ * SAH cost becomes the split plane. The finished tree is stored as a flat
+ * array of nodes in depth-first order, where the first child of an interior
+ * node directly follows its parent.
+ *
+ * With <tt>spatialSplits</tt> enabled, the builder additionally considers
+ * spatial splits as in "Spatial Splits in Bounding Volume Hierarchies" by
+ * Stich et al. (2009): triangles straddling a split plane are clipped and
+ * referenced from both children, which pays off for long thin triangles
+ * whose boxes overlap badly. The total number of extra references is
+ * limited to <tt>duplicationBudget</tt> times the number of triangles, and
+ * spatial splits are only tried where the children of the best object
+ * split overlap by more than <tt>splitAlpha</tt> times the scene area.
+ *
+ * With <tt>fastBuild</tt> enabled, the SAH is not evaluated at all and a
+ * linear BVH is built instead, as in "Fast BVH Construction on GPUs" by
+ * Lauterbach et al. (2009): the triangle centroids are quantized to a
+ * 1024^3 grid and sorted by their Morton codes with a parallel radix sort,
+ * and every node is split where the highest differing bit of the codes
+ * in its range flips. This is much faster to build, but costs some
+ * traversal performance, which suits interactive previews.
+ *
+ * Packets of coherent rays (\ref rayIntersectPacket()) fetch every node
+ * once for the whole packet. A node is culled right away if an interval
+ * arithmetic test shows that no ray of the packet can hit it, and is
+ * otherwise entered as soon as one ray hits it; rays that missed an
+ * ancestor node are skipped below it, as in "Ray Tracing Deformable
+ * Scenes using Dynamic Bounding Volume Hierarchies" by Wald et al. (2007).
+ *
+ * \ref refit() updates the node bounds bottom-up for animated meshes.
+ * Subtrees whose surface area grew by more than <tt>rebuildThreshold</tt>
+ * times the growth of the whole scene since they were built are rebuilt
+ * with the SAH, while the rest of the tree is kept.
+ *
+ * If <tt>cacheDir</tt> is set, the finished hierarchy is written to a
+ * file in that directory, named after a hash of the vertex positions,
+ * the triangles and the build parameters. Later runs over the same
+ * geometry map that file and traverse the nodes straight from the
+ * mapping; they are only copied once \ref refit() has to modify them.
+ * Finding the file still hashes all vertices and indices once.
+ *
+ * The following properties can be set in the scene description:
+ * <tt>bins</tt> (bins per axis), <tt>maxLeafSize</tt>,
+ * <tt>traversalCost</tt>, <tt>intersectionCost</tt>,
+ * <tt>rebuildThreshold</tt>, <tt>spatialSplits</tt>,
+ * <tt>duplicationBudget</tt>, <tt>splitAlpha</tt>, <tt>fastBuild</tt>,
+ * <tt>cacheDir</tt> and <tt>occluderCache</tt>.
+ */
+class BVH : public Accel {
+public:
+    BVH(const PropertyList &props);
+
+    /// Build the hierarchy over all registered meshes
+    void build();
+
+    /// Refit the node bounds and rebuild degraded subtrees
+    void refit();
+
+    Accel* createBottomLevel() const { return new BVH(getProperties()); }
+
+    void rayIntersectPacket(const Ray3f* rays, uint32_t count, Intersection* its, bool* hits) const;
+
+    /// Return a human-readable summary of this instance
+    std::string toString() const;
+
+protected:
+    /// Return the build parameters of this instance as a property list
+    PropertyList getProperties() const;
+
+    bool traverse(Ray3f& ray, RayHit& hit, bool shadowRay) const;
+
+    bool traverseOccluded(const Ray3f& ray, RayHit& occluder) const;
+
+    /// Bounds of the origins, reciprocal directions and extents of the rays of a packet
+    struct PacketBounds {
+        Point3f o_min, o_max;
+        Vector3f rcp_min, rcp_max;
+        float mint, maxt;
+
+        /// Conservative test: \c false only if no ray of the packet can hit \c bbox
+        bool intersects(const BoundingBox3f& bbox) const {
+            float nearT = mint, farT = maxt;
+            for (int i = 0; i < 3; i++) {
+                /* Intervals of the distances to both slab planes. Products
+                   of zero and infinity are NaN and ignored by fmin/fmax */
+                float lo[2] = { bbox.min[i] - o_max[i], bbox.min[i] - o_min[i] };
+                float hi[2] = { bbox.max[i] - o_max[i], bbox.max[i] - o_min[i] };
+                bool negative = rcp_max[i] < 0;
+                const float* enter = negative ? hi : lo;
+                const float* exit = negative ? lo : hi;
+                float t1 = std::fmin(std::fmin(enter[0] * rcp_min[i], enter[0] * rcp_max[i]),
+                                     std::fmin(enter[1] * rcp_min[i], enter[1] * rcp_max[i]));
+                float t2 = std::fmax(std::fmax(exit[0] * rcp_min[i], exit[0] * rcp_max[i]),
+                                     std::fmax(exit[1] * rcp_min[i], exit[1] * rcp_max[i])) * (1 + 2 * roundingError(3));
+                if (t1 > nearT)
+                    nearT = t1;
+                if (t2 < farT)
+                    farT = t2;
+            }
+            return nearT <= farT;
+        }
+    };
+
+    /// Do the directions of all rays lie in the same octant?
+    static bool sameOctant(const Ray3f* rays, uint32_t count);
+
+    /**
+     * \brief Closest-hit traversal of a packet of rays whose direction
+     * components have the same signs
+     *
+     * Updates \c rays[i].maxt and \c hits[i] like \ref traverse()
+     */
+    void traversePacket(Ray3f* rays, uint32_t count, RayHit* hits) const;
+
+    /**
+     * \brief Intersect the triangle references [first, first + count)
+     *
+     * Updates \c ray.maxt and \c hit like \ref traverse(). For shadow rays
+     * it stops at the first hit.
+     */
+    bool intersectLeaf(uint32_t first, uint32_t count, Ray3f& ray, RayHit& hit, bool shadowRay) const {
+        bool foundIntersection = false;
+        PrimitiveCursor cursor(*this);
+        for (uint32_t i = first; i < first + count; ++i) {
+            float u, v, t;
+            uint32_t triangle_idx;
+            const Mesh* mesh = cursor.resolve(m_prim_id_data[i], triangle_idx);
+            if (mesh->rayIntersect(triangle_idx, ray, u, v, t) && t < ray.maxt) {
+                /* An intersection was found! Can terminate
+                   immediately if this is a shadow ray query */
+                if (shadowRay)
+                    return true;
+                ray.maxt = t;
+                hit.t = t;
+                hit.uv = Point2f(u, v);
+                hit.mesh = mesh;
+                hit.f = triangle_idx;
+                foundIntersection = true;
+            }
+        }
+        return foundIntersection;
+    }
+
+    /// Find any triangle among the references [first, first + count) that blocks a ray
+    bool occludedLeaf(uint32_t first, uint32_t count, const Ray3f& ray, RayHit& occluder) const {
+        PrimitiveCursor cursor(*this);
+        for (uint32_t i = first; i < first + count; ++i) {
+            float u, v, t;
+            uint32_t triangle_idx;
+            const Mesh* mesh = cursor.resolve(m_prim_id_data[i], triangle_idx);
+            if (mesh->rayIntersect(triangle_idx, ray, u, v, t)) {
+                occluder.mesh = mesh;
+                occluder.f = triangle_idx;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /// Maximum depth of the hierarchy (also the size of the traversal stack)
+    static constexpr uint32_t MAX_DEPTH = 64;
+    /// Maximum number of triangles in a leaf (the size of Node::num_triangles)
+    static constexpr uint32_t MAX_LEAF_TRIANGLES = 0xFFFF;
+    /// Maximum number of SAH bins per axis
+    static constexpr uint32_t MAX_BINS = 64;
+    /// Subtrees with more triangles than this are built as separate tasks
+    static constexpr uint32_t PARALLEL_BUILD_THRESHOLD = 4096;
+    /// Binning and partitioning of larger nodes is split across threads
+    static constexpr uint32_t PARALLEL_SPLIT_THRESHOLD = 65536;
+    /// Subtrees above this depth are refitted as separate tasks
+    static constexpr uint32_t PARALLEL_REFIT_DEPTH = 8;
+
+    /// Node of the flattened hierarchy (32 bytes, two per cache line)
+    struct alignas(32) Node {
+        BoundingBox3f bbox;     ///< Bounds of all triangles below this node
+        uint32_t offset;        ///< Leaf: first triangle reference, interior: index of the second child
+        uint16_t num_triangles; ///< Number of triangles (0 for interior nodes)
+        uint8_t  axis;          ///< Split axis of interior nodes
+        uint8_t  pad;
+
+        bool isLeaf() const { return num_triangles > 0; }
+    };
+    static_assert(sizeof(Node) == 32, "BVH nodes should be 32 bytes");
+
+    /// Triangle reference used during construction
+    struct PrimRef {
+        BoundingBox3f bbox;
+        Point3f centroid;
+        uint32_t prim_id;       ///< Global primitive id, see \ref resolvePrimitive()
+    };
+
+    /// Temporary tree node used during construction
+    struct BuildNode {
+        BoundingBox3f bbox;
+        std::unique_ptr<BuildNode> children[2];
+        uint32_t first = 0;
+        uint32_t num_triangles = 0;
+        uint32_t axis = 0;
+        std::vector<PrimRef> refs;  ///< References of a leaf built with spatial splits
+        bool spatial = false;       ///< Split with a spatial split
+        float sah_gain = 0.f;       ///< SAH cost saved by the spatial split (not normalized)
+    };
+
+    /// Best spatial split of a set of references
+    struct SpatialSplit {
+        int axis = -1;
+        float pos = 0.f;                ///< Position of the split plane
+        float cost = std::numeric_limits<float>::infinity(); ///< Sum of area times count of both sides
+        uint32_t num_left = 0, num_right = 0;
+    };
+
+    /// Best object split of a range of references, found by binning their centroids
+    struct ObjectSplit {
+        int axis = -1;                  ///< Split axis (-1 if no plane separates the centroids)
+        uint32_t bin = 0;               ///< Last bin of the left side
+        float cost = std::numeric_limits<float>::infinity(); ///< Sum of area times count of both sides
+        BoundingBox3f left_bbox, right_bbox;
+        Point3f min_val;
+        Vector3f scale;
+        uint32_t num_bins = 0;
+
+        uint32_t binIndex(const PrimRef& ref, int axis) const {
+            return std::min((uint32_t) ((ref.centroid[axis] - min_val[axis]) * scale[axis]), num_bins - 1);
+        }
+        bool isLeft(const PrimRef& ref) const { return binIndex(ref, axis) <= bin; }
+    };
+
+    ObjectSplit findObjectSplit(const std::vector<PrimRef>& refs, uint32_t begin, uint32_t end,
+        const BoundingBox3f& centroid_bbox) const;
+
+    BuildNode* buildRecursive(std::vector<PrimRef>& refs, uint32_t begin, uint32_t end, uint32_t depth) const;
+
+    /**
+     * \brief Build a subtree with object and spatial splits
+     *
+     * Consumes \c refs. \c budget is the number of extra references the
+     * subtree may create by splitting triangles.
+     */
+    BuildNode* buildSpatialRecursive(std::vector<PrimRef>& refs, uint32_t depth, uint32_t budget) const;
+
+    /// Build a linear BVH over \c refs (reordering them) from the Morton codes of their centroids
+    BuildNode* buildLinear(std::vector<PrimRef>& refs) const;
+
+    /// Build the subtree of the Morton-sorted references [begin, end)
+    BuildNode* buildLinearRecursive(const std::vector<PrimRef>& refs, const std::vector<uint32_t>& codes,
+        uint32_t begin, uint32_t end, uint32_t depth) const;
+
+    /// Find the best spatial split by binning clipped triangles along every axis
+    SpatialSplit findSpatialSplit(const std::vector<PrimRef>& refs, const BoundingBox3f& bbox) const;
+
+    /// Return the bounds of the part of a reference between the planes \c lo and \c hi along \c axis
+    BoundingBox3f clipReference(const PrimRef& ref, int axis, float lo, float hi) const;
+
+    /// Move the references of spatially split leaves into one list, in depth-first order
+    void gatherLeaves(BuildNode* node, std::vector<PrimRef>& refs, uint32_t& num_spatial_splits, float& sah_gain) const;
+
+    /// Append a build tree to \ref m_nodes, shifting its triangle references by \c ref_offset
+    uint32_t flatten(const BuildNode* node, uint32_t depth, uint32_t ref_offset = 0);
+
+    /// Recompute the bounds of a subtree from the current vertex positions
+    BoundingBox3f refitRecursive(uint32_t node_idx, uint32_t depth);
+
+    /// Collect the topmost subtrees (and their depths) that grew more than \c threshold since they were built
+    void findDegraded(uint32_t node_idx, uint32_t depth, float threshold,
+        std::vector<std::pair<uint32_t, uint32_t>>& degraded) const;
+
+    /// Copy a subtree of \c old_nodes to \ref m_nodes, replacing rebuilt subtrees by their new version
+    uint32_t relink(const std::vector<Node, tbb::cache_aligned_allocator<Node>>& old_nodes,
+        const std::vector<float>& old_areas, uint32_t old_idx, uint32_t depth,
+        const std::unordered_map<uint32_t, std::pair<BuildNode*, uint32_t>>& rebuilt);
+
+    /// Return the triangle reference range [first, end) below a node
+    void subtreeRange(uint32_t node_idx, uint32_t& first, uint32_t& end) const;
+
+    /// Compute the normalized SAH cost of the current hierarchy
+    float computeSAHCost() const;
+
+    /// Hash the geometry of all meshes and the build parameters into the key of the cache file
+    uint64_t computeCacheKey() const;
+
+    /// Return the path of the cache file for a key (relative directories start at the scene directory)
+    std::string cacheFilename(uint64_t key) const;
+
+    /// Load the hierarchy from a cache file, returns \c false if it is missing or does not match \c key
+    bool loadCache(const std::string& filename, uint64_t key);
+
+    /// Write the hierarchy to a cache file, failures only print a warning
+    void saveCache(const std::string& filename, uint64_t key) const;
+
+    /// Point the traversal at \ref m_nodes and \ref m_prim_ids
+    void mapArrays();
+
+    /// Copy a hierarchy mapped from a cache file into \ref m_nodes and \ref m_prim_ids, and release the file
+    void copyMappedArrays();
+
+    /// Compute the bounds of a range of references and of their centroids
+    static void computeBounds(const std::vector<PrimRef>& refs, uint32_t begin, uint32_t end,
+        BoundingBox3f& bbox, BoundingBox3f& centroid_bbox);
+
+    /**
+     * \brief Partition a range of references
+     *
+     * Returns the index of the first reference for which \c pred is false.
+     * Large ranges are partitioned stably in parallel. The choice only
+     * depends on the size of the range, so the result does not depend on
+     * the number of threads.
+     */
+    template <typename Predicate>
+    static uint32_t partition(std::vector<PrimRef>& refs, uint32_t begin, uint32_t end, const Predicate& pred);
+
+    /**
+     * \brief Sort keys by their bits [first_bit, first_bit + num_bits)
+     *
+     * Stable least significant digit radix sort with 8 bits per pass.
+     * Every pass counts the digits of fixed-size blocks in parallel and
+     * scatters the blocks in parallel afterwards.
+     */
+    static void radixSort(std::vector<uint64_t>& keys, int first_bit, int num_bits);
+
+    std::vector<Node, tbb::cache_aligned_allocator<Node>> m_nodes; ///< Flattened hierarchy, root at index 0
+    std::vector<uint32_t> m_prim_ids;         ///< Global primitive id of every leaf reference
+    std::vector<float> m_build_areas;         ///< Surface area of every node when it was built
+    std::unique_ptr<MappedFile> m_cache_file; ///< Cache file the hierarchy is mapped from (if any)
+    const Node* m_node_data = nullptr;        ///< Nodes used for traversal (\ref m_nodes or the cache file)
+    const uint32_t* m_prim_id_data = nullptr; ///< Primitive ids used for traversal (\ref m_prim_ids or the cache file)
+
+    uint32_t m_num_bins;        ///< Number of SAH bins per axis
+    uint32_t m_max_leaf_size;   ///< Nodes with more triangles are always split
+    float m_traversal_cost;     ///< SAH cost of visiting an interior node
+    float m_intersection_cost;  ///< SAH cost of a ray-triangle test
+    float m_rebuild_threshold;  ///< Relative growth of a subtree that triggers its rebuild
+    bool m_spatial_splits;      ///< Build with spatial splits (SBVH)
+    float m_duplication_budget; ///< Extra references allowed by spatial splits, relative to the triangle count
+    float m_split_alpha;        ///< Minimal child overlap (relative to the scene area) to try spatial splits
+    bool m_fast_build;          ///< Build a linear BVH from Morton codes instead of using the SAH
+    std::string m_cache_dir;    ///< Directory of the cache files (empty: no caching)
+
+    // only statistics
+    uint32_t m_num_nodes = 0;
+    uint32_t m_num_leaf_nodes = 0;
+    uint32_t m_max_leaf_triangles = 0;
+    uint32_t m_depth = 0;
+    float m_sah_cost = 0.f;
+};
+
+NORI_NAMESPACE_END
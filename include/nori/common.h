@@ -18,6 +18,7 @@
 #include <algorithm>
 #include <vector>
 #include <memory>
+#include <limits>
 #include <Eigen/Core>
 #include <stdint.h>
 #include <ImathPlatform.h>
@@ -35,9 +36,16 @@
 #define PLATFORM_WINDOWS
 #endif
 
-/* "Ray epsilon": relative error threshold for ray intersection computations */
+/* Small threshold for sampling computations. Rays do not need it: their origins
+   are offset by bounds on the floating point error, see Intersection::spawnRay() */
 #define Epsilon 1e-4f
 
+/* Unit roundoff of single precision floating point arithmetic */
+#define MachineEpsilon (std::numeric_limits<float>::epsilon() * 0.5f)
+
+/* Shadow rays stop this fraction short of their target point */
+#define ShadowEpsilon 1e-4f
+
 /* A few useful constants */
 #undef M_PI
 
@@ -114,6 +122,7 @@ class ImageBlock;
 class Integrator;
 class KDTree;
 class Emitter;
+class Instance;
 struct EmitterQueryRecord;
 class Mesh;
 class NoriObject;
@@ -132,6 +141,10 @@ using std::endl;
 typedef Eigen::Matrix<float,    Eigen::Dynamic, Eigen::Dynamic> MatrixXf;
 typedef Eigen::Matrix<uint32_t, Eigen::Dynamic, Eigen::Dynamic> MatrixXu;
 
+/// Read-only views of matrices stored elsewhere (e.g. in a memory mapped file)
+typedef Eigen::Map<const MatrixXf> MatrixXfMap;
+typedef Eigen::Map<const MatrixXu> MatrixXuMap;
+
 /// Simple exception class, which stores a human-readable error description
 class NoriException : public std::runtime_error {
 public:
@@ -176,6 +189,34 @@ extern std::string timeString(double time, bool precise = false);
 /// Convert a memory amount in bytes into a human-readable string
 extern std::string memString(size_t size, bool precise = false);
 
+/**
+ * \brief Compute a 64-bit hash of a block of memory
+ *
+ * Not a cryptographic hash; intended for detecting changed data. Hashes
+ * of several blocks can be chained by passing the previous result as \c seed.
+ */
+extern uint64_t hashBytes(const void *data, size_t size, uint64_t seed = 0);
+
+/// Insert two zero bits after each of the lower 10 bits of \c x
+inline uint32_t expandBits(uint32_t x) {
+    x = (x * 0x00010001u) & 0xFF0000FFu;
+    x = (x * 0x00000101u) & 0x0F00F00Fu;
+    x = (x * 0x00000011u) & 0xC30C30C3u;
+    x = (x * 0x00000005u) & 0x49249249u;
+    return x;
+}
+
+/**
+ * \brief Interleave the lower 10 bits of three grid coordinates into a
+ * 30 bit Morton code
+ *
+ * Bit <tt>3 * i + 2</tt> of the code is bit \c i of \c x, followed by
+ * the bits of \c y and \c z.
+ */
+inline uint32_t mortonCode(uint32_t x, uint32_t y, uint32_t z) {
+    return (expandBits(x) << 2) | (expandBits(y) << 1) | expandBits(z);
+}
+
 /// Measures associated with probability distributions
 enum EMeasure {
     EUnknownMeasure = 0,
@@ -221,6 +262,14 @@ inline float lerp(float t, float v1, float v2) {
     return ((float) 1 - t) * v1 + t * v2;
 }
 
+/**
+ * \brief Bound on the relative rounding error of \c n chained floating
+ * point operations (the gamma_n of Higham and PBRT)
+ */
+inline constexpr float roundingError(int n) {
+    return (n * MachineEpsilon) / (1 - n * MachineEpsilon);
+}
+
 /// Always-positive modulo operation
 inline int mod(int a, int b) {
     int r = a % b;
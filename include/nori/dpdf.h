@@ -38,6 +38,17 @@ public:
         m_cdf.reserve(nEntries+1);
     }
 
+    /**
+     * \brief Replace all entries by a precomputed cumulative distribution
+     *
+     * \c cdf holds the <tt>nEntries+1</tt> unnormalized running sums
+     * of the entries, starting with zero (as built by \ref append()).
+     */
+    void setCDF(const float *cdf, size_t nEntries) {
+        m_cdf.assign(cdf, cdf + nEntries + 1);
+        m_normalized = false;
+    }
+
     /// Append an entry with the specified discrete probability
     void append(float pdfValue) {
         m_cdf.push_back(m_cdf[m_cdf.size()-1] + pdfValue);
@@ -18,7 +18,7 @@ NORI_NAMESPACE_BEGIN
         Point3f shadingPoint, lightPoint;
         Normal3f shadingNormal, lightNormal;
 
-        EmitterQueryRecord(Point3f &sp, Point3f &lp, Normal3f &sn, Normal3f &ln) : shadingPoint(sp), lightPoint(lp),
+        EmitterQueryRecord(const Point3f &sp, const Point3f &lp, const Normal3f &sn, const Normal3f &ln) : shadingPoint(sp), lightPoint(lp),
                                                                                    shadingNormal(sn), lightNormal(ln) {}
 
     };
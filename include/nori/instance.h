@@ -0,0 +1,52 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <nori/object.h>
+#include <nori/transform.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Placement of a mesh in the scene
+ *
+ * Instances are declared as children of a mesh:
+ * <tt>&lt;instance&gt;&lt;transform name="toWorld"&gt;..&lt;/transform&gt;&lt;/instance&gt;</tt>.
+ * A mesh with instances is not rendered on its own; instead, each instance
+ * renders it with its \c toWorld transformation applied on top of the
+ * mesh geometry. All instances of a mesh share a single bottom-level
+ * acceleration structure (see \ref TwoLevelAccel).
+ */
+class Instance : public NoriObject {
+public:
+    Instance(const PropertyList &props);
+
+    /// Return the transformation from mesh space to world space
+    const Transform &getToWorld() const { return m_toWorld; }
+
+    /// Return a human-readable summary of this instance
+    std::string toString() const;
+
+    EClassType getClassType() const { return EInstance; }
+
+protected:
+    Transform m_toWorld;
+};
+
+NORI_NAMESPACE_END
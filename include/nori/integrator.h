@@ -33,7 +33,7 @@ public:
     virtual void preprocess(const Scene *scene) { }
 
     /**
-     * \brief Sample the incident radiance along a ray
+     * \brief Sample the incident radiance along a camera ray
      *
      * \param scene
      *    A pointer to the underlying scene
@@ -44,7 +44,26 @@ public:
      * \return
      *    A (usually) unbiased estimate of the radiance in this direction
      */
-    virtual Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray) const = 0;
+    virtual Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray) const {
+        Intersection its;
+        bool hit = scene->rayIntersect(ray, its, RayStats::EPrimaryRay);
+        return LiFromIntersection(scene, sampler, ray, hit ? &its : nullptr);
+    }
+
+    /**
+     * \brief Sample the incident radiance along a ray whose first
+     * intersection has already been found
+     *
+     * The renderer traces the camera rays of neighboring pixels together
+     * as a packet and continues every sample here; \ref Li() calls it
+     * after tracing a single ray.
+     *
+     * \param its
+     *    The first intersection along \c ray, or \c nullptr if the ray
+     *    left the scene
+     */
+    virtual Color3f LiFromIntersection(const Scene *scene, Sampler *sampler, const Ray3f &ray,
+        const Intersection *its) const = 0;
 
     /**
      * \brief Return the type of object (i.e. Mesh/BSDF/etc.) 
@@ -0,0 +1,65 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <nori/common.h>
+#if defined(PLATFORM_WINDOWS)
+#include <tbb/cache_aligned_allocator.h>
+#endif
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Read-only view of a whole file, memory mapped where supported
+ *
+ * Platforms without \c mmap() read the file into a buffer instead,
+ * which is aligned to a cache line like a mapping would be.
+ * By default pages are mapped for sequential access, since most loaders
+ * read files front to back.
+ */
+class MappedFile {
+public:
+    /// Map \c filename; check \ref isValid() for success
+    MappedFile(const std::string &filename, bool sequential = true);
+
+    ~MappedFile();
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    /// Was the file opened? (Empty files are valid, but have no data)
+    bool isValid() const { return m_valid; }
+
+    /// Return the file contents
+    const char *data() const { return m_data; }
+
+    /// Return the size of the file in bytes
+    size_t size() const { return m_size; }
+
+private:
+    const char *m_data = nullptr;
+    size_t m_size = 0;
+    bool m_valid = false;
+#if defined(PLATFORM_WINDOWS)
+    std::vector<char, tbb::cache_aligned_allocator<char>> m_buffer;
+#endif
+};
+
+NORI_NAMESPACE_END
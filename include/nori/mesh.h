@@ -34,9 +34,11 @@ struct Intersection {
     Frame geoFrame;
     /// Pointer to the associated mesh
     const Mesh *mesh;
+    /// Conservative bound on the floating point error of \ref p (per axis)
+    Vector3f pError;
 
     /// Create an uninitialized intersection record
-    Intersection() : mesh(nullptr) { }
+    Intersection() : mesh(nullptr), pError(Vector3f::Zero()) { }
 
     /// Transform a direction vector into the local shading frame
     Vector3f toLocal(const Vector3f &d) const {
@@ -48,12 +50,49 @@ struct Intersection {
         return shFrame.toWorld(d);
     }
 
+    /**
+     * \brief Ray leaving the surface into direction \c d
+     *
+     * The origin is pushed along the geometric normal just far enough
+     * that the rounding error of \ref p can not put it on the wrong side
+     * of the surface, so the ray never hits the triangle it starts from.
+     */
+    Ray3f spawnRay(const Vector3f &d) const;
+
+    /// Shadow ray from the surface towards \c target, stopping just short of it
+    Ray3f spawnRayTo(const Point3f &target) const;
+
     /// Return a human-readable summary of the intersection record
     std::string toString() const;
 
     bool hasHit() const { return mesh != nullptr; }
 };
 
+/**
+ * \brief Minimal record of a ray-triangle intersection
+ *
+ * This is what the traversal of an acceleration structure produces. The
+ * full \ref Intersection (position, texture coordinates and frames) is
+ * only computed on demand, see \ref Accel::computeSurfaceInteraction().
+ */
+struct RayHit {
+    /// Unoccluded distance along the ray
+    float t;
+    /// Barycentric coordinates of the intersection within the triangle
+    Point2f uv;
+    /// Index of the triangle within its mesh
+    uint32_t f;
+    /// Index of the mesh instance (two-level acceleration structures only)
+    uint32_t instance;
+    /// Pointer to the associated mesh
+    const Mesh *mesh;
+
+    /// Create an empty hit record
+    RayHit() : f(0), instance(0), mesh(nullptr) { }
+
+    bool hasHit() const { return mesh != nullptr; }
+};
+
 /**
  * \brief Triangle mesh
  *
@@ -71,10 +110,10 @@ public:
     virtual void activate();
 
     /// Return the total number of triangles in this shape
-    uint32_t getTriangleCount() const { return (uint32_t) m_F.cols(); }
+    uint32_t getTriangleCount() const { return (uint32_t) m_FMap.cols(); }
 
     /// Return the total number of vertices in this shape
-    uint32_t getVertexCount() const { return (uint32_t) m_V.cols(); }
+    uint32_t getVertexCount() const { return (uint32_t) m_VMap.cols(); }
 
 
     /// Return the surface area of mesh
@@ -96,8 +135,14 @@ public:
 
     /** \brief Ray-triangle intersection test
      *
-     * Uses the algorithm by Moeller and Trumbore discussed at
-     * <tt>http://www.acm.org/jgt/papers/MollerTrumbore97/code.html</tt>.
+     * Uses the watertight algorithm by Woop, Benthin and Wald ("Watertight
+     * Ray/Triangle Intersection", JCGT 2013): the vertices are moved into
+     * a space where the ray runs along the z axis, and the three 2D edge
+     * functions are evaluated there. Rays through a shared edge or vertex
+     * evaluate the same edge function for all adjacent triangles, so they
+     * can not slip through the mesh. Like in PBRT, edge functions that
+     * round to zero are recomputed in double precision, and hits closer
+     * than the error bound of \c t are rejected.
      *
      * Note that the test only applies to a single triangle in the mesh.
      * An acceleration data structure like \ref BVH is needed to search
@@ -121,17 +166,21 @@ public:
      */
     bool rayIntersect(uint32_t index, const Ray3f &ray, float &u, float &v, float &t) const;
 
+    /// Intersect a ray with the triangle (p0, p1, p2), see \ref rayIntersect()
+    static bool rayIntersect(const Point3f &p0, const Point3f &p1, const Point3f &p2,
+        const Ray3f &ray, float &u, float &v, float &t);
+
     /// Return a pointer to the vertex positions
-    const MatrixXf &getVertexPositions() const { return m_V; }
+    const MatrixXfMap &getVertexPositions() const { return m_VMap; }
 
     /// Return a pointer to the vertex normals (or \c nullptr if there are none)
-    const MatrixXf &getVertexNormals() const { return m_N; }
+    const MatrixXfMap &getVertexNormals() const { return m_NMap; }
 
     /// Return a pointer to the texture coordinates (or \c nullptr if there are none)
-    const MatrixXf &getVertexTexCoords() const { return m_UV; }
+    const MatrixXfMap &getVertexTexCoords() const { return m_UVMap; }
 
     /// Return a pointer to the triangle vertex index list
-    const MatrixXu &getIndices() const { return m_F; }
+    const MatrixXuMap &getIndices() const { return m_FMap; }
 
     /// Is this mesh an area emitter?
     bool isEmitter() const { return m_emitter != nullptr; }
@@ -145,9 +194,22 @@ public:
     /// Return a pointer to the BSDF associated with this mesh
     const BSDF *getBSDF() const { return m_bsdf; }
 
+    /// Return the instances of this mesh (empty if the mesh is placed directly)
+    const std::vector<Instance *> &getInstances() const { return m_instances; }
+
     /// Register a child object (e.g. a BSDF) with the mesh
     virtual void addChild(NoriObject *child);
 
+    /**
+     * \brief Switch to the vertex data of another animation frame
+     *
+     * The topology (faces) has to be the same in every frame.
+     *
+     * \return \c true if the vertex positions changed, \c false if the
+     *    mesh is not animated or already shows this frame
+     */
+    bool setFrame(int frame);
+
     /// Return the name of this mesh
     const std::string &getName() const { return m_name; }
 
@@ -179,14 +241,43 @@ protected:
     /// Create an empty mesh
     Mesh();
 
+    /**
+     * \brief Load the vertex data of an animation frame
+     *
+     * Mesh formats that support animation override this; the default
+     * implementation returns \c false (not animated).
+     */
+    virtual bool loadFrame(int /*frame*/) { return false; }
+
+    /// Compute the area distribution used to sample emitting meshes
+    virtual void computeEmitterPDF();
+
+    /// Render from \c m_V, \c m_N, \c m_UV and \c m_F (loaders call this after filling them)
+    void mapArrays();
+
+    /**
+     * \brief Render from arrays stored elsewhere, e.g. in a memory mapped file
+     *
+     * The arrays are column-major like the matrices (3 floats per vertex
+     * position and normal, 2 per texture coordinate, 3 indices per face)
+     * and must outlive the mesh. \c N and \c UV may be \c nullptr.
+     */
+    void mapArrays(const float *V, const float *N, const float *UV, const uint32_t *F,
+                   uint32_t vertexCount, uint32_t triangleCount);
+
 protected:
     std::string m_name;                  ///< Identifying name
     MatrixXf m_V;                   ///< Vertex positions
     MatrixXf m_N;                   ///< Vertex normals
     MatrixXf m_UV;                  ///< Vertex texture coordinates
     MatrixXu      m_F;                   ///< Faces
+    MatrixXfMap m_VMap{nullptr, 3, 0};   ///< Vertex positions used for rendering
+    MatrixXfMap m_NMap{nullptr, 3, 0};   ///< Vertex normals used for rendering
+    MatrixXfMap m_UVMap{nullptr, 2, 0};  ///< Vertex texture coordinates used for rendering
+    MatrixXuMap m_FMap{nullptr, 3, 0};   ///< Faces used for rendering
     BSDF         *m_bsdf = nullptr;      ///< BSDF of the surface
     Emitter    *m_emitter = nullptr;     ///< Associated emitter, if any
+    std::vector<Instance *> m_instances; ///< Instances sharing this geometry
     BoundingBox3f m_bbox;                ///< Bounding box of the mesh
     DiscretePDF dpdf;               ///mesh pdf for sampling
 };
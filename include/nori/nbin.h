@@ -0,0 +1,23 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+*/
+
+#pragma once
+
+#include <nori/mesh.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Store a mesh in the binary "nbin" format
+ *
+ * The file holds the vertex positions, normals, texture coordinates,
+ * faces and the triangle area distribution as little-endian arrays, so
+ * that the \c nbin mesh can map them into memory instead of loading them.
+ * Throws a \ref NoriException if the file cannot be written.
+ */
+extern void writeNBin(const Mesh *mesh, const std::string &filename);
+
+NORI_NAMESPACE_END
@@ -30,6 +30,8 @@ public:
         ESampler,
         ETest,
         EReconstructionFilter,
+        EAccel,
+        EInstance,
         EClassTypeCount
     };
 
@@ -86,6 +88,8 @@ public:
             case EIntegrator: return "integrator";
             case ESampler:    return "sampler";
             case ETest:       return "test";
+            case EAccel:      return "accel";
+            case EInstance:   return "instance";
             default:          return "<unknown>";
         }
     }
@@ -34,12 +34,12 @@ template <typename _PointType, typename _VectorType> struct TRay {
     Scalar maxt;     ///< Maximum position on the ray segment
 
     /// Construct a new ray
-    TRay() : mint(Epsilon), 
+    TRay() : mint(0), 
         maxt(std::numeric_limits<Scalar>::infinity()) { }
     
     /// Construct a new ray
     TRay(const PointType &o, const VectorType &d) : o(o), d(d), 
-            mint(Epsilon), maxt(std::numeric_limits<Scalar>::infinity()) {
+            mint(0), maxt(std::numeric_limits<Scalar>::infinity()) {
         update();
     }
 
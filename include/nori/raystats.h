@@ -0,0 +1,92 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <nori/common.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Counters of the ray queries traced by one thread
+ *
+ * Counting is only compiled in when Nori is configured with
+ * <tt>-DNORI_RAY_STATS=ON</tt>; otherwise every \ref NORI_STAT() update
+ * compiles to nothing. Each thread counts into its own record, so the
+ * updates need no synchronization; \ref total() sums the records of all
+ * threads and must only be called while no rays are traced.
+ */
+struct RayStats {
+    /// Kind of a ray query, as seen by the \ref Scene
+    enum ERayType {
+        EPrimaryRay = 0,    ///< Camera rays
+        EShadowRay,         ///< Occlusion queries
+        EIndirectRay,       ///< All other closest hit queries
+        ERayTypeCount
+    };
+
+#if defined(NORI_RAY_STATS)
+    static constexpr bool enabled = true;
+#else
+    static constexpr bool enabled = false;
+#endif
+
+    uint64_t rays[ERayTypeCount] = {};  ///< Number of traced rays per type
+    uint64_t nodes_visited = 0;         ///< Hierarchy nodes fetched by the traversal
+    uint64_t box_tests = 0;             ///< Ray-box tests
+    uint64_t triangle_tests = 0;        ///< Ray-triangle tests
+
+    /// Return the counters of the calling thread
+    static RayStats& local() {
+        static thread_local RayStats* stats = nullptr;
+        if (!stats)
+            stats = registerThread();
+        return *stats;
+    }
+
+    /// Return the traversal cost counted by the calling thread so far, as shown by the heatmap
+    static uint64_t localCost() {
+        if (!enabled)
+            return 0;
+        const RayStats& stats = local();
+        return stats.nodes_visited + stats.triangle_tests;
+    }
+
+    /// Return the sum of the counters of all threads
+    static RayStats total();
+
+    /// Reset the counters of all threads
+    static void reset();
+
+    /// Return a human-readable summary
+    std::string toString() const;
+
+private:
+    /// Allocate the record of the calling thread
+    static RayStats* registerThread();
+};
+
+#if defined(NORI_RAY_STATS)
+/// Add \c value to a counter of the calling thread (only with NORI_RAY_STATS)
+#define NORI_STAT(counter, value) (RayStats::local().counter += (value))
+#else
+#define NORI_STAT(counter, value) ((void) 0)
+#endif
+
+NORI_NAMESPACE_END
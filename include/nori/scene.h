@@ -25,7 +25,7 @@ public:
     /// Release all memory
     virtual ~Scene();
 
-    /// Return a pointer to the scene's kd-tree
+    /// Return a pointer to the scene's acceleration data structure
     const Accel *getAccel() const { return m_accel; }
 
     /// Return a pointer to the scene's integrator
@@ -61,12 +61,38 @@ public:
      *    A detailed intersection record, which will be filled by the
      *    intersection query
      *
+     * \param type
+     *    The kind of ray, as counted by the ray statistics
+     *
      * \return \c true if an intersection was found
      */
-    bool rayIntersect(const Ray3f &ray, Intersection &its) const {
+    bool rayIntersect(const Ray3f &ray, Intersection &its,
+            RayStats::ERayType type = RayStats::EIndirectRay) const {
+        NORI_STAT(rays[type], 1);
         return m_accel->rayIntersect(ray, its, false);
     }
 
+    /**
+     * \brief Find the closest triangle along a ray without computing the
+     * surface information
+     *
+     * This is cheaper than the variant returning an \ref Intersection
+     * when only the distance or the hit mesh is needed. The full record
+     * can be obtained later with \ref computeSurfaceInteraction().
+     *
+     * \return \c true if an intersection was found
+     */
+    bool rayIntersect(const Ray3f &ray, RayHit &hit,
+            RayStats::ERayType type = RayStats::EIndirectRay) const {
+        NORI_STAT(rays[type], 1);
+        return m_accel->rayIntersect(ray, hit);
+    }
+
+    /// Compute the detailed intersection information of a hit found by \ref rayIntersect()
+    void computeSurfaceInteraction(const RayHit &hit, Intersection &its) const {
+        m_accel->computeSurfaceInteraction(hit, its);
+    }
+
     /**
      * \brief Intersect a ray against all triangles stored in the scene
      * and \a only determine whether or not there is an intersection.
@@ -83,8 +109,33 @@ public:
      * \return \c true if an intersection was found
      */
     bool rayIntersect(const Ray3f &ray) const {
-        Intersection its; /* Unused */
-        return m_accel->rayIntersect(ray, its, true);
+        NORI_STAT(rays[RayStats::EShadowRay], 1);
+        return m_accel->occluded(ray);
+    }
+
+    /**
+     * \brief Intersect a packet of up to \ref Accel::MAX_PACKET_SIZE
+     * coherent rays against all triangles stored in the scene
+     *
+     * \c hits[i] tells whether ray \c i hit the scene, in which case
+     * \c its[i] contains the detailed intersection information
+     */
+    void rayIntersectPacket(const Ray3f *rays, uint32_t count, Intersection *its, bool *hits) const {
+        NORI_STAT(rays[RayStats::EPrimaryRay], count);
+        m_accel->rayIntersectPacket(rays, count, its, hits);
+    }
+
+    /**
+     * \brief Intersect a batch of (possibly incoherent) rays against all
+     * triangles stored in the scene
+     *
+     * The rays are reordered internally for better memory locality, the
+     * results are returned in the original order (see
+     * \ref Accel::intersectBatch())
+     */
+    void intersectBatch(const Ray3f *rays, size_t count, Intersection *its, bool *hits) const {
+        NORI_STAT(rays[RayStats::EIndirectRay], count);
+        m_accel->intersectBatch(rays, count, its, hits);
     }
 
     /// \brief Return an axis-aligned box that bounds the scene
@@ -95,11 +146,19 @@ public:
     /**
      * \brief Inherited from \ref NoriObject::activate()
      *
-     * Initializes the internal data structures (kd-tree,
+     * Initializes the internal data structures (acceleration structure,
      * emitter sampling data structures, etc.)
      */
     void activate();
 
+    /**
+     * \brief Switch all animated meshes to the given frame
+     *
+     * Instead of rebuilding it, the acceleration data structure is
+     * refitted to the new vertex positions (see \ref Accel::refit()).
+     */
+    void setFrame(int frame);
+
     /// Add a child object to the scene (meshes, integrators etc.)
     void addChild(NoriObject *obj);
 
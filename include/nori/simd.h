@@ -0,0 +1,228 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <nori/common.h>
+#include <cmath>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#  include <immintrin.h>
+#  define NORI_SSE 1
+#endif
+
+/* AVX code can be compiled on every x86 target. Unless the whole build
+   targets AVX, it is confined to functions marked with NORI_TARGET_AVX
+   and must only run after a runtime check (see widebvh_avx.cpp) */
+#if defined(NORI_SSE)
+#  define NORI_AVX 1
+#  if defined(__AVX__) || defined(_MSC_VER)
+#    define NORI_TARGET_AVX
+#  else
+#    define NORI_TARGET_AVX __attribute__((target("avx")))
+#  endif
+#endif
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+#  include <arm_neon.h>
+#  define NORI_NEON 1
+#endif
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Minimal N-wide float vector used by the SIMD ray queries
+ *
+ * The generic version is a plain array (which compilers can often
+ * auto-vectorize). Specializations map 4-wide vectors to SSE or NEON.
+ * The AVX version of 8-wide vectors is the separate type \ref FloatAVX,
+ * so that code using it can be compiled next to the portable version.
+ *
+ * \c min and \c max follow the SSE convention and return the second
+ * argument if either argument is NaN. Comparisons return a bit mask with
+ * one bit per lane.
+ */
+template <int N> struct FloatN {
+    float v[N];
+
+    FloatN() { }
+    explicit FloatN(float f) { for (int i = 0; i < N; ++i) v[i] = f; }
+
+    static FloatN load(const float *p) {
+        FloatN r;
+        for (int i = 0; i < N; ++i) r.v[i] = p[i];
+        return r;
+    }
+
+    /// Load N unsigned bytes and convert them to floats
+    static FloatN loadBytes(const uint8_t *p) {
+        FloatN r;
+        for (int i = 0; i < N; ++i) r.v[i] = (float) p[i];
+        return r;
+    }
+
+    void store(float *p) const { for (int i = 0; i < N; ++i) p[i] = v[i]; }
+
+#define NORI_FLOATN_OP(op) \
+    friend FloatN operator op(const FloatN &a, const FloatN &b) { \
+        FloatN r; \
+        for (int i = 0; i < N; ++i) r.v[i] = a.v[i] op b.v[i]; \
+        return r; \
+    }
+    NORI_FLOATN_OP(+) NORI_FLOATN_OP(-) NORI_FLOATN_OP(*) NORI_FLOATN_OP(/)
+#undef NORI_FLOATN_OP
+
+    friend FloatN min(const FloatN &a, const FloatN &b) {
+        FloatN r;
+        for (int i = 0; i < N; ++i) r.v[i] = a.v[i] < b.v[i] ? a.v[i] : b.v[i];
+        return r;
+    }
+
+    friend FloatN max(const FloatN &a, const FloatN &b) {
+        FloatN r;
+        for (int i = 0; i < N; ++i) r.v[i] = a.v[i] > b.v[i] ? a.v[i] : b.v[i];
+        return r;
+    }
+
+    friend FloatN abs(const FloatN &a) {
+        FloatN r;
+        for (int i = 0; i < N; ++i) r.v[i] = std::abs(a.v[i]);
+        return r;
+    }
+
+#define NORI_FLOATN_CMP(name, op) \
+    friend int name(const FloatN &a, const FloatN &b) { \
+        int mask = 0; \
+        for (int i = 0; i < N; ++i) mask |= (a.v[i] op b.v[i]) ? (1 << i) : 0; \
+        return mask; \
+    }
+    NORI_FLOATN_CMP(lessThan, <) NORI_FLOATN_CMP(lessEqual, <=)
+    NORI_FLOATN_CMP(greaterThan, >) NORI_FLOATN_CMP(greaterEqual, >=)
+#undef NORI_FLOATN_CMP
+};
+
+#if defined(NORI_SSE)
+template <> struct FloatN<4> {
+    __m128 v;
+
+    FloatN() { }
+    FloatN(__m128 v) : v(v) { }
+    explicit FloatN(float f) : v(_mm_set1_ps(f)) { }
+
+    static FloatN load(const float *p) { return _mm_loadu_ps(p); }
+    static FloatN loadBytes(const uint8_t *p) {
+        int32_t bytes;
+        memcpy(&bytes, p, sizeof(bytes));
+        const __m128i zero = _mm_setzero_si128();
+        __m128i words = _mm_unpacklo_epi8(_mm_cvtsi32_si128(bytes), zero);
+        return _mm_cvtepi32_ps(_mm_unpacklo_epi16(words, zero));
+    }
+    void store(float *p) const { _mm_storeu_ps(p, v); }
+
+    friend FloatN operator+(const FloatN &a, const FloatN &b) { return _mm_add_ps(a.v, b.v); }
+    friend FloatN operator-(const FloatN &a, const FloatN &b) { return _mm_sub_ps(a.v, b.v); }
+    friend FloatN operator*(const FloatN &a, const FloatN &b) { return _mm_mul_ps(a.v, b.v); }
+    friend FloatN operator/(const FloatN &a, const FloatN &b) { return _mm_div_ps(a.v, b.v); }
+    friend FloatN min(const FloatN &a, const FloatN &b) { return _mm_min_ps(a.v, b.v); }
+    friend FloatN max(const FloatN &a, const FloatN &b) { return _mm_max_ps(a.v, b.v); }
+    friend FloatN abs(const FloatN &a) { return _mm_andnot_ps(_mm_set1_ps(-0.f), a.v); }
+
+    friend int lessThan(const FloatN &a, const FloatN &b) { return _mm_movemask_ps(_mm_cmplt_ps(a.v, b.v)); }
+    friend int lessEqual(const FloatN &a, const FloatN &b) { return _mm_movemask_ps(_mm_cmple_ps(a.v, b.v)); }
+    friend int greaterThan(const FloatN &a, const FloatN &b) { return _mm_movemask_ps(_mm_cmpgt_ps(a.v, b.v)); }
+    friend int greaterEqual(const FloatN &a, const FloatN &b) { return _mm_movemask_ps(_mm_cmpge_ps(a.v, b.v)); }
+};
+#elif defined(NORI_NEON)
+template <> struct FloatN<4> {
+    float32x4_t v;
+
+    FloatN() { }
+    FloatN(float32x4_t v) : v(v) { }
+    explicit FloatN(float f) : v(vdupq_n_f32(f)) { }
+
+    static FloatN load(const float *p) { return vld1q_f32(p); }
+    static FloatN loadBytes(const uint8_t *p) {
+        uint32_t bytes;
+        memcpy(&bytes, p, sizeof(bytes));
+        uint16x8_t words = vmovl_u8(vreinterpret_u8_u32(vdup_n_u32(bytes)));
+        return vcvtq_f32_u32(vmovl_u16(vget_low_u16(words)));
+    }
+    void store(float *p) const { vst1q_f32(p, v); }
+
+    friend FloatN operator+(const FloatN &a, const FloatN &b) { return vaddq_f32(a.v, b.v); }
+    friend FloatN operator-(const FloatN &a, const FloatN &b) { return vsubq_f32(a.v, b.v); }
+    friend FloatN operator*(const FloatN &a, const FloatN &b) { return vmulq_f32(a.v, b.v); }
+    friend FloatN operator/(const FloatN &a, const FloatN &b) { return vdivq_f32(a.v, b.v); }
+    /* Select explicitly instead of vminq/vmaxq, which propagate NaNs */
+    friend FloatN min(const FloatN &a, const FloatN &b) { return vbslq_f32(vcltq_f32(a.v, b.v), a.v, b.v); }
+    friend FloatN max(const FloatN &a, const FloatN &b) { return vbslq_f32(vcgtq_f32(a.v, b.v), a.v, b.v); }
+    friend FloatN abs(const FloatN &a) { return vabsq_f32(a.v); }
+
+    static int movemask(uint32x4_t m) {
+        static const int32_t shifts[4] = { 0, 1, 2, 3 };
+        return (int) vaddvq_u32(vshlq_u32(vshrq_n_u32(m, 31), vld1q_s32(shifts)));
+    }
+    friend int lessThan(const FloatN &a, const FloatN &b) { return movemask(vcltq_f32(a.v, b.v)); }
+    friend int lessEqual(const FloatN &a, const FloatN &b) { return movemask(vcleq_f32(a.v, b.v)); }
+    friend int greaterThan(const FloatN &a, const FloatN &b) { return movemask(vcgtq_f32(a.v, b.v)); }
+    friend int greaterEqual(const FloatN &a, const FloatN &b) { return movemask(vcgeq_f32(a.v, b.v)); }
+};
+#endif
+
+#if defined(NORI_AVX)
+/**
+ * \brief 8-wide float vector using AVX, with the interface of \ref FloatAVX
+ *
+ * All functions are compiled for AVX, even if the rest of the build is
+ * not, and must only be called on CPUs that support it.
+ */
+struct FloatAVX {
+    __m256 v;
+
+    NORI_TARGET_AVX FloatAVX() { }
+    NORI_TARGET_AVX FloatAVX(__m256 v) : v(v) { }
+    NORI_TARGET_AVX explicit FloatAVX(float f) : v(_mm256_set1_ps(f)) { }
+
+    NORI_TARGET_AVX static FloatAVX load(const float *p) { return _mm256_loadu_ps(p); }
+    NORI_TARGET_AVX static FloatAVX loadBytes(const uint8_t *p) {
+        /* Widen with SSE2, AVX alone has no 256 bit integer unpacks */
+        const __m128i zero = _mm_setzero_si128();
+        __m128i words = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) p), zero);
+        __m128 lo = _mm_cvtepi32_ps(_mm_unpacklo_epi16(words, zero));
+        __m128 hi = _mm_cvtepi32_ps(_mm_unpackhi_epi16(words, zero));
+        return _mm256_insertf128_ps(_mm256_castps128_ps256(lo), hi, 1);
+    }
+    NORI_TARGET_AVX void store(float *p) const { _mm256_storeu_ps(p, v); }
+
+    friend NORI_TARGET_AVX FloatAVX operator+(const FloatAVX &a, const FloatAVX &b) { return _mm256_add_ps(a.v, b.v); }
+    friend NORI_TARGET_AVX FloatAVX operator-(const FloatAVX &a, const FloatAVX &b) { return _mm256_sub_ps(a.v, b.v); }
+    friend NORI_TARGET_AVX FloatAVX operator*(const FloatAVX &a, const FloatAVX &b) { return _mm256_mul_ps(a.v, b.v); }
+    friend NORI_TARGET_AVX FloatAVX operator/(const FloatAVX &a, const FloatAVX &b) { return _mm256_div_ps(a.v, b.v); }
+    friend NORI_TARGET_AVX FloatAVX min(const FloatAVX &a, const FloatAVX &b) { return _mm256_min_ps(a.v, b.v); }
+    friend NORI_TARGET_AVX FloatAVX max(const FloatAVX &a, const FloatAVX &b) { return _mm256_max_ps(a.v, b.v); }
+    friend NORI_TARGET_AVX FloatAVX abs(const FloatAVX &a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.f), a.v); }
+
+    friend NORI_TARGET_AVX int lessThan(const FloatAVX &a, const FloatAVX &b) { return _mm256_movemask_ps(_mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ)); }
+    friend NORI_TARGET_AVX int lessEqual(const FloatAVX &a, const FloatAVX &b) { return _mm256_movemask_ps(_mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ)); }
+    friend NORI_TARGET_AVX int greaterThan(const FloatAVX &a, const FloatAVX &b) { return _mm256_movemask_ps(_mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ)); }
+    friend NORI_TARGET_AVX int greaterEqual(const FloatAVX &a, const FloatAVX &b) { return _mm256_movemask_ps(_mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ)); }
+};
+#endif
+
+NORI_NAMESPACE_END
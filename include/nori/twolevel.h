@@ -0,0 +1,111 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <nori/accel.h>
+#include <tbb/cache_aligned_allocator.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Two-level acceleration structure for instanced geometry
+ *
+ * The bottom level consists of one acceleration structure per unique
+ * piece of geometry, which any number of instances refer to together with
+ * a transformation. Memory therefore grows with the amount of unique
+ * geometry instead of the number of instances, and every bottom-level
+ * structure is built only once. The top level is a small BVH over the
+ * world-space bounds of all instances; rays that reach an instance are
+ * transformed into its local space and traverse the shared structure.
+ *
+ * The scene creates this structure automatically as soon as a mesh
+ * contains <tt>&lt;instance&gt;</tt> tags (see \ref Instance).
+ */
+class TwoLevelAccel : public Accel {
+public:
+    /**
+     * \brief Register a bottom-level acceleration structure and return its index
+     *
+     * The structure is built by \ref build() and owned by this instance.
+     */
+    uint32_t addBottomLevel(Accel* accel);
+
+    /// Place the bottom-level structure \c index in the scene using the given transformation
+    void addInstance(uint32_t index, const Transform& toWorld);
+
+    /// Build all bottom-level structures and the top-level hierarchy
+    void build();
+
+    /// Refit all bottom-level structures and rebuild the (small) top level
+    void refit();
+
+    Accel* createBottomLevel() const;
+
+    /// Compute the surface information in the local space of the instance and move it to world space
+    void computeSurfaceInteraction(const RayHit& hit, Intersection& its) const;
+
+    /// Return a human-readable summary of this instance
+    std::string toString() const;
+
+protected:
+    /// Closest-hit traversal, also records the instance that was hit in \c hit
+    bool traverse(Ray3f& ray, RayHit& hit, bool shadowRay) const;
+
+    bool traverseOccluded(const Ray3f& ray, RayHit& occluder) const;
+
+    /// Test the occluder in the local space of its instance
+    bool testOccluder(const Ray3f& ray, const RayHit& occluder) const;
+
+    /// Maximum depth of the top-level hierarchy (also the size of the traversal stack)
+    static constexpr uint32_t MAX_DEPTH = 64;
+    /// Maximum number of instances per top-level leaf
+    static constexpr uint32_t MAX_LEAF_SIZE = 2;
+
+    struct InstanceRecord {
+        Transform toWorld;      ///< Local to world space
+        Transform toLocal;      ///< World to local space
+        BoundingBox3f bbox;     ///< World-space bounds
+        uint32_t accel_idx;     ///< Index of the shared bottom-level structure
+    };
+
+    /// Node of the top-level hierarchy (same layout as \ref BVH::Node)
+    struct alignas(32) Node {
+        BoundingBox3f bbox;     ///< Bounds of all instances below this node
+        uint32_t offset;        ///< Leaf: first instance reference, interior: index of the second child
+        uint16_t num_instances; ///< Number of instances (0 for interior nodes)
+        uint8_t  axis;          ///< Split axis of interior nodes
+        uint8_t  pad;
+
+        bool isLeaf() const { return num_instances > 0; }
+    };
+
+    /// Build the top-level hierarchy over the current bounds of all instances
+    void buildTopLevel();
+
+    /// Build the subtree over m_instance_indices[begin, end) at node slot \c node_idx
+    void buildRecursive(uint32_t node_idx, uint32_t begin, uint32_t end, uint32_t depth);
+
+    std::vector<std::unique_ptr<Accel>> m_bottom_levels;
+    std::vector<InstanceRecord, tbb::cache_aligned_allocator<InstanceRecord>> m_instances;
+    std::vector<Node, tbb::cache_aligned_allocator<Node>> m_nodes;  ///< Top-level hierarchy, root at index 0
+    std::vector<uint32_t> m_instance_indices;                       ///< Instance of every leaf reference
+    uint32_t m_depth = 0;
+};
+
+NORI_NAMESPACE_END
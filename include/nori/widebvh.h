@@ -0,0 +1,1081 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <nori/bvh.h>
+#include <nori/simd.h>
+#include <tbb/parallel_for.h>
+#include <chrono>
+#include <cmath>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief N-wide BVH (QBVH/OBVH) with SIMD box tests
+ *
+ * Builds a binary SAH BVH first and then collapses it: every wide node
+ * pulls up to N children out of the binary tree by repeatedly opening the
+ * child with the largest surface area. The child boxes of a node are
+ * stored in SoA layout, so that one ray is tested against all of them
+ * with a single SIMD slab test. \c Float is the N-wide vector type of
+ * these tests (see \ref FloatN); bvh8 uses \ref FloatAVX instead on CPUs
+ * with AVX, which are detected at runtime (see widebvh_avx.cpp).
+ *
+ * With <tt>precomputeTriangles</tt> enabled, every leaf additionally keeps
+ * a copy of its triangles (the three vertices) packed N at a time in SoA
+ * layout. Leaves are then intersected with an N-wide version of the
+ * watertight test of \ref Mesh::rayIntersect() instead of gathering
+ * vertices through the mesh index buffers, at the cost of 36 bytes per triangle (rounded up to
+ * whole packets).
+ *
+ * Packets of coherent rays (\ref rayIntersectPacket()) fetch every node
+ * once: children that no ray of the packet can hit are culled with
+ * interval arithmetic, and every other child is entered with the first
+ * ray that hits it (see \ref traverseNodesPacket()).
+ *
+ * \ref refit() updates the wide nodes (and packets) in place. Unlike the
+ * binary BVH, degraded subtrees are not rebuilt individually: if the SAH
+ * cost of the whole tree grew by more than <tt>rebuildThreshold</tt>, the
+ * hierarchy is built from scratch.
+ *
+ * With <tt>compressNodes</tt> enabled, the nodes are stored quantized
+ * after the build: every child box is rounded outwards to 8 bits per
+ * plane on a power-of-two grid spanning the node, and the children of a
+ * node are laid out consecutively (interior nodes in breadth-first order,
+ * leaf triangles or packets in slot order) so that a node stores two base
+ * offsets instead of one index per slot. This shrinks a node by a factor
+ * of 3.2 (80 instead of 256 bytes). Only N = 8 supports it: the origin,
+ * exponents and base offsets take 24 bytes for any width, so a 4-wide
+ * node would only shrink from 128 to 52 bytes. This comes at the cost
+ * of decoding the boxes during traversal and of visiting a few more
+ * nodes because of the looser bounds. Compressed hierarchies cannot be
+ * refitted and are rebuilt instead.
+ */
+template <int N, typename Float = FloatN<N>> class WideBVH : public BVH {
+public:
+    WideBVH(const PropertyList &props) : BVH(props) {
+        m_precompute_triangles = props.getBoolean("precomputeTriangles", false);
+        m_compress_nodes = props.getBoolean("compressNodes", false);
+
+        if (m_compress_nodes && N < 8)
+            throw NoriException("BVH%i: compressed nodes are only supported by bvh8!", N);
+        if (m_compress_nodes && m_max_leaf_size > 0xFF)
+            throw NoriException("BVH%i: compressed nodes require a maximum leaf size of at most %i!", N, 0xFF);
+    }
+
+    Accel* createBottomLevel() const {
+        PropertyList props = getProperties();
+        props.setBoolean("precomputeTriangles", m_precompute_triangles);
+        props.setBoolean("compressNodes", m_compress_nodes);
+        return new WideBVH(props);
+    }
+
+    void build() {
+        BVH::build();
+        /* The binary nodes are collapsed and freed below, so a hierarchy mapped from the cache is copied first */
+        copyMappedArrays();
+
+        m_wide_nodes.clear();
+        m_compressed_nodes.clear();
+        m_packets.clear();
+        m_num_wide_leaves = 0;
+
+        if (!m_nodes.empty()) {
+            if (m_nodes[0].isLeaf()) {
+                /* Single leaf: wrap it in a root with one occupied slot */
+                addNode();
+                setChild(0, 0, m_nodes[0]);
+                m_num_wide_leaves++;
+            } else {
+                collapse(0);
+            }
+        }
+
+        /* The binary hierarchy is not needed for traversal anymore */
+        std::vector<BVH::Node, tbb::cache_aligned_allocator<BVH::Node>>().swap(m_nodes);
+        std::vector<float>().swap(m_build_areas);
+        mapArrays();
+        m_wide_sah_cost = computeWideSAHCost();
+
+        printf("BVH%d nodes: %d \n", N, (int) m_wide_nodes.size());
+        printf("BVH%d avg children per node: %f \n", N,
+            (float) (m_wide_nodes.size() - 1 + m_num_wide_leaves) / (float) std::max<size_t>(m_wide_nodes.size(), 1));
+        size_t index_memory = m_prim_ids.size() * sizeof(uint32_t);
+        if (m_compress_nodes) {
+            size_t wide_memory = m_wide_nodes.size() * sizeof(Node);
+            compress();
+            size_t compressed_memory = m_compressed_nodes.size() * sizeof(CompressedNode);
+            printf("BVH%d node memory: %s (compressed nodes: %s instead of %s, %.2fx smaller) \n", N,
+                memString(compressed_memory + index_memory).c_str(), memString(compressed_memory).c_str(),
+                memString(wide_memory).c_str(), (double) wide_memory / (double) std::max<size_t>(compressed_memory, 1));
+        } else {
+            printf("BVH%d node memory: %s \n", N, memString(m_wide_nodes.size() * sizeof(Node) + index_memory).c_str());
+        }
+        if (m_precompute_triangles)
+            printf("BVH%d precomputed triangle memory: %s (%d packets) \n", N,
+                memString(m_packets.size() * sizeof(TrianglePacket)).c_str(), (int) m_packets.size());
+        printf("BVH%d SAH cost: %f \n", N, m_wide_sah_cost);
+    }
+
+    void refit() {
+        updateBoundingBox();
+        updatePrimitiveOffsets();
+        if (m_wide_nodes.empty() || getPrimitiveCount() != m_prim_ids.size() || m_spatial_splits) {
+            /* The topology changed (or the leaves hold clipped references, or
+               the nodes were compressed), nothing to refit */
+            build();
+            return;
+        }
+
+        auto start = std::chrono::high_resolution_clock::now();
+
+        refitRecursive(0, 0);
+        float sah_cost = computeWideSAHCost();
+        if (sah_cost > m_rebuild_threshold * m_wide_sah_cost) {
+            printf("BVH%d SAH cost grew from %f to %f, rebuilding \n", N, m_wide_sah_cost, sah_cost);
+            build();
+            return;
+        }
+
+        printf("BVH%d refit time: %ldms \n", N, (long) std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::high_resolution_clock::now() - start).count());
+        printf("BVH%d SAH cost: %f \n", N, sah_cost);
+    }
+
+    std::string toString() const {
+        return tfm::format(
+            "BVH%i[\n"
+            "  bins = %i,\n"
+            "  maxLeafSize = %i,\n"
+            "  traversalCost = %f,\n"
+            "  intersectionCost = %f,\n"
+            "  rebuildThreshold = %f,\n"
+            "  precomputeTriangles = %s,\n"
+            "  compressNodes = %s\n"
+            "]",
+            N,
+            m_num_bins,
+            m_max_leaf_size,
+            m_traversal_cost,
+            m_intersection_cost,
+            m_rebuild_threshold,
+            m_precompute_triangles ? "true" : "false",
+            m_compress_nodes ? "true" : "false"
+        );
+    }
+
+protected:
+    /// Wide node with the child boxes in SoA layout
+    struct alignas(64) Node {
+        float lower[3][N];              ///< Minimum of every child box, per axis
+        float upper[3][N];              ///< Maximum of every child box, per axis
+        uint32_t child[N];              ///< Wide node index, or first triangle reference/packet of a leaf
+        uint16_t num_triangles[N];      ///< Number of triangles of a leaf child (0 for interior children)
+    };
+
+    /**
+     * \brief Wide node with quantized child boxes
+     *
+     * Plane \c q of a child box lies at <tt>origin + q * 2^(exponent - 127)</tt>.
+     * Interior children are stored consecutively from \c child_base, the
+     * triangle references (or packets) of the leaf children consecutively
+     * from \c triangle_base, both in slot order.
+     */
+    struct CompressedNode {
+        float origin[3];                ///< Lower corner of the quantization grid
+        uint8_t exponent[3];            ///< Biased exponent of the grid step, per axis
+        uint8_t interior_mask;          ///< Bit \c i is set if slot \c i holds an interior child
+        uint32_t child_base;            ///< Compressed node index of the first interior child
+        uint32_t triangle_base;         ///< First triangle reference or packet of the first leaf child
+        uint8_t num_triangles[N];       ///< Number of triangles of a leaf child (0 for interior children)
+        uint8_t lower[3][N];            ///< Quantized minimum of every child box, per axis
+        uint8_t upper[3][N];            ///< Quantized maximum of every child box, per axis
+
+        float scale(int axis) const {
+            uint32_t bits = (uint32_t) exponent[axis] << 23;
+            float result;
+            memcpy(&result, &bits, sizeof(result));
+            return result;
+        }
+    };
+
+    /// N triangles of a leaf, stored as their three vertices in SoA layout
+    struct alignas(32) TrianglePacket {
+        float p0[3][N];
+        float p1[3][N];
+        float p2[3][N];
+        uint32_t prim_id[N];            ///< Global primitive id of every lane
+    };
+
+    /// Copy the triangle references [first, first + count) into packets, return the first packet
+    uint32_t packTriangles(uint32_t first, uint32_t count) {
+        uint32_t first_packet = (uint32_t) m_packets.size();
+        for (uint32_t i = 0; i < count; i += N) {
+            /* Unused lanes keep degenerate (all-zero) triangles, which the
+               edge function test always rejects */
+            TrianglePacket packet = {};
+            for (uint32_t lane = 0; lane < N && i + lane < count; lane++) {
+                packet.prim_id[lane] = m_prim_ids[first + i + lane];
+                setLane(packet, lane);
+            }
+            m_packets.push_back(packet);
+        }
+        return first_packet;
+    }
+
+    /// Load the current vertex positions of the triangle in a packet lane, return its bounds
+    BoundingBox3f setLane(TrianglePacket& packet, uint32_t lane) const {
+        uint32_t mesh_idx, triangle_idx;
+        resolvePrimitive(packet.prim_id[lane], mesh_idx, triangle_idx);
+        const Mesh* mesh = m_meshes[mesh_idx];
+        const MatrixXfMap &V = mesh->getVertexPositions();
+        const MatrixXuMap &F = mesh->getIndices();
+        Point3f p0 = V.col(F(0, triangle_idx)), p1 = V.col(F(1, triangle_idx)), p2 = V.col(F(2, triangle_idx));
+        for (int axis = 0; axis < 3; axis++) {
+            packet.p0[axis][lane] = p0[axis];
+            packet.p1[axis][lane] = p1[axis];
+            packet.p2[axis][lane] = p2[axis];
+        }
+        BoundingBox3f bbox(p0);
+        bbox.expandBy(p1);
+        bbox.expandBy(p2);
+        return bbox;
+    }
+
+    /// Recompute the child boxes of a wide node and its subtree, return the node bounds
+    BoundingBox3f refitRecursive(uint32_t wide_idx, uint32_t depth) {
+        Node& node = m_wide_nodes[wide_idx];
+
+        auto refitChild = [&](int i) {
+            BoundingBox3f bbox;
+            if (node.num_triangles[i] > 0 && m_precompute_triangles) {
+                uint32_t count = node.num_triangles[i];
+                for (uint32_t p = node.child[i]; p < node.child[i] + (count + N - 1) / N; p++) {
+                    for (uint32_t lane = 0; lane < N && (p - node.child[i]) * N + lane < count; lane++)
+                        bbox.expandBy(setLane(m_packets[p], lane));
+                }
+            } else if (node.num_triangles[i] > 0) {
+                for (uint32_t ref = node.child[i]; ref < node.child[i] + node.num_triangles[i]; ref++) {
+                    uint32_t mesh_idx, triangle_idx;
+                    resolvePrimitive(m_prim_ids[ref], mesh_idx, triangle_idx);
+                    bbox.expandBy(m_meshes[mesh_idx]->getBoundingBox(triangle_idx));
+                }
+            } else if (node.child[i] != 0) {
+                bbox = refitRecursive(node.child[i], depth + 1);
+            } else {
+                return; /* Empty slot */
+            }
+            for (int axis = 0; axis < 3; axis++) {
+                node.lower[axis][i] = bbox.min[axis];
+                node.upper[axis][i] = bbox.max[axis];
+            }
+        };
+
+        if (depth < PARALLEL_REFIT_DEPTH / 2)
+            tbb::parallel_for(0, N, refitChild);
+        else
+            for (int i = 0; i < N; i++)
+                refitChild(i);
+
+        return childBounds(node);
+    }
+
+    /// Return the union of all child boxes of a wide node
+    static BoundingBox3f childBounds(const Node& node) {
+        BoundingBox3f bbox;
+        for (int i = 0; i < N; i++)
+            bbox.expandBy(BoundingBox3f(
+                Point3f(node.lower[0][i], node.lower[1][i], node.lower[2][i]),
+                Point3f(node.upper[0][i], node.upper[1][i], node.upper[2][i])));
+        return bbox;
+    }
+
+    /// Compute the normalized SAH cost of the wide hierarchy
+    float computeWideSAHCost() const {
+        if (m_wide_nodes.empty())
+            return 0.f;
+        float root_area = childBounds(m_wide_nodes[0]).getSurfaceArea();
+        float cost = m_traversal_cost * root_area;
+        for (const Node& node : m_wide_nodes) {
+            for (int i = 0; i < N; i++) {
+                if (node.num_triangles[i] == 0 && node.child[i] == 0)
+                    continue;
+                Vector3f extents(node.upper[0][i] - node.lower[0][i], node.upper[1][i] - node.lower[1][i],
+                    node.upper[2][i] - node.lower[2][i]);
+                float area = 2.f * (extents.x() * extents.y() + extents.y() * extents.z() + extents.z() * extents.x());
+                cost += (node.num_triangles[i] > 0 ? m_intersection_cost * node.num_triangles[i] : m_traversal_cost) * area;
+            }
+        }
+        return cost / root_area;
+    }
+
+    /// Quantize the child boxes of a wide node relative to their union
+    static void quantize(const Node& node, CompressedNode& compressed) {
+        BoundingBox3f bbox = childBounds(node);
+        for (int axis = 0; axis < 3; axis++) {
+            /* Smallest power of two step that covers the node with 255 steps */
+            float origin = bbox.min[axis];
+            int exponent;
+            std::frexp((bbox.max[axis] - origin) / 255.f, &exponent);
+            exponent = clamp(exponent, -126, 127);
+            while (exponent < 127 && origin + 255.f * std::ldexp(1.f, exponent) < bbox.max[axis])
+                exponent++;
+            float scale = std::ldexp(1.f, exponent);
+            compressed.origin[axis] = origin;
+            compressed.exponent[axis] = (uint8_t) (exponent + 127);
+
+            for (int i = 0; i < N; i++) {
+                if (node.num_triangles[i] == 0 && node.child[i] == 0) {
+                    /* Empty slots keep an inverted box, like in the full precision node */
+                    compressed.lower[axis][i] = 0xFF;
+                    compressed.upper[axis][i] = 0;
+                    continue;
+                }
+                /* Round outwards, so that the quantized box contains the child box */
+                int lo = clamp((int) std::floor((node.lower[axis][i] - origin) / scale), 0, 0xFF);
+                int hi = clamp((int) std::ceil((node.upper[axis][i] - origin) / scale), 0, 0xFF);
+                while (lo > 0 && origin + lo * scale > node.lower[axis][i])
+                    lo--;
+                while (hi < 0xFF && origin + hi * scale < node.upper[axis][i])
+                    hi++;
+                compressed.lower[axis][i] = (uint8_t) lo;
+                compressed.upper[axis][i] = (uint8_t) hi;
+            }
+        }
+    }
+
+    /// Replace the wide nodes by \ref m_compressed_nodes and reorder the leaves to match
+    void compress() {
+        if (m_wide_nodes.empty())
+            return;
+        /* Leaves forced at the maximum depth may exceed the maximum leaf size */
+        for (const Node& node : m_wide_nodes)
+            for (int i = 0; i < N; i++)
+                if (node.num_triangles[i] > 0xFF)
+                    throw NoriException("BVH%i: a leaf holds %i triangles, but compressed nodes support at most %i; "
+                        "disable compressNodes!", N, node.num_triangles[i], 0xFF);
+        m_compressed_nodes.resize(m_wide_nodes.size());
+        std::vector<uint32_t> wide_indices(m_wide_nodes.size());
+        std::vector<uint32_t> prim_ids;
+        std::vector<TrianglePacket, tbb::cache_aligned_allocator<TrianglePacket>> packets;
+        prim_ids.reserve(m_prim_ids.size());
+        packets.reserve(m_packets.size());
+
+        /* Breadth-first order keeps the interior children of every node next to each other */
+        uint32_t num_nodes = 1;
+        wide_indices[0] = 0;
+        for (uint32_t idx = 0; idx < num_nodes; idx++) {
+            const Node& node = m_wide_nodes[wide_indices[idx]];
+            CompressedNode& compressed = m_compressed_nodes[idx];
+            quantize(node, compressed);
+            compressed.interior_mask = 0;
+            compressed.child_base = num_nodes;
+            compressed.triangle_base = (uint32_t) (m_precompute_triangles ? packets.size() : prim_ids.size());
+
+            for (int i = 0; i < N; i++) {
+                uint32_t first = node.child[i], count = node.num_triangles[i];
+                compressed.num_triangles[i] = (uint8_t) count;
+                if (count > 0 && m_precompute_triangles) {
+                    packets.insert(packets.end(), m_packets.begin() + first, m_packets.begin() + first + (count + N - 1) / N);
+                } else if (count > 0) {
+                    prim_ids.insert(prim_ids.end(), m_prim_ids.begin() + first, m_prim_ids.begin() + first + count);
+                } else if (first != 0) {
+                    compressed.interior_mask |= (uint8_t) (1 << i);
+                    wide_indices[num_nodes++] = first;
+                }
+            }
+        }
+
+        if (m_precompute_triangles) {
+            m_packets.swap(packets);
+        } else {
+            m_prim_ids.swap(prim_ids);
+            mapArrays();
+        }
+        std::vector<Node, tbb::cache_aligned_allocator<Node>>().swap(m_wide_nodes);
+    }
+
+    /**
+     * \brief Intersect a ray with all child boxes of a wide node, narrowing [nearT, farT] per child
+     *
+     * Like \ref BoundingBox3f::raySegmentIntersect(), exit distances are
+     * enlarged by their rounding error so that no box is missed.
+     */
+    static void slabTest(const Node& node, const bool* negative, const Float* origin, const Float* rcp,
+        Float& nearT, Float& farT) {
+        const Float far_scale(1 + 2 * roundingError(3));
+        for (int axis = 0; axis < 3; axis++) {
+            const float* near_plane = negative[axis] ? node.upper[axis] : node.lower[axis];
+            const float* far_plane = negative[axis] ? node.lower[axis] : node.upper[axis];
+            nearT = max((Float::load(near_plane) - origin[axis]) * rcp[axis], nearT);
+            farT = min((Float::load(far_plane) - origin[axis]) * rcp[axis] * far_scale, farT);
+        }
+    }
+
+    /**
+     * \brief Intersect a ray with all child boxes of a compressed node, narrowing [nearT, farT] per child
+     *
+     * The two terms of a decoded distance can be large and of opposite
+     * sign, so a relative margin does not cover the cancellation in their
+     * sum; both bounds are instead moved outwards by its absolute error.
+     */
+    static void slabTest(const CompressedNode& node, const bool* negative, const Float* origin,
+        const Float* rcp, Float& nearT, Float& farT) {
+        const Float gamma(roundingError(5));
+        for (int axis = 0; axis < 3; axis++) {
+            /* Dequantize straight into ray distances: t = q * step / d + (origin - o) / d */
+            Float step = Float(node.scale(axis)) * rcp[axis];
+            Float base = (Float(node.origin[axis]) - origin[axis]) * rcp[axis];
+            Float step_error = abs(step) * gamma, base_error = abs(base) * gamma;
+            Float near_q = Float::loadBytes(negative[axis] ? node.upper[axis] : node.lower[axis]);
+            Float far_q = Float::loadBytes(negative[axis] ? node.lower[axis] : node.upper[axis]);
+            nearT = max(near_q * step + base - (near_q * step_error + base_error), nearT);
+            farT = min(far_q * step + base + (far_q * step_error + base_error), farT);
+        }
+    }
+
+    /// Bit mask of the occupied slots; empty full precision slots are never hit thanks to their inverted boxes
+    static int childMask(const Node&) {
+        return (1 << N) - 1;
+    }
+
+    /**
+     * \brief Bit mask of the occupied slots of a compressed node
+     *
+     * Empty slots have inverted boxes as well, but the error bounds of
+     * \ref slabTest() can widen them into hits far from the grid origin.
+     */
+    static int childMask(const CompressedNode& node) {
+        int mask = node.interior_mask;
+        for (int i = 0; i < N; i++)
+            mask |= node.num_triangles[i] > 0 ? (1 << i) : 0;
+        return mask;
+    }
+
+    /// Bit mask of the slots that hold leaves
+    static int leafMask(const Node& node) {
+        int mask = 0;
+        for (int i = 0; i < N; i++)
+            mask |= node.num_triangles[i] > 0 ? (1 << i) : 0;
+        return mask;
+    }
+
+    /// Bit mask of the slots of a compressed node that hold leaves
+    static int leafMask(const CompressedNode& node) {
+        return childMask(node) & ~node.interior_mask;
+    }
+
+    /// Bounds of the rays of a packet whose directions share an octant, see \ref BVH::PacketBounds
+    struct PacketSlabs {
+        bool negative[3];
+        Float o_min[3], o_max[3];
+        Float rcp_min[3], rcp_max[3];
+        Float mint, maxt;
+    };
+
+    /**
+     * \brief Conservative test of a packet against all child boxes of a node
+     *
+     * N-wide version of \ref BVH::PacketBounds::intersects(): returns the
+     * mask of the children that some ray of the packet may hit. Products
+     * of zero and infinity are NaN and leave their axis unconstrained.
+     */
+    static int packetMask(const Node& node, const PacketSlabs& slabs) {
+        const Float far_scale(1 + 2 * roundingError(3));
+        Float nearT = slabs.mint, farT = slabs.maxt;
+        for (int axis = 0; axis < 3; axis++) {
+            Float near_plane = Float::load(slabs.negative[axis] ? node.upper[axis] : node.lower[axis]);
+            Float far_plane = Float::load(slabs.negative[axis] ? node.lower[axis] : node.upper[axis]);
+            const Float &rcp_min = slabs.rcp_min[axis], &rcp_max = slabs.rcp_max[axis];
+            Float near0 = near_plane - slabs.o_max[axis], near1 = near_plane - slabs.o_min[axis];
+            Float far0 = far_plane - slabs.o_max[axis], far1 = far_plane - slabs.o_min[axis];
+            Float t1 = min(min(near0 * rcp_min, near0 * rcp_max), min(near1 * rcp_min, near1 * rcp_max));
+            Float t2 = max(max(far0 * rcp_min, far0 * rcp_max), max(far1 * rcp_min, far1 * rcp_max)) * far_scale;
+            nearT = max(t1, nearT);
+            farT = min(t2, farT);
+        }
+        return lessEqual(nearT, farT);
+    }
+
+    /// Compressed nodes are not culled for whole packets, this would need the error bounds of their decoding
+    static int packetMask(const CompressedNode&, const PacketSlabs&) {
+        return (1 << N) - 1;
+    }
+
+    /// Look up the wide node index (or first triangle reference/packet) and triangle count of slot \c i
+    void getChild(const Node& node, int i, uint32_t& child, uint32_t& num_triangles) const {
+        child = node.child[i];
+        num_triangles = node.num_triangles[i];
+    }
+
+    /// Look up the node index (or first triangle reference/packet) and triangle count of slot \c i
+    void getChild(const CompressedNode& node, int i, uint32_t& child, uint32_t& num_triangles) const {
+        uint32_t interior_offset = 0, leaf_offset = 0;
+        for (int j = 0; j < i; j++) {
+            if (node.interior_mask & (1 << j))
+                interior_offset++;
+            else
+                leaf_offset += m_precompute_triangles ? (node.num_triangles[j] + N - 1) / N : node.num_triangles[j];
+        }
+        num_triangles = node.num_triangles[i];
+        child = (node.interior_mask & (1 << i)) ? node.child_base + interior_offset : node.triangle_base + leaf_offset;
+    }
+
+    /// Ray set up for the watertight triangle test, broadcast to all lanes
+    struct ShearedRay {
+        int kx, ky, kz;                 ///< Axis permutation that makes the largest direction component z
+        Float sx, sy, sz;               ///< Shear that maps the ray direction onto +z
+    };
+
+    static ShearedRay shearRay(const Ray3f& ray) {
+        ShearedRay sheared;
+        sheared.kz = 0;
+        if (std::abs(ray.d.y()) > std::abs(ray.d[sheared.kz])) sheared.kz = 1;
+        if (std::abs(ray.d.z()) > std::abs(ray.d[sheared.kz])) sheared.kz = 2;
+        sheared.kx = sheared.kz == 2 ? 0 : sheared.kz + 1;
+        sheared.ky = sheared.kx == 2 ? 0 : sheared.kx + 1;
+        sheared.sx = Float(-ray.d[sheared.kx] * ray.dRcp[sheared.kz]);
+        sheared.sy = Float(-ray.d[sheared.ky] * ray.dRcp[sheared.kz]);
+        sheared.sz = Float(ray.dRcp[sheared.kz]);
+        return sheared;
+    }
+
+    /**
+     * \brief Intersect a ray with the N triangles of a packet
+     *
+     * The watertight test of \ref Mesh::rayIntersect(), evaluated for all
+     * lanes at once with the same operations. Lanes with an edge function
+     * of exactly zero are handed to the scalar test, which recomputes it
+     * in double precision. Returns the mask of lanes hit within
+     * [ray.mint, ray.maxt].
+     */
+    int intersectPacket(const TrianglePacket& packet, const Float* origin, const ShearedRay& sheared,
+        const Ray3f& ray, Float& u, Float& v, Float& t) const {
+        const Float zero(0.f);
+        auto abs = [](const Float& a) { return max(a, Float(0.f) - a); };
+        auto isZero = [&](const Float& a) { return lessEqual(a, zero) & greaterEqual(a, zero); };
+
+        const float (*vertices[3])[N] = { packet.p0, packet.p1, packet.p2 };
+        Float x[3], y[3], z[3];
+        for (int i = 0; i < 3; i++) {
+            Float px = Float::load(vertices[i][sheared.kx]) - origin[sheared.kx];
+            Float py = Float::load(vertices[i][sheared.ky]) - origin[sheared.ky];
+            Float pz = Float::load(vertices[i][sheared.kz]) - origin[sheared.kz];
+            x[i] = px + sheared.sx * pz;
+            y[i] = py + sheared.sy * pz;
+            z[i] = sheared.sz * pz;
+        }
+
+        Float e0 = x[1] * y[2] - y[1] * x[2];
+        Float e1 = x[2] * y[0] - y[2] * x[0];
+        Float e2 = x[0] * y[1] - y[0] * x[1];
+        Float det = e0 + e1 + e2;
+        Float t_scaled = e0 * z[0] + e1 * z[1] + e2 * z[2];
+        Float max_t_scaled = Float(ray.maxt) * det;
+
+        int mixed_signs = (lessThan(e0, zero) | lessThan(e1, zero) | lessThan(e2, zero))
+            & (greaterThan(e0, zero) | greaterThan(e1, zero) | greaterThan(e2, zero));
+        int mask = ~mixed_signs
+            & ((lessThan(det, zero) & lessThan(t_scaled, zero) & greaterEqual(t_scaled, max_t_scaled))
+             | (greaterThan(det, zero) & greaterThan(t_scaled, zero) & lessEqual(t_scaled, max_t_scaled)));
+
+        Float inv_det = Float(1.f) / det;
+        u = e1 * inv_det;
+        v = e2 * inv_det;
+        t = t_scaled * inv_det;
+
+        /* Conservative bound on the rounding error of t, see Mesh::rayIntersect() */
+        Float max_z = max(max(abs(z[0]), abs(z[1])), abs(z[2]));
+        Float max_x = max(max(abs(x[0]), abs(x[1])), abs(x[2]));
+        Float max_y = max(max(abs(y[0]), abs(y[1])), abs(y[2]));
+        Float max_e = max(max(abs(e0), abs(e1)), abs(e2));
+        Float delta_z = Float(roundingError(3)) * max_z;
+        Float delta_x = Float(roundingError(5)) * (max_x + max_z);
+        Float delta_y = Float(roundingError(5)) * (max_y + max_z);
+        Float delta_e = Float(2.f) * (Float(roundingError(2)) * max_x * max_y + delta_y * max_x + delta_x * max_y);
+        Float delta_t = Float(3.f) * (Float(roundingError(3)) * max_e * max_z + delta_e * max_z + delta_z * max_e)
+            * abs(inv_det);
+        mask &= greaterThan(t, delta_t) & greaterEqual(t, Float(ray.mint)) & lessEqual(t, Float(ray.maxt));
+
+        /* Lanes where all edge functions vanish are degenerate (this includes the unused lanes) */
+        int zero_e0 = isZero(e0), zero_e1 = isZero(e1), zero_e2 = isZero(e2);
+        int fallback = (zero_e0 | zero_e1 | zero_e2) & ~(zero_e0 & zero_e1 & zero_e2);
+        if (fallback) {
+            float u_lanes[N], v_lanes[N], t_lanes[N];
+            u.store(u_lanes);
+            v.store(v_lanes);
+            t.store(t_lanes);
+            mask &= ~fallback;
+            for (int lane = 0; lane < N; lane++) {
+                if (!(fallback & (1 << lane)))
+                    continue;
+                Point3f p0(packet.p0[0][lane], packet.p0[1][lane], packet.p0[2][lane]);
+                Point3f p1(packet.p1[0][lane], packet.p1[1][lane], packet.p1[2][lane]);
+                Point3f p2(packet.p2[0][lane], packet.p2[1][lane], packet.p2[2][lane]);
+                if (Mesh::rayIntersect(p0, p1, p2, ray, u_lanes[lane], v_lanes[lane], t_lanes[lane]))
+                    mask |= 1 << lane;
+            }
+            u = Float::load(u_lanes);
+            v = Float::load(v_lanes);
+            t = Float::load(t_lanes);
+        }
+        return mask;
+    }
+
+    /// Intersect the precomputed triangles of a leaf, N at a time
+    bool intersectPackets(uint32_t first_packet, uint32_t count, const Float* origin, const ShearedRay& sheared,
+        Ray3f& ray, RayHit& hit, bool shadowRay) const {
+        bool foundIntersection = false;
+        NORI_STAT(triangle_tests, count);
+
+        for (uint32_t p = first_packet; p < first_packet + (count + N - 1) / N; p++) {
+            Float u, v, t;
+            int mask = intersectPacket(m_packets[p], origin, sheared, ray, u, v, t);
+            if (mask == 0)
+                continue;
+
+            /* An intersection was found! Can terminate
+               immediately if this is a shadow ray query */
+            if (shadowRay)
+                return true;
+
+            float t_lanes[N], u_lanes[N], v_lanes[N];
+            t.store(t_lanes);
+            u.store(u_lanes);
+            v.store(v_lanes);
+
+            int best = -1;
+            for (int lane = 0; lane < N; lane++)
+                if ((mask & (1 << lane)) && (best == -1 || t_lanes[lane] < t_lanes[best]))
+                    best = lane;
+
+            uint32_t mesh_idx, triangle_idx;
+            resolvePrimitive(m_packets[p].prim_id[best], mesh_idx, triangle_idx);
+            ray.maxt = t_lanes[best];
+            hit.t = t_lanes[best];
+            hit.uv = Point2f(u_lanes[best], v_lanes[best]);
+            hit.mesh = m_meshes[mesh_idx];
+            hit.f = triangle_idx;
+            foundIntersection = true;
+        }
+        return foundIntersection;
+    }
+
+    /// Find any precomputed triangle of a leaf that blocks a ray
+    bool occludedPackets(uint32_t first_packet, uint32_t count, const Float* origin, const ShearedRay& sheared,
+        const Ray3f& ray, RayHit& occluder) const {
+        for (uint32_t p = first_packet; p < first_packet + (count + N - 1) / N; p++) {
+            NORI_STAT(triangle_tests, std::min<uint32_t>(N, count - (p - first_packet) * N));
+            Float u, v, t;
+            int mask = intersectPacket(m_packets[p], origin, sheared, ray, u, v, t);
+            if (mask == 0)
+                continue;
+
+            int lane = 0;
+            while (!(mask & (1 << lane)))
+                lane++;
+            uint32_t mesh_idx, triangle_idx;
+            resolvePrimitive(m_packets[p].prim_id[lane], mesh_idx, triangle_idx);
+            occluder.mesh = m_meshes[mesh_idx];
+            occluder.f = triangle_idx;
+            return true;
+        }
+        return false;
+    }
+
+    /// Store a binary node in slot \c i of a wide node
+    void setChild(uint32_t wide_idx, int i, const BVH::Node& binary_node) {
+        Node& node = m_wide_nodes[wide_idx];
+        for (int axis = 0; axis < 3; axis++) {
+            node.lower[axis][i] = binary_node.bbox.min[axis];
+            node.upper[axis][i] = binary_node.bbox.max[axis];
+        }
+        node.num_triangles[i] = binary_node.num_triangles;
+        node.child[i] = binary_node.offset;
+        if (binary_node.isLeaf() && m_precompute_triangles)
+            node.child[i] = packTriangles(binary_node.offset, binary_node.num_triangles);
+    }
+
+    /// Append a wide node with all slots empty
+    uint32_t addNode() {
+        uint32_t wide_idx = (uint32_t) m_wide_nodes.size();
+        m_wide_nodes.emplace_back();
+
+        /* Empty slots get an inverted box, which no ray can hit */
+        Node& node = m_wide_nodes[wide_idx];
+        for (int i = 0; i < N; i++) {
+            for (int axis = 0; axis < 3; axis++) {
+                node.lower[axis][i] = std::numeric_limits<float>::infinity();
+                node.upper[axis][i] = -std::numeric_limits<float>::infinity();
+            }
+            node.child[i] = 0;
+            node.num_triangles[i] = 0;
+        }
+        return wide_idx;
+    }
+
+    /// Create a wide node for the binary interior node \c binary_idx
+    uint32_t collapse(uint32_t binary_idx) {
+        uint32_t wide_idx = addNode();
+
+        /* Open the interior child with the largest surface area until the node is full */
+        uint32_t children[N];
+        int num_children = 2;
+        children[0] = binary_idx + 1;
+        children[1] = m_nodes[binary_idx].offset;
+
+        while (num_children < N) {
+            int best = -1;
+            float best_area = -1.f;
+            for (int i = 0; i < num_children; i++) {
+                const BVH::Node& child = m_nodes[children[i]];
+                if (!child.isLeaf() && child.bbox.getSurfaceArea() > best_area) {
+                    best_area = child.bbox.getSurfaceArea();
+                    best = i;
+                }
+            }
+            if (best == -1)
+                break;
+            uint32_t opened = children[best];
+            children[best] = opened + 1;
+            children[num_children++] = m_nodes[opened].offset;
+        }
+
+        for (int i = 0; i < num_children; i++) {
+            const BVH::Node& child = m_nodes[children[i]];
+            setChild(wide_idx, i, child);
+            if (child.isLeaf()) {
+                m_num_wide_leaves++;
+            } else {
+                uint32_t child_idx = collapse(children[i]);
+                m_wide_nodes[wide_idx].child[i] = child_idx;
+            }
+        }
+        return wide_idx;
+    }
+
+    void rayIntersectPacket(const Ray3f* rays_, uint32_t count, Intersection* its, bool* hits) const {
+        /* Culling whole packets requires the directions to lie in the same octant */
+        if (count < 2 || !sameOctant(rays_, count)) {
+            Accel::rayIntersectPacket(rays_, count, its, hits);
+            return;
+        }
+
+        Ray3f rays[MAX_PACKET_SIZE];
+        RayHit packet_hits[MAX_PACKET_SIZE];
+        for (uint32_t i = 0; i < count; ++i)
+            rays[i] = rays_[i];
+
+        if (m_compress_nodes)
+            traverseNodesPacket(m_compressed_nodes, rays, count, packet_hits);
+        else
+            traverseNodesPacket(m_wide_nodes, rays, count, packet_hits);
+
+        for (uint32_t i = 0; i < count; ++i) {
+            hits[i] = packet_hits[i].hasHit();
+            if (hits[i])
+                computeSurfaceInteraction(packet_hits[i], its[i]);
+        }
+    }
+
+    bool traverse(Ray3f& ray, RayHit& hit, bool shadowRay) const {
+        return m_compress_nodes ? traverseNodes(m_compressed_nodes, ray, hit, shadowRay)
+            : traverseNodes(m_wide_nodes, ray, hit, shadowRay);
+    }
+
+    bool traverseOccluded(const Ray3f& ray, RayHit& occluder) const {
+        return m_compress_nodes ? traverseNodesOccluded(m_compressed_nodes, ray, occluder)
+            : traverseNodesOccluded(m_wide_nodes, ray, occluder);
+    }
+
+    /// Closest hit traversal, shared by the full precision and the compressed nodes
+    template <typename NodeVector> bool traverseNodes(const NodeVector& nodes, Ray3f& ray, RayHit& hit,
+        bool shadowRay) const {
+        if (nodes.empty())
+            return false;
+
+        bool foundIntersection = false;
+
+        /* Near and far planes of every axis follow from the direction sign */
+        bool negative[3] = { ray.dRcp.x() < 0, ray.dRcp.y() < 0, ray.dRcp.z() < 0 };
+        Float origin[3] = { Float(ray.o.x()), Float(ray.o.y()), Float(ray.o.z()) };
+        Float rcp[3] = { Float(ray.dRcp.x()), Float(ray.dRcp.y()), Float(ray.dRcp.z()) };
+        ShearedRay sheared = shearRay(ray);
+
+        struct StackEntry {
+            uint32_t child;
+            uint32_t num_triangles;
+            float nearT;
+        };
+        StackEntry stack[(N - 1) * MAX_DEPTH + 1];
+        uint32_t stack_size = 0;
+        stack[stack_size++] = { 0, 0, ray.mint };
+
+        while (stack_size > 0) {
+            StackEntry entry = stack[--stack_size];
+
+            // skip nodes that lie behind a hit found after they were pushed
+            if (entry.nearT > ray.maxt)
+                continue;
+
+            if (entry.num_triangles > 0) {
+                bool found = m_precompute_triangles
+                    ? intersectPackets(entry.child, entry.num_triangles, origin, sheared, ray, hit, shadowRay)
+                    : intersectLeaf(entry.child, entry.num_triangles, ray, hit, shadowRay);
+                if (found) {
+                    if (shadowRay)
+                        return true;
+                    foundIntersection = true;
+                }
+                continue;
+            }
+
+            const auto& node = nodes[entry.child];
+            NORI_STAT(nodes_visited, 1);
+            NORI_STAT(box_tests, N);
+
+            /* Slab test against all N child boxes at once. NaNs from rays
+               starting on a slab plane end up in the first argument of
+               min/max and are therefore ignored */
+            Float nearT(ray.mint), farT(ray.maxt);
+            slabTest(node, negative, origin, rcp, nearT, farT);
+            int mask = lessEqual(nearT, farT) & childMask(node);
+            if (mask == 0)
+                continue;
+
+            float near_dist[N];
+            nearT.store(near_dist);
+
+            /* Push the hit children from far to near (insertion sort on at most N entries) */
+            uint32_t first = stack_size;
+            for (int i = 0; i < N; i++) {
+                if (!(mask & (1 << i)))
+                    continue;
+                StackEntry child_entry = { 0, 0, near_dist[i] };
+                getChild(node, i, child_entry.child, child_entry.num_triangles);
+                uint32_t j = stack_size++;
+                while (j > first && stack[j - 1].nearT < child_entry.nearT) {
+                    stack[j] = stack[j - 1];
+                    j--;
+                }
+                stack[j] = child_entry;
+            }
+        }
+
+        return foundIntersection;
+    }
+
+    /**
+     * \brief Closest hit traversal of a packet of rays, shared by the full
+     * precision and the compressed nodes
+     *
+     * Every node is fetched once for the whole packet, and its children
+     * that no ray can hit are culled with \ref packetMask(). As in
+     * \ref BVH::traversePacket(), an interior child is entered with the
+     * first active ray that hits its box, and the rays before that one are
+     * skipped in its subtree; for coherent rays, one N-wide slab test per
+     * node usually finds the first ray of all children. Leaf children
+     * record exactly which rays hit their box. The directions must lie in
+     * the same octant. Updates \c rays[i].maxt and \c hits[i] like
+     * \ref traverse().
+     */
+    template <typename NodeVector> void traverseNodesPacket(const NodeVector& nodes, Ray3f* rays, uint32_t count,
+        RayHit* hits) const {
+        if (nodes.empty())
+            return;
+
+        struct PacketRay {
+            bool negative[3];
+            Float origin[3];
+            Float rcp[3];
+            ShearedRay sheared;
+        };
+        PacketRay packet[MAX_PACKET_SIZE];
+        for (uint32_t i = 0; i < count; ++i) {
+            const Ray3f& ray = rays[i];
+            for (int axis = 0; axis < 3; axis++) {
+                packet[i].negative[axis] = ray.dRcp[axis] < 0;
+                packet[i].origin[axis] = Float(ray.o[axis]);
+                packet[i].rcp[axis] = Float(ray.dRcp[axis]);
+            }
+            packet[i].sheared = shearRay(ray);
+        }
+
+        PacketSlabs slabs;
+        float mint = rays[0].mint, maxt = rays[0].maxt;
+        for (int axis = 0; axis < 3; axis++) {
+            float o_min = rays[0].o[axis], o_max = o_min, rcp_min = rays[0].dRcp[axis], rcp_max = rcp_min;
+            for (uint32_t i = 1; i < count; ++i) {
+                o_min = std::min(o_min, rays[i].o[axis]);
+                o_max = std::max(o_max, rays[i].o[axis]);
+                rcp_min = std::min(rcp_min, rays[i].dRcp[axis]);
+                rcp_max = std::max(rcp_max, rays[i].dRcp[axis]);
+            }
+            slabs.negative[axis] = packet[0].negative[axis];
+            slabs.o_min[axis] = Float(o_min);
+            slabs.o_max[axis] = Float(o_max);
+            slabs.rcp_min[axis] = Float(rcp_min);
+            slabs.rcp_max[axis] = Float(rcp_max);
+        }
+        for (uint32_t i = 1; i < count; ++i) {
+            mint = std::min(mint, rays[i].mint);
+            maxt = std::max(maxt, rays[i].maxt);
+        }
+        slabs.mint = Float(mint);
+        slabs.maxt = Float(maxt);
+
+        /* Interior entries store the first ray that may hit the node, leaf
+           entries the mask of the rays that hit their box */
+        struct StackEntry {
+            uint32_t child;
+            uint32_t num_triangles;
+            uint32_t rays;
+            float nearT;
+        };
+        StackEntry stack[(N - 1) * MAX_DEPTH + 1];
+        uint32_t stack_size = 0;
+        stack[stack_size++] = { 0, 0, 0, 0.f };
+
+        while (stack_size > 0) {
+            StackEntry entry = stack[--stack_size];
+
+            if (entry.num_triangles > 0) {
+                for (uint32_t i = 0; i < count; ++i) {
+                    // skip rays that found a hit in front of the leaf after it was pushed
+                    if (!(entry.rays & (1u << i)) || entry.nearT > rays[i].maxt)
+                        continue;
+                    if (m_precompute_triangles)
+                        intersectPackets(entry.child, entry.num_triangles, packet[i].origin, packet[i].sheared,
+                            rays[i], hits[i], false);
+                    else
+                        intersectLeaf(entry.child, entry.num_triangles, rays[i], hits[i], false);
+                }
+                continue;
+            }
+
+            const auto& node = nodes[entry.child];
+            NORI_STAT(nodes_visited, 1);
+
+            /* Test the rays in order until every interior child has found its
+               first ray; leaf children need the result of every ray */
+            int leaf_mask = leafMask(node);
+            int unresolved = childMask(node) & packetMask(node, slabs), hit_mask = 0;
+            uint32_t child_rays[N] = {};
+            float child_near[N];
+
+            for (uint32_t i = entry.rays; i < count && unresolved != 0; ++i) {
+                NORI_STAT(box_tests, N);
+                Float nearT(rays[i].mint), farT(rays[i].maxt);
+                slabTest(node, packet[i].negative, packet[i].origin, packet[i].rcp, nearT, farT);
+                int mask = lessEqual(nearT, farT) & unresolved;
+                if (mask == 0)
+                    continue;
+
+                float near_dist[N];
+                nearT.store(near_dist);
+                for (int j = 0; j < N; j++) {
+                    if (!(mask & (1 << j)))
+                        continue;
+                    if (!(leaf_mask & (1 << j))) {
+                        child_rays[j] = i;
+                        child_near[j] = near_dist[j];
+                        unresolved &= ~(1 << j);
+                    } else if (hit_mask & (1 << j)) {
+                        child_rays[j] |= 1u << i;
+                        child_near[j] = std::min(child_near[j], near_dist[j]);
+                    } else {
+                        child_rays[j] = 1u << i;
+                        child_near[j] = near_dist[j];
+                    }
+                    hit_mask |= 1 << j;
+                }
+            }
+
+            /* Push the hit children from far to near (insertion sort on at most N entries) */
+            uint32_t first = stack_size;
+            for (int j = 0; j < N; j++) {
+                if (!(hit_mask & (1 << j)))
+                    continue;
+                StackEntry child_entry = { 0, 0, child_rays[j], child_near[j] };
+                getChild(node, j, child_entry.child, child_entry.num_triangles);
+                uint32_t k = stack_size++;
+                while (k > first && stack[k - 1].nearT < child_entry.nearT) {
+                    stack[k] = stack[k - 1];
+                    k--;
+                }
+                stack[k] = child_entry;
+            }
+        }
+    }
+
+    /// Any hit traversal, shared by the full precision and the compressed nodes
+    template <typename NodeVector> bool traverseNodesOccluded(const NodeVector& nodes, const Ray3f& ray,
+        RayHit& occluder) const {
+        if (nodes.empty())
+            return false;
+
+        bool negative[3] = { ray.dRcp.x() < 0, ray.dRcp.y() < 0, ray.dRcp.z() < 0 };
+        Float origin[3] = { Float(ray.o.x()), Float(ray.o.y()), Float(ray.o.z()) };
+        Float rcp[3] = { Float(ray.dRcp.x()), Float(ray.dRcp.y()), Float(ray.dRcp.z()) };
+        ShearedRay sheared = shearRay(ray);
+
+        /* Any hit ends the query: children are pushed unsorted, and leaves
+           are tested as soon as their box is hit instead of being pushed */
+        uint32_t stack[(N - 1) * MAX_DEPTH + 1];
+        uint32_t stack_size = 0;
+        stack[stack_size++] = 0;
+
+        while (stack_size > 0) {
+            const auto& node = nodes[stack[--stack_size]];
+            NORI_STAT(nodes_visited, 1);
+            NORI_STAT(box_tests, N);
+
+            Float nearT(ray.mint), farT(ray.maxt);
+            slabTest(node, negative, origin, rcp, nearT, farT);
+            int mask = lessEqual(nearT, farT) & childMask(node);
+
+            for (int i = 0; mask != 0; i++, mask >>= 1) {
+                if (!(mask & 1))
+                    continue;
+                uint32_t child, num_triangles;
+                getChild(node, i, child, num_triangles);
+                if (num_triangles == 0) {
+                    stack[stack_size++] = child;
+                    continue;
+                }
+                bool hit = m_precompute_triangles
+                    ? occludedPackets(child, num_triangles, origin, sheared, ray, occluder)
+                    : occludedLeaf(child, num_triangles, ray, occluder);
+                if (hit)
+                    return true;
+            }
+        }
+        return false;
+    }
+
+    std::vector<Node, tbb::cache_aligned_allocator<Node>> m_wide_nodes; ///< Wide hierarchy, root at index 0
+    std::vector<CompressedNode> m_compressed_nodes; ///< Quantized hierarchy (replaces \ref m_wide_nodes), root at index 0
+    std::vector<TrianglePacket, tbb::cache_aligned_allocator<TrianglePacket>> m_packets; ///< Precomputed leaf triangles
+    bool m_precompute_triangles;    ///< Intersect leaves through \ref m_packets
+    bool m_compress_nodes;          ///< Quantize the nodes after the build
+    uint32_t m_num_wide_leaves = 0;
+    float m_wide_sah_cost = 0.f;    ///< SAH cost right after the last build
+};
+
+NORI_NAMESPACE_END
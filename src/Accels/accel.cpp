@@ -18,289 +18,200 @@
 
 #include <nori/accel.h>
 #include <Eigen/Geometry>
-#include <chrono>
-#include <nori/timer.h>
-
-using namespace std::chrono;
+#include <tbb/parallel_for.h>
+#include <tbb/parallel_sort.h>
+#include <tbb/blocked_range.h>
+#include <atomic>
 
 NORI_NAMESPACE_BEGIN
 
-void Accel::addMesh(Mesh* mesh) {
-    if (m_num_meshes >= MAX_NUM_MESHES)
-        throw NoriException("Accel: only %d meshes are supported!", MAX_NUM_MESHES);
-    m_meshes[m_num_meshes] = mesh;
-    m_bbox.expandBy(mesh->getBoundingBox());
-    m_num_meshes++;
-}
-
-void Accel::build() {
-    if (m_num_meshes == 0)
-        throw NoriException("No mesh found, could not build acceleration structure");
+namespace {
+    /// Triangle that blocked the last occluded ray of a thread, and the structure it belongs to
+    struct LastOccluder {
+        uint64_t accel_id = 0;
+        RayHit occluder;
+    };
+    thread_local LastOccluder t_last_occluder;
 
-    auto start = high_resolution_clock::now();
-    // delete old hierarchy if present
-    delete m_root;
+    std::atomic<uint64_t> next_accel_id(1);
 
-    uint32_t num_triangles = 0;
-    for (uint32_t mesh_idx = 0; mesh_idx < m_num_meshes; mesh_idx++) {
-        num_triangles += m_meshes[mesh_idx]->getTriangleCount();
-    }
+    /// Number of consecutive sorted rays of a batch traced by one task
+    constexpr size_t BATCH_GRAIN_SIZE = 1024;
+}
 
-    std::vector<uint32_t> triangles(num_triangles);
-    std::vector<uint32_t> mesh_indices(num_triangles);
-    uint32_t offset = 0;
-
-    for (uint32_t current_mesh_idx = 0; current_mesh_idx < m_num_meshes; current_mesh_idx++) {
-        uint32_t num_triangles_mesh = m_meshes[current_mesh_idx]->getTriangleCount();
-        for (uint32_t i = 0; i < num_triangles_mesh; i++) {
-            triangles[offset + i] = i;
-            mesh_indices[offset + i] = current_mesh_idx;
-        }
-        offset += num_triangles_mesh;
-    }
+Accel::Accel() : m_prim_offsets(1, 0), m_id(next_accel_id++) { }
 
-    m_root = buildRecursive(m_bbox, triangles, mesh_indices, 0);
-    printf("Octree build time: %ldms \n", duration_cast<milliseconds>(high_resolution_clock::now() - start).count());
-    printf("Num nodes: %d \n", m_num_nodes);
-    printf("Num leaf nodes: %d \n", m_num_leaf_nodes);
-    printf("Num non-empty leaf nodes: %d \n", m_num_nonempty_leaf_nodes);
-    printf("Total number of saved triangles: %d \n", m_num_triangles_saved);
-    printf("Avg triangles per node: %f \n", (float)m_num_triangles_saved / (float)m_num_nodes);
-    printf("Recursion depth: %d \n", m_recursion_depth);
+void Accel::addMesh(Mesh* mesh) {
+    m_meshes.push_back(mesh);
+    m_bbox.expandBy(mesh->getBoundingBox());
+    m_num_meshes++;
+    m_prim_offsets.push_back(m_prim_offsets.back() + mesh->getTriangleCount());
 }
 
-bool Accel::rayIntersect(const Ray3f& ray_, Intersection& its, bool shadowRay) const {
-    bool foundIntersection;  // Was an intersection found so far?
-    uint32_t f = (uint32_t)-1;      // Triangle index of the closest intersection
-
-    Ray3f ray(ray_); /// Make a copy of the ray (we will need to update its '.maxt' value)
+void Accel::refit() {
+    updateBoundingBox();
+    build();
+}
 
-    foundIntersection = traverseRecursive(*m_root, ray, its, shadowRay, f);
-    if (shadowRay)
-        return foundIntersection;
-
-    if (foundIntersection) {
-        /* At this point, we now know that there is an intersection,
-           and we know the triangle index of the closest such intersection.
-
-           The following computes a number of additional properties which
-           characterize the intersection (normals, texture coordinates, etc..)
-        */
-
-        /* Find the barycentric coordinates */
-        Vector3f bary;
-        bary << 1 - its.uv.sum(), its.uv;
-
-        /* References to all relevant mesh buffers */
-        const Mesh* mesh = its.mesh;
-        const MatrixXf& V = mesh->getVertexPositions();
-        const MatrixXf& N = mesh->getVertexNormals();
-        const MatrixXf& UV = mesh->getVertexTexCoords();
-        const MatrixXu& F = mesh->getIndices();
-
-        /* Vertex indices of the triangle */
-        uint32_t idx0 = F(0, f), idx1 = F(1, f), idx2 = F(2, f);
-
-        Point3f p0 = V.col(idx0), p1 = V.col(idx1), p2 = V.col(idx2);
-
-        /* Compute the intersection positon accurately
-           using barycentric coordinates */
-        its.p = bary.x() * p0 + bary.y() * p1 + bary.z() * p2;
-
-        /* Compute proper texture coordinates if provided by the mesh */
-        if (UV.size() > 0)
-            its.uv = bary.x() * UV.col(idx0) +
-            bary.y() * UV.col(idx1) +
-            bary.z() * UV.col(idx2);
-
-        /* Compute the geometry frame */
-        its.geoFrame = Frame((p1 - p0).cross(p2 - p0).normalized());
-
-        if (N.size() > 0) {
-            /* Compute the shading frame. Note that for simplicity,
-               the current implementation doesn't attempt to provide
-               tangents that are continuous across the surface. That
-               means that this code will need to be modified to be able
-               use anisotropic BRDFs, which need tangent continuity */
-
-            its.shFrame = Frame(
-                (bary.x() * N.col(idx0) +
-                    bary.y() * N.col(idx1) +
-                    bary.z() * N.col(idx2)).normalized());
-        }
-        else {
-            its.shFrame = its.geoFrame;
-        }
-    }
+void Accel::updateBoundingBox() {
+    m_bbox.reset();
+    for (const Mesh* mesh : m_meshes)
+        m_bbox.expandBy(mesh->getBoundingBox());
+}
 
-    return foundIntersection;
+void Accel::updatePrimitiveOffsets() {
+    m_prim_offsets.resize(m_meshes.size() + 1);
+    for (size_t mesh_idx = 0; mesh_idx < m_meshes.size(); mesh_idx++)
+        m_prim_offsets[mesh_idx + 1] = m_prim_offsets[mesh_idx] + m_meshes[mesh_idx]->getTriangleCount();
 }
 
-Accel::Node* Accel::buildRecursive(const BoundingBox3f& bbox, std::vector<uint32_t>& triangle_indices,
-    std::vector<uint32_t>& mesh_indices, uint32_t recursion_depth) {
-    // a node is created in any case
-    m_num_nodes++;
+bool Accel::rayIntersect(const Ray3f& ray, Intersection& its, bool shadowRay) const {
+    if (shadowRay)
+        return occluded(ray);
 
-    uint32_t num_triangles = triangle_indices.size();
+    RayHit hit;
+    if (!rayIntersect(ray, hit))
+        return false;
 
-    // return empty node if no triangles are left
-    if (num_triangles == 0) {
-        Node* node = new Node();
-        node->bbox = BoundingBox3f(bbox);
+    computeSurfaceInteraction(hit, its);
+    return true;
+}
 
-        // add to statistics
-        m_num_leaf_nodes++;
-        return node;
-    }
+bool Accel::rayIntersect(const Ray3f& ray_, RayHit& hit) const {
+    Ray3f ray(ray_); /// Make a copy of the ray (we will need to update its '.maxt' value)
+    return traverse(ray, hit, false);
+}
 
-    // create leaf node if 10 or less triangles are left or if the max recursion depth is reached.
-    if (num_triangles <= MAX_TRIANGLES_PER_NODE || recursion_depth >= MAX_RECURSION_DEPTH) {
-        Node* node = new Node();
-        node->num_triangles = num_triangles;
-        node->triangle_indices = new uint32_t[num_triangles];
-        node->mesh_indices = new uint32_t[num_triangles];
-
-        for (uint32_t i = 0; i < num_triangles; i++) {
-            node->triangle_indices[i] = triangle_indices[i];
-            node->mesh_indices[i] = mesh_indices[i];
-        }
-        node->bbox = BoundingBox3f(bbox);
-
-        // add to statistics
-        m_num_leaf_nodes++;
-        m_num_nonempty_leaf_nodes++;
-        m_num_triangles_saved += num_triangles;
-        return node;
-    }
+void Accel::rayIntersectPacket(const Ray3f* rays, uint32_t count, Intersection* its, bool* hits) const {
+    for (uint32_t i = 0; i < count; ++i)
+        hits[i] = rayIntersect(rays[i], its[i], false);
+}
 
-    // create new parent node
-    Node* node = new Node();
-    node->bbox = BoundingBox3f(bbox);
-
-    BoundingBox3f child_bboxes[8] = {};
-    subdivideBBox(bbox, child_bboxes);
-
-    std::vector<std::vector<uint32_t>> child_triangle_indices(8);
-    std::vector<std::vector<uint32_t>> child_mesh_indices(8);
-
-    uint32_t child_num_triangles[8] = {};
-
-    // place every triangle in the children it overlaps with
-    // for every child bbox
-    for (uint32_t i = 0; i < 8; i++) {
-        // for every triangle inside of the parent create triangle bounding box
-        for (uint32_t j = 0; j < num_triangles; j++) {
-            // for every triangle vertex expand triangle bbox
-            uint32_t triangle_idx = triangle_indices[j];
-            uint32_t mesh_idx = mesh_indices[j];
-            BoundingBox3f triangle_bbox = m_meshes[mesh_idx]->getBoundingBox(triangle_idx);
-
-            // check if triangle is in bbox, if so put triangle index into triangle list of child
-            if (child_bboxes[i].overlaps(triangle_bbox)) {
-                child_triangle_indices[i].emplace_back(triangle_idx);
-                child_mesh_indices[i].emplace_back(mesh_idx);
-                child_num_triangles[i]++;
+void Accel::intersectBatch(const Ray3f* rays, size_t count, Intersection* its, bool* hits) const {
+    /* Sort key: direction octant (3 bits), Morton code of the origin
+       inside the scene bounds (30 bits) and the ray index (31 bits) */
+    if (count >= (size_t(1) << 31))
+        throw NoriException("Accel::intersectBatch(): too many rays!");
+
+    Vector3f scale = Vector3f::Constant(1023.f).cwiseQuotient(m_bbox.getExtents().cwiseMax(Vector3f::Constant(1e-20f)));
+    std::vector<uint64_t> keys(count);
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, count, BATCH_GRAIN_SIZE),
+        [&](const tbb::blocked_range<size_t>& range) {
+            for (size_t i = range.begin(); i != range.end(); ++i) {
+                const Ray3f& ray = rays[i];
+                uint32_t octant = (ray.d.x() < 0 ? 1 : 0) | (ray.d.y() < 0 ? 2 : 0) | (ray.d.z() < 0 ? 4 : 0);
+                Vector3f cell = (ray.o - m_bbox.min).cwiseProduct(scale).cwiseMax(Vector3f::Zero()).cwiseMin(Vector3f::Constant(1023.f));
+                uint32_t morton = mortonCode((uint32_t) cell.x(), (uint32_t) cell.y(), (uint32_t) cell.z());
+                keys[i] = ((uint64_t) octant << 61) | ((uint64_t) morton << 31) | (uint64_t) i;
             }
-        }
-    }
-
-    // release memory to avoid stack overflow
-    triangle_indices = std::vector<uint32_t>();
-    mesh_indices = std::vector<uint32_t>();
-
-    node->child = buildRecursive(child_bboxes[0], child_triangle_indices[0], child_mesh_indices[0], recursion_depth + 1);
-    Node* last_child = node->child;
+        });
+    tbb::parallel_sort(keys.begin(), keys.end());
+
+    /* Sorted rays are still too divergent for packet traversal, so every
+       thread traces a contiguous run of them one by one; the gain comes
+       from cache reuse between neighboring queries */
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, count, BATCH_GRAIN_SIZE),
+        [&](const tbb::blocked_range<size_t>& range) {
+            for (size_t k = range.begin(); k != range.end(); ++k) {
+                size_t i = (size_t) (keys[k] & 0x7FFFFFFFu);
+                hits[i] = rayIntersect(rays[i], its[i], false);
+            }
+        });
+}
 
-    // for every child bbox
-    for (uint32_t i = 1; i < 8; i++) {
-        last_child->next = buildRecursive(child_bboxes[i], child_triangle_indices[i], child_mesh_indices[i], recursion_depth + 1);
-        last_child = last_child->next; 
-        m_recursion_depth = std::max(m_recursion_depth, recursion_depth + 1);
+bool Accel::occluded(const Ray3f& ray) const {
+    if (!m_occluder_cache) {
+        RayHit occluder;
+        return traverseOccluded(ray, occluder);
     }
-    return node;
-}
 
-bool Accel::traverseRecursive(const Node& node, Ray3f& ray, Intersection& its, bool shadowRay, uint32_t& hit_idx) const {
-    bool foundIntersection = false;
+    /* The identifier (instead of the address) makes sure that a cached
+       triangle never refers to the meshes of a deleted structure */
+    LastOccluder& last = t_last_occluder;
+    if (last.accel_id == m_id && testOccluder(ray, last.occluder))
+        return true;
 
-    // only check triangles of node and its children if ray intersects with node bbox
-    if (!node.bbox.rayIntersect(ray)) {
+    RayHit occluder;
+    if (!traverseOccluded(ray, occluder))
         return false;
+    if (occluder.mesh) {
+        last.accel_id = m_id;
+        last.occluder = occluder;
     }
+    return true;
+}
 
-    // search through all triangles in node
-    for (uint32_t i = 0; i < node.num_triangles; ++i) {
-        float u, v, t;
-        uint32_t triangle_idx = node.triangle_indices[i];
-        uint32_t mesh_idx = node.mesh_indices[i];
-        if (m_meshes[mesh_idx]->rayIntersect(triangle_idx, ray, u, v, t) && t < ray.maxt) {
-            /* An intersection was found! Can terminate
-               immediately if this is a shadow ray query */
-            if (shadowRay)
-                return true;
-            ray.maxt = t;
-            its.t = t;
-            its.uv = Point2f(u, v);
-            its.mesh = m_meshes[mesh_idx];
-            hit_idx = triangle_idx;
-            foundIntersection = true;
-        }
-    }
-
-    if (node.child) {
-        std::pair<Node*, float> children[8];
-        Node* current_child = node.child;
-        int i = 0;
-        do {
-            children[i] = std::pair<Node*, float>(current_child, current_child->bbox.distanceTo(ray.o));
-            current_child = current_child->next;
-            i++;
-        } while (current_child);
-
-        std::sort(children, children + 8, [ray](const std::pair<Node*, float>& l, const std::pair<Node*, float>& r) {
-            return l.second < r.second;
-            });
-
-        for (auto child : children) {
-            foundIntersection = traverseRecursive(*child.first, ray, its, shadowRay, hit_idx) || foundIntersection;
-            if (shadowRay && foundIntersection)
-                return true;
-        }
-    }
-    return foundIntersection;
+bool Accel::traverseOccluded(const Ray3f& ray_, RayHit& occluder) const {
+    /* Shadow ray queries stop before recording the hit */
+    Ray3f ray(ray_);
+    return traverse(ray, occluder, true);
 }
 
-void Accel::subdivideBBox(const nori::BoundingBox3f& parent, nori::BoundingBox3f* bboxes) {
-    Point3f extents = parent.getExtents();
-
-    Point3f x0_y0_z0 = parent.min;
-    Point3f x1_y0_z0 = Point3f(parent.min.x() + extents.x() / 2.f, parent.min.y(), parent.min.z());
-    Point3f x0_y1_z0 = Point3f(parent.min.x(), parent.min.y() + extents.y() / 2.f, parent.min.z());
-    Point3f x1_y1_z0 = Point3f(parent.min.x() + extents.x() / 2.f, parent.min.y() + extents.y() / 2.f, parent.min.z());
-
-    Point3f x0_y0_z1 = Point3f(parent.min.x(), parent.min.y(), parent.min.z() + extents.z() / 2.f);
-    Point3f x1_y0_z1 = Point3f(parent.min.x() + extents.x() / 2.f, parent.min.y(), parent.min.z() + extents.z() / 2.f);
-    Point3f x0_y1_z1 = Point3f(parent.min.x(), parent.min.y() + extents.y() / 2.f, parent.min.z() + extents.z() / 2.f);
-    Point3f x1_y1_z1 = Point3f(parent.min.x() + extents.x() / 2.f, parent.min.y() + extents.y() / 2.f, parent.min.z() + extents.z() / 2.f);
-    Point3f x2_y1_z1 = Point3f(parent.max.x(), parent.min.y() + extents.y() / 2.f, parent.min.z() + extents.z() / 2.f);
-    Point3f x1_y2_z1 = Point3f(parent.min.x() + extents.x() / 2.f, parent.max.y(), parent.min.z() + extents.z() / 2.f);
-    Point3f x2_y2_z1 = Point3f(parent.max.x(), parent.max.y(), parent.min.z() + extents.z() / 2.f);
-
-    Point3f x1_y1_z2 = Point3f(parent.min.x() + extents.x() / 2.f, parent.min.y() + extents.y() / 2.f, parent.max.z());
-    Point3f x2_y1_z2 = Point3f(parent.max.x(), parent.min.y() + extents.y() / 2.f, parent.max.z());
-    Point3f x1_y2_z2 = Point3f(parent.min.x() + extents.x() / 2.f, parent.max.y(), parent.max.z());
-    Point3f x2_y2_z2 = Point3f(parent.max.x(), parent.max.y(), parent.max.z());
-
-    bboxes[0] = BoundingBox3f(x0_y0_z0, x1_y1_z1);
-    bboxes[1] = BoundingBox3f(x1_y0_z0, x2_y1_z1);
-    bboxes[2] = BoundingBox3f(x0_y1_z0, x1_y2_z1);
-    bboxes[3] = BoundingBox3f(x1_y1_z0, x2_y2_z1);
-    bboxes[4] = BoundingBox3f(x0_y0_z1, x1_y1_z2);
-    bboxes[5] = BoundingBox3f(x1_y0_z1, x2_y1_z2);
-    bboxes[6] = BoundingBox3f(x0_y1_z1, x1_y2_z2);
-    bboxes[7] = BoundingBox3f(x1_y1_z1, x2_y2_z2);
+bool Accel::testOccluder(const Ray3f& ray, const RayHit& occluder) const {
+    float u, v, t;
+    return occluder.mesh->rayIntersect(occluder.f, ray, u, v, t);
 }
 
+void Accel::computeSurfaceInteraction(const RayHit& hit, Intersection& its) const {
+    /* At this point, we now know that there is an intersection,
+       and we know the triangle index of the closest such intersection.
+
+       The following computes a number of additional properties which
+       characterize the intersection (normals, texture coordinates, etc..)
+    */
+    uint32_t f = hit.f;
+    its.t = hit.t;
+    its.mesh = hit.mesh;
+
+    /* Find the barycentric coordinates */
+    Vector3f bary;
+    bary << 1 - hit.uv.sum(), hit.uv;
+
+    /* References to all relevant mesh buffers */
+    const Mesh* mesh = hit.mesh;
+    const MatrixXfMap &V = mesh->getVertexPositions();
+    const MatrixXfMap &N = mesh->getVertexNormals();
+    const MatrixXfMap &UV = mesh->getVertexTexCoords();
+    const MatrixXuMap &F = mesh->getIndices();
+
+    /* Vertex indices of the triangle */
+    uint32_t idx0 = F(0, f), idx1 = F(1, f), idx2 = F(2, f);
+
+    Point3f p0 = V.col(idx0), p1 = V.col(idx1), p2 = V.col(idx2);
+
+    /* Compute the intersection positon accurately
+       using barycentric coordinates */
+    its.p = bary.x() * p0 + bary.y() * p1 + bary.z() * p2;
+
+    /* Bound the rounding error of the interpolation, which
+       spawned rays have to step over (see PBRT, section 3.9) */
+    its.pError = roundingError(7) * (std::abs(bary.x()) * p0.cwiseAbs() +
+        std::abs(bary.y()) * p1.cwiseAbs() + std::abs(bary.z()) * p2.cwiseAbs());
+
+    /* Compute proper texture coordinates if provided by the mesh */
+    if (UV.size() > 0)
+        its.uv = bary.x() * UV.col(idx0) +
+        bary.y() * UV.col(idx1) +
+        bary.z() * UV.col(idx2);
+
+    /* Compute the geometry frame */
+    its.geoFrame = Frame((p1 - p0).cross(p2 - p0).normalized());
+
+    if (N.size() > 0) {
+        /* Compute the shading frame. Note that for simplicity,
+           the current implementation doesn't attempt to provide
+           tangents that are continuous across the surface. That
+           means that this code will need to be modified to be able
+           use anisotropic BRDFs, which need tangent continuity */
+
+        its.shFrame = Frame(
+            (bary.x() * N.col(idx0) +
+                bary.y() * N.col(idx1) +
+                bary.z() * N.col(idx2)).normalized());
+    }
+    else {
+        its.shFrame = its.geoFrame;
+    }
+}
 
 NORI_NAMESPACE_END
-
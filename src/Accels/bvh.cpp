@@ -0,0 +1,1171 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/bvh.h>
+#include <tbb/parallel_for.h>
+#include <tbb/parallel_reduce.h>
+#include <tbb/parallel_invoke.h>
+#include <tbb/blocked_range.h>
+#include <tbb/enumerable_thread_specific.h>
+#include <chrono>
+
+using namespace std::chrono;
+
+NORI_NAMESPACE_BEGIN
+
+BVH::BVH(const PropertyList &props) {
+    m_num_bins = (uint32_t) props.getInteger("bins", 16);
+    m_max_leaf_size = (uint32_t) props.getInteger("maxLeafSize", 4);
+    m_traversal_cost = props.getFloat("traversalCost", 1.f);
+    m_intersection_cost = props.getFloat("intersectionCost", 1.f);
+    m_rebuild_threshold = props.getFloat("rebuildThreshold", 2.f);
+    m_spatial_splits = props.getBoolean("spatialSplits", false);
+    m_duplication_budget = props.getFloat("duplicationBudget", 0.3f);
+    m_split_alpha = props.getFloat("splitAlpha", 1e-5f);
+    m_fast_build = props.getBoolean("fastBuild", false);
+    m_cache_dir = props.getString("cacheDir", "");
+    m_occluder_cache = props.getBoolean("occluderCache", true);
+
+    if (m_num_bins < 2 || m_num_bins > MAX_BINS)
+        throw NoriException("BVH: the number of bins must be between 2 and %i!", MAX_BINS);
+    if (m_max_leaf_size < 1 || m_max_leaf_size > 0xFFFF)
+        throw NoriException("BVH: the maximum leaf size must be between 1 and %i!", 0xFFFF);
+    if (m_rebuild_threshold <= 1.f)
+        throw NoriException("BVH: the rebuild threshold must be larger than 1!");
+    if (m_duplication_budget < 0.f)
+        throw NoriException("BVH: the duplication budget must be positive!");
+    if (m_fast_build && m_spatial_splits)
+        throw NoriException("BVH: spatial splits can not be combined with the fast build!");
+}
+
+PropertyList BVH::getProperties() const {
+    PropertyList props;
+    props.setInteger("bins", (int) m_num_bins);
+    props.setInteger("maxLeafSize", (int) m_max_leaf_size);
+    props.setFloat("traversalCost", m_traversal_cost);
+    props.setFloat("intersectionCost", m_intersection_cost);
+    props.setFloat("rebuildThreshold", m_rebuild_threshold);
+    props.setBoolean("spatialSplits", m_spatial_splits);
+    props.setFloat("duplicationBudget", m_duplication_budget);
+    props.setFloat("splitAlpha", m_split_alpha);
+    props.setBoolean("fastBuild", m_fast_build);
+    props.setString("cacheDir", m_cache_dir);
+    props.setBoolean("occluderCache", m_occluder_cache);
+    return props;
+}
+
+void BVH::build() {
+    if (m_num_meshes == 0)
+        throw NoriException("No mesh found, could not build acceleration structure");
+
+    auto start = high_resolution_clock::now();
+    updatePrimitiveOffsets();
+
+    uint64_t cache_key = 0;
+    std::string cache_filename;
+    if (!m_cache_dir.empty()) {
+        cache_key = computeCacheKey();
+        cache_filename = cacheFilename(cache_key);
+        if (loadCache(cache_filename, cache_key)) {
+            printf("BVH loaded from cache \"%s\" in %ldms \n", cache_filename.c_str(),
+                duration_cast<milliseconds>(high_resolution_clock::now() - start).count());
+            printf("Num nodes: %d \n", m_num_nodes);
+            printf("Node memory: %s (mapped) \n", memString(m_cache_file->size()).c_str());
+            printf("SAH cost: %f \n", m_sah_cost);
+            return;
+        }
+    }
+
+    uint32_t num_triangles = getPrimitiveCount();
+    std::vector<PrimRef> refs(num_triangles);
+    for (uint32_t mesh_idx = 0; mesh_idx < m_num_meshes; mesh_idx++) {
+        const Mesh* mesh = m_meshes[mesh_idx];
+        uint32_t prim_offset = m_prim_offsets[mesh_idx];
+        tbb::parallel_for(tbb::blocked_range<uint32_t>(0, mesh->getTriangleCount()),
+            [&](const tbb::blocked_range<uint32_t>& range) {
+                for (uint32_t i = range.begin(); i < range.end(); i++) {
+                    PrimRef& ref = refs[prim_offset + i];
+                    ref.bbox = mesh->getBoundingBox(i);
+                    ref.centroid = ref.bbox.getCenter();
+                    ref.prim_id = prim_offset + i;
+                }
+            });
+    }
+
+    m_cache_file.reset();
+    m_nodes.clear();
+    m_num_nodes = m_num_leaf_nodes = m_max_leaf_triangles = m_depth = 0;
+    m_sah_cost = 0.f;
+
+    uint32_t num_spatial_splits = 0;
+    float sah_gain = 0.f;
+
+    if (num_triangles > 0) {
+        std::unique_ptr<BuildNode> root;
+        if (m_spatial_splits) {
+            root.reset(buildSpatialRecursive(refs, 0, (uint32_t) (num_triangles * m_duplication_budget)));
+            refs.clear();
+            gatherLeaves(root.get(), refs, num_spatial_splits, sah_gain);
+        } else if (m_fast_build) {
+            root.reset(buildLinear(refs));
+        } else {
+            root.reset(buildRecursive(refs, 0, num_triangles, 0));
+        }
+
+        flatten(root.get(), 0);
+        m_sah_cost /= m_nodes[0].bbox.getSurfaceArea();
+        sah_gain /= m_nodes[0].bbox.getSurfaceArea();
+    }
+    uint32_t num_refs = (uint32_t) refs.size();
+
+    m_build_areas.resize(m_nodes.size());
+    for (size_t i = 0; i < m_nodes.size(); i++)
+        m_build_areas[i] = m_nodes[i].bbox.getSurfaceArea();
+
+    /* Leaves reference contiguous ranges of the partitioned triangle list */
+    m_prim_ids.resize(num_refs);
+    tbb::parallel_for(tbb::blocked_range<uint32_t>(0, num_refs),
+        [&](const tbb::blocked_range<uint32_t>& range) {
+            for (uint32_t i = range.begin(); i < range.end(); i++)
+                m_prim_ids[i] = refs[i].prim_id;
+        });
+    mapArrays();
+
+    printf("BVH build time: %ldms \n", duration_cast<milliseconds>(high_resolution_clock::now() - start).count());
+    printf("Num nodes: %d \n", m_num_nodes);
+    printf("Num leaf nodes: %d \n", m_num_leaf_nodes);
+    printf("Avg triangles per leaf: %f \n", (float) num_refs / (float) std::max(m_num_leaf_nodes, 1u));
+    printf("Max triangles per leaf: %d \n", m_max_leaf_triangles);
+    printf("Depth: %d \n", m_depth);
+    printf("Node memory: %s \n", memString(m_nodes.size() * sizeof(Node) +
+        m_prim_ids.size() * sizeof(uint32_t)).c_str());
+    printf("SAH cost: %f \n", m_sah_cost);
+    if (m_spatial_splits) {
+        printf("Spatial splits: %d \n", num_spatial_splits);
+        printf("Duplicated references: %d (%.1f%%) \n", num_refs - num_triangles,
+            100.f * (num_refs - num_triangles) / (float) std::max(num_triangles, 1u));
+        printf("SAH cost reduction by spatial splits: %f (%.1f%%) \n", sah_gain,
+            100.f * sah_gain / (m_sah_cost + sah_gain));
+    }
+
+    if (!cache_filename.empty())
+        saveCache(cache_filename, cache_key);
+}
+
+void BVH::computeBounds(const std::vector<PrimRef>& refs, uint32_t begin, uint32_t end,
+    BoundingBox3f& bbox, BoundingBox3f& centroid_bbox) {
+    typedef std::pair<BoundingBox3f, BoundingBox3f> Bounds;
+
+    auto accumulate = [&](const tbb::blocked_range<uint32_t>& range, Bounds bounds) {
+        for (uint32_t i = range.begin(); i < range.end(); i++) {
+            bounds.first.expandBy(refs[i].bbox);
+            bounds.second.expandBy(refs[i].centroid);
+        }
+        return bounds;
+    };
+
+    Bounds bounds;
+    if (end - begin > PARALLEL_SPLIT_THRESHOLD) {
+        bounds = tbb::parallel_reduce(tbb::blocked_range<uint32_t>(begin, end), Bounds(), accumulate,
+            [](const Bounds& a, const Bounds& b) {
+                return Bounds(BoundingBox3f::merge(a.first, b.first), BoundingBox3f::merge(a.second, b.second));
+            });
+    } else {
+        bounds = accumulate(tbb::blocked_range<uint32_t>(begin, end), Bounds());
+    }
+    bbox = bounds.first;
+    centroid_bbox = bounds.second;
+}
+
+void BVH::radixSort(std::vector<uint64_t>& keys, int first_bit, int num_bits) {
+    const int RADIX_BITS = 8;
+    const uint32_t RADIX = 1u << RADIX_BITS;
+    const size_t BLOCK_SIZE = PARALLEL_SPLIT_THRESHOLD;
+
+    size_t num_keys = keys.size();
+    size_t num_blocks = (num_keys + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    std::vector<uint64_t> sorted(num_keys);
+    std::vector<size_t> offsets(num_blocks * RADIX);
+
+    for (int shift = first_bit; shift < first_bit + num_bits; shift += RADIX_BITS) {
+        auto digit = [&](uint64_t key) { return (uint32_t) (key >> shift) & (RADIX - 1); };
+
+        tbb::parallel_for(size_t(0), num_blocks, [&](size_t block) {
+            size_t* counts = &offsets[block * RADIX];
+            std::fill(counts, counts + RADIX, size_t(0));
+            for (size_t i = block * BLOCK_SIZE; i < std::min(num_keys, (block + 1) * BLOCK_SIZE); i++)
+                counts[digit(keys[i])]++;
+        });
+
+        /* Blocks with the same digit are written in order, which keeps the sort stable */
+        size_t sum = 0;
+        bool single_digit = false;
+        for (uint32_t d = 0; d < RADIX; d++) {
+            size_t digit_begin = sum;
+            for (size_t block = 0; block < num_blocks; block++) {
+                size_t count = offsets[block * RADIX + d];
+                offsets[block * RADIX + d] = sum;
+                sum += count;
+            }
+            single_digit |= sum - digit_begin == num_keys;
+        }
+        if (single_digit)
+            continue;
+
+        tbb::parallel_for(size_t(0), num_blocks, [&](size_t block) {
+            size_t* block_offsets = &offsets[block * RADIX];
+            for (size_t i = block * BLOCK_SIZE; i < std::min(num_keys, (block + 1) * BLOCK_SIZE); i++)
+                sorted[block_offsets[digit(keys[i])]++] = keys[i];
+        });
+        keys.swap(sorted);
+    }
+}
+
+template <typename Predicate>
+uint32_t BVH::partition(std::vector<PrimRef>& refs, uint32_t begin, uint32_t end, const Predicate& pred) {
+    if (end - begin <= PARALLEL_SPLIT_THRESHOLD)
+        return (uint32_t) (std::partition(refs.data() + begin, refs.data() + end, pred) - refs.data());
+
+    /* Count the references that go left in fixed-size blocks, then scatter
+       every block to its prefix-summed position in a temporary buffer */
+    const uint32_t block_size = PARALLEL_SPLIT_THRESHOLD / 16;
+    uint32_t num_blocks = (end - begin + block_size - 1) / block_size;
+    std::vector<uint32_t> left_offsets(num_blocks + 1, 0);
+
+    tbb::parallel_for(0u, num_blocks, [&](uint32_t block) {
+        uint32_t block_begin = begin + block * block_size, block_end = std::min(block_begin + block_size, end);
+        uint32_t count = 0;
+        for (uint32_t i = block_begin; i < block_end; i++)
+            count += pred(refs[i]) ? 1 : 0;
+        left_offsets[block + 1] = count;
+    });
+    for (uint32_t block = 0; block < num_blocks; block++)
+        left_offsets[block + 1] += left_offsets[block];
+
+    uint32_t num_left = left_offsets[num_blocks];
+    std::vector<PrimRef> temp(end - begin);
+
+    tbb::parallel_for(0u, num_blocks, [&](uint32_t block) {
+        uint32_t block_begin = begin + block * block_size, block_end = std::min(block_begin + block_size, end);
+        uint32_t left = left_offsets[block];
+        uint32_t right = num_left + (block_begin - begin) - left_offsets[block];
+        for (uint32_t i = block_begin; i < block_end; i++) {
+            if (pred(refs[i]))
+                temp[left++] = refs[i];
+            else
+                temp[right++] = refs[i];
+        }
+    });
+
+    tbb::parallel_for(tbb::blocked_range<uint32_t>(0, end - begin),
+        [&](const tbb::blocked_range<uint32_t>& range) {
+            std::copy(temp.begin() + range.begin(), temp.begin() + range.end(), refs.begin() + begin + range.begin());
+        });
+
+    return begin + num_left;
+}
+
+BVH::ObjectSplit BVH::findObjectSplit(const std::vector<PrimRef>& refs, uint32_t begin, uint32_t end,
+    const BoundingBox3f& centroid_bbox) const {
+    ObjectSplit split;
+    uint32_t num_triangles = end - begin;
+
+    /* Bin the triangle centroids along every axis */
+    struct Bins {
+        BoundingBox3f bboxes[3][MAX_BINS];
+        uint32_t counts[3][MAX_BINS] = {};
+    };
+
+    Vector3f extents = centroid_bbox.getExtents();
+    Vector3f scale;
+    for (int axis = 0; axis < 3; axis++)
+        scale[axis] = extents[axis] > 0.f ? m_num_bins / extents[axis] : 0.f;
+    const uint32_t num_bins = m_num_bins;
+    split.num_bins = num_bins;
+    split.min_val = centroid_bbox.min;
+    split.scale = scale;
+
+    auto accumulate = [&](const tbb::blocked_range<uint32_t>& range, Bins& bins) {
+        for (uint32_t i = range.begin(); i < range.end(); i++) {
+            for (int axis = 0; axis < 3; axis++) {
+                uint32_t bin = split.binIndex(refs[i], axis);
+                bins.bboxes[axis][bin].expandBy(refs[i].bbox);
+                bins.counts[axis][bin]++;
+            }
+        }
+    };
+
+    std::unique_ptr<Bins> bins(new Bins());
+    if (num_triangles > PARALLEL_SPLIT_THRESHOLD) {
+        tbb::enumerable_thread_specific<Bins> local_bins;
+        tbb::parallel_for(tbb::blocked_range<uint32_t>(begin, end),
+            [&](const tbb::blocked_range<uint32_t>& range) { accumulate(range, local_bins.local()); });
+        for (const Bins& local : local_bins) {
+            for (int axis = 0; axis < 3; axis++) {
+                for (uint32_t i = 0; i < num_bins; i++) {
+                    bins->bboxes[axis][i].expandBy(local.bboxes[axis][i]);
+                    bins->counts[axis][i] += local.counts[axis][i];
+                }
+            }
+        }
+    } else {
+        accumulate(tbb::blocked_range<uint32_t>(begin, end), *bins);
+    }
+
+    /* Sweep the bin boundaries to find the split with the lowest SAH cost */
+    BoundingBox3f right_bboxes[MAX_BINS];
+
+    for (int axis = 0; axis < 3; axis++) {
+        if (extents[axis] <= 0.f)
+            continue;
+
+        const BoundingBox3f* bin_bboxes = bins->bboxes[axis];
+        const uint32_t* bin_counts = bins->counts[axis];
+
+        /* Sweep from the right to collect the area/count of every right partition */
+        float right_areas[MAX_BINS];
+        uint32_t right_counts[MAX_BINS];
+        BoundingBox3f right_bbox;
+        uint32_t right_count = 0;
+        for (uint32_t i = num_bins - 1; i > 0; i--) {
+            right_bbox.expandBy(bin_bboxes[i]);
+            right_count += bin_counts[i];
+            right_areas[i] = right_count ? right_bbox.getSurfaceArea() : 0.f;
+            right_counts[i] = right_count;
+            right_bboxes[i] = right_bbox;
+        }
+
+        /* Sweep from the left and evaluate the split after every bin */
+        BoundingBox3f left_bbox;
+        uint32_t left_count = 0;
+        for (uint32_t i = 0; i < num_bins - 1; i++) {
+            left_bbox.expandBy(bin_bboxes[i]);
+            left_count += bin_counts[i];
+            if (left_count == 0 || right_counts[i + 1] == 0)
+                continue;
+            float cost = left_bbox.getSurfaceArea() * left_count + right_areas[i + 1] * right_counts[i + 1];
+            if (cost < split.cost) {
+                split.cost = cost;
+                split.axis = axis;
+                split.bin = i;
+                split.left_bbox = left_bbox;
+                split.right_bbox = right_bboxes[i + 1];
+            }
+        }
+    }
+
+    return split;
+}
+
+BVH::BuildNode* BVH::buildRecursive(std::vector<PrimRef>& refs, uint32_t begin, uint32_t end, uint32_t depth) const {
+    BuildNode* node = new BuildNode();
+
+    BoundingBox3f centroid_bbox;
+    computeBounds(refs, begin, end, node->bbox, centroid_bbox);
+
+    uint32_t num_triangles = end - begin;
+    auto makeLeaf = [&]() {
+        node->first = begin;
+        node->num_triangles = num_triangles;
+        return node;
+    };
+
+    if (num_triangles == 1 || depth + 1 >= MAX_DEPTH)
+        return makeLeaf();
+
+    ObjectSplit split = findObjectSplit(refs, begin, end, centroid_bbox);
+
+    float leaf_cost = m_intersection_cost * num_triangles;
+    uint32_t mid;
+
+    if (split.axis == -1) {
+        /* All centroids coincide: no plane separates the triangles */
+        if (num_triangles <= std::max(m_max_leaf_size, 0xFFu))
+            return makeLeaf();
+        mid = begin + num_triangles / 2;
+        split.axis = 0;
+    } else {
+        float split_cost = m_traversal_cost + m_intersection_cost * split.cost / node->bbox.getSurfaceArea();
+        if (num_triangles <= m_max_leaf_size && leaf_cost <= split_cost)
+            return makeLeaf();
+
+        mid = partition(refs, begin, end, [&](const PrimRef& ref) { return split.isLeft(ref); });
+    }
+
+    node->axis = (uint32_t) split.axis;
+    if (num_triangles > PARALLEL_BUILD_THRESHOLD) {
+        tbb::parallel_invoke(
+            [&] { node->children[0].reset(buildRecursive(refs, begin, mid, depth + 1)); },
+            [&] { node->children[1].reset(buildRecursive(refs, mid, end, depth + 1)); });
+    } else {
+        node->children[0].reset(buildRecursive(refs, begin, mid, depth + 1));
+        node->children[1].reset(buildRecursive(refs, mid, end, depth + 1));
+    }
+    return node;
+}
+
+BVH::BuildNode* BVH::buildLinear(std::vector<PrimRef>& refs) const {
+    uint32_t num_refs = (uint32_t) refs.size();
+    BoundingBox3f bbox, centroid_bbox;
+    computeBounds(refs, 0, num_refs, bbox, centroid_bbox);
+
+    /* Quantize the centroids to a 1024^3 grid; the reference index fills the lower half of the key */
+    Vector3f extents = centroid_bbox.getExtents();
+    Vector3f scale;
+    for (int axis = 0; axis < 3; axis++)
+        scale[axis] = extents[axis] > 0.f ? 1024.f / extents[axis] : 0.f;
+
+    std::vector<uint64_t> keys(num_refs);
+    tbb::parallel_for(tbb::blocked_range<uint32_t>(0, num_refs),
+        [&](const tbb::blocked_range<uint32_t>& range) {
+            for (uint32_t i = range.begin(); i < range.end(); i++) {
+                Vector3f cell = (refs[i].centroid - centroid_bbox.min).cwiseProduct(scale)
+                    .cwiseMax(Vector3f::Zero()).cwiseMin(Vector3f::Constant(1023.f));
+                uint32_t code = mortonCode((uint32_t) cell.x(), (uint32_t) cell.y(), (uint32_t) cell.z());
+                keys[i] = ((uint64_t) code << 32) | i;
+            }
+        });
+
+    radixSort(keys, 32, 30);
+
+    std::vector<PrimRef> sorted(num_refs);
+    std::vector<uint32_t> codes(num_refs);
+    tbb::parallel_for(tbb::blocked_range<uint32_t>(0, num_refs),
+        [&](const tbb::blocked_range<uint32_t>& range) {
+            for (uint32_t i = range.begin(); i < range.end(); i++) {
+                sorted[i] = refs[(uint32_t) keys[i]];
+                codes[i] = (uint32_t) (keys[i] >> 32);
+            }
+        });
+    refs.swap(sorted);
+
+    return buildLinearRecursive(refs, codes, 0, num_refs, 0);
+}
+
+BVH::BuildNode* BVH::buildLinearRecursive(const std::vector<PrimRef>& refs, const std::vector<uint32_t>& codes,
+    uint32_t begin, uint32_t end, uint32_t depth) const {
+    BuildNode* node = new BuildNode();
+    uint32_t num_triangles = end - begin;
+
+    if (num_triangles <= m_max_leaf_size || depth + 1 >= MAX_DEPTH) {
+        for (uint32_t i = begin; i < end; i++)
+            node->bbox.expandBy(refs[i].bbox);
+        node->first = begin;
+        node->num_triangles = num_triangles;
+        return node;
+    }
+
+    /* The codes of the range share all bits above the highest differing
+       one, so the range splits where that bit flips. Ranges of identical
+       codes are simply halved */
+    uint32_t mid = begin + num_triangles / 2;
+    uint32_t diff = codes[begin] ^ codes[end - 1];
+    if (diff != 0) {
+        int bit = 0;
+        while (diff >> (bit + 1))
+            bit++;
+        mid = (uint32_t) (std::partition_point(codes.begin() + begin, codes.begin() + end,
+            [bit](uint32_t code) { return !(code & (1u << bit)); }) - codes.begin());
+
+        /* Bits 3i + 2, 3i + 1 and 3i hold the x, y and z coordinates */
+        node->axis = (uint32_t) (2 - bit % 3);
+    }
+
+    if (num_triangles > PARALLEL_BUILD_THRESHOLD) {
+        tbb::parallel_invoke(
+            [&] { node->children[0].reset(buildLinearRecursive(refs, codes, begin, mid, depth + 1)); },
+            [&] { node->children[1].reset(buildLinearRecursive(refs, codes, mid, end, depth + 1)); });
+    } else {
+        node->children[0].reset(buildLinearRecursive(refs, codes, begin, mid, depth + 1));
+        node->children[1].reset(buildLinearRecursive(refs, codes, mid, end, depth + 1));
+    }
+    node->bbox = BoundingBox3f::merge(node->children[0]->bbox, node->children[1]->bbox);
+    return node;
+}
+
+BVH::BuildNode* BVH::buildSpatialRecursive(std::vector<PrimRef>& refs, uint32_t depth, uint32_t budget) const {
+    BuildNode* node = new BuildNode();
+
+    uint32_t num_refs = (uint32_t) refs.size();
+    BoundingBox3f centroid_bbox;
+    computeBounds(refs, 0, num_refs, node->bbox, centroid_bbox);
+
+    auto makeLeaf = [&]() {
+        node->num_triangles = num_refs;
+        node->refs.swap(refs);
+        return node;
+    };
+
+    if (num_refs == 1 || depth + 1 >= MAX_DEPTH)
+        return makeLeaf();
+
+    ObjectSplit object_split = findObjectSplit(refs, 0, num_refs, centroid_bbox);
+
+    /* Only try spatial splits where the children of the object split overlap noticeably */
+    SpatialSplit spatial_split;
+    if (budget > 0) {
+        float overlap = 0.f;
+        if (object_split.axis != -1) {
+            BoundingBox3f intersection(object_split.left_bbox.min.cwiseMax(object_split.right_bbox.min),
+                object_split.left_bbox.max.cwiseMin(object_split.right_bbox.max));
+            if (intersection.isValid())
+                overlap = intersection.getSurfaceArea();
+        }
+        if (object_split.axis == -1 || overlap > m_split_alpha * m_bbox.getSurfaceArea()) {
+            spatial_split = findSpatialSplit(refs, node->bbox);
+            if (spatial_split.num_left + spatial_split.num_right - num_refs > budget)
+                spatial_split.axis = -1;
+        }
+    }
+
+    bool use_spatial = spatial_split.axis != -1 && spatial_split.cost < object_split.cost;
+    float leaf_cost = m_intersection_cost * num_refs;
+    std::vector<PrimRef> left, right;
+
+    if (!use_spatial && object_split.axis == -1) {
+        /* All centroids coincide: no plane separates the triangles */
+        if (num_refs <= std::max(m_max_leaf_size, 0xFFu))
+            return makeLeaf();
+        left.assign(refs.begin(), refs.begin() + num_refs / 2);
+        right.assign(refs.begin() + num_refs / 2, refs.end());
+        node->axis = 0;
+    } else {
+        float best_cost = use_spatial ? spatial_split.cost : object_split.cost;
+        float split_cost = m_traversal_cost + m_intersection_cost * best_cost / node->bbox.getSurfaceArea();
+        if (num_refs <= m_max_leaf_size && leaf_cost <= split_cost)
+            return makeLeaf();
+
+        if (use_spatial) {
+            /* References straddling the plane go to both sides, clipped to their part */
+            int axis = spatial_split.axis;
+            float pos = spatial_split.pos;
+            left.reserve(spatial_split.num_left);
+            right.reserve(spatial_split.num_right);
+            for (const PrimRef& ref : refs) {
+                if (ref.bbox.max[axis] <= pos) {
+                    left.push_back(ref);
+                } else if (ref.bbox.min[axis] >= pos) {
+                    right.push_back(ref);
+                } else {
+                    PrimRef clipped = ref;
+                    clipped.bbox = clipReference(ref, axis, -std::numeric_limits<float>::infinity(), pos);
+                    if (clipped.bbox.isValid()) {
+                        clipped.centroid = clipped.bbox.getCenter();
+                        left.push_back(clipped);
+                    }
+                    clipped.bbox = clipReference(ref, axis, pos, std::numeric_limits<float>::infinity());
+                    if (clipped.bbox.isValid()) {
+                        clipped.centroid = clipped.bbox.getCenter();
+                        right.push_back(clipped);
+                    }
+                }
+            }
+            node->axis = (uint32_t) axis;
+            node->spatial = true;
+            if (object_split.axis != -1)
+                node->sah_gain = m_intersection_cost * (object_split.cost - spatial_split.cost);
+        } else {
+            auto mid = std::partition(refs.begin(), refs.end(), [&](const PrimRef& ref) { return object_split.isLeft(ref); });
+            left.assign(refs.begin(), mid);
+            right.assign(mid, refs.end());
+            node->axis = (uint32_t) object_split.axis;
+        }
+
+        if (left.empty() || right.empty()) {
+            /* Degenerate clipping results, keep everything in one leaf if possible */
+            if (num_refs <= std::max(m_max_leaf_size, 0xFFu)) {
+                node->spatial = false;
+                node->sah_gain = 0.f;
+                return makeLeaf();
+            }
+            left.assign(refs.begin(), refs.begin() + num_refs / 2);
+            right.assign(refs.begin() + num_refs / 2, refs.end());
+            node->spatial = false;
+            node->sah_gain = 0.f;
+        }
+    }
+    std::vector<PrimRef>().swap(refs);
+
+    /* Hand the remaining budget to the children in proportion to their size */
+    uint32_t num_left = (uint32_t) left.size(), num_right = (uint32_t) right.size();
+    uint32_t duplicates = num_left + num_right - num_refs;
+    uint32_t remaining = budget > duplicates ? budget - duplicates : 0;
+    uint32_t left_budget = (uint32_t) ((uint64_t) remaining * num_left / (num_left + num_right));
+    uint32_t right_budget = remaining - left_budget;
+
+    if (num_refs > PARALLEL_BUILD_THRESHOLD) {
+        tbb::parallel_invoke(
+            [&] { node->children[0].reset(buildSpatialRecursive(left, depth + 1, left_budget)); },
+            [&] { node->children[1].reset(buildSpatialRecursive(right, depth + 1, right_budget)); });
+    } else {
+        node->children[0].reset(buildSpatialRecursive(left, depth + 1, left_budget));
+        node->children[1].reset(buildSpatialRecursive(right, depth + 1, right_budget));
+    }
+    return node;
+}
+
+BVH::SpatialSplit BVH::findSpatialSplit(const std::vector<PrimRef>& refs, const BoundingBox3f& bbox) const {
+    struct Bins {
+        BoundingBox3f bboxes[3][MAX_BINS];
+        uint32_t entries[3][MAX_BINS] = {};  ///< References starting in a bin
+        uint32_t exits[3][MAX_BINS] = {};    ///< References ending in a bin
+    };
+
+    const uint32_t num_bins = m_num_bins;
+    Vector3f extents = bbox.getExtents();
+    auto binIndex = [&](float value, int axis) {
+        int bin = (int) ((value - bbox.min[axis]) * num_bins / extents[axis]);
+        return (uint32_t) std::min(std::max(bin, 0), (int) num_bins - 1);
+    };
+
+    /* Every reference is clipped to all bins it overlaps */
+    auto accumulate = [&](const tbb::blocked_range<uint32_t>& range, Bins& bins) {
+        for (uint32_t i = range.begin(); i < range.end(); i++) {
+            const PrimRef& ref = refs[i];
+            for (int axis = 0; axis < 3; axis++) {
+                if (extents[axis] <= 0.f)
+                    continue;
+                uint32_t first = binIndex(ref.bbox.min[axis], axis);
+                uint32_t last = binIndex(ref.bbox.max[axis], axis);
+                if (first == last) {
+                    bins.bboxes[axis][first].expandBy(ref.bbox);
+                } else {
+                    float width = extents[axis] / num_bins;
+                    for (uint32_t bin = first; bin <= last; bin++) {
+                        float lo = bbox.min[axis] + bin * width;
+                        BoundingBox3f clipped = clipReference(ref, axis, lo, bin == num_bins - 1 ? bbox.max[axis] : lo + width);
+                        if (clipped.isValid())
+                            bins.bboxes[axis][bin].expandBy(clipped);
+                    }
+                }
+                bins.entries[axis][first]++;
+                bins.exits[axis][last]++;
+            }
+        }
+    };
+
+    std::unique_ptr<Bins> bins(new Bins());
+    uint32_t num_refs = (uint32_t) refs.size();
+    if (num_refs > PARALLEL_SPLIT_THRESHOLD) {
+        tbb::enumerable_thread_specific<Bins> local_bins;
+        tbb::parallel_for(tbb::blocked_range<uint32_t>(0, num_refs),
+            [&](const tbb::blocked_range<uint32_t>& range) { accumulate(range, local_bins.local()); });
+        for (const Bins& local : local_bins) {
+            for (int axis = 0; axis < 3; axis++) {
+                for (uint32_t i = 0; i < num_bins; i++) {
+                    bins->bboxes[axis][i].expandBy(local.bboxes[axis][i]);
+                    bins->entries[axis][i] += local.entries[axis][i];
+                    bins->exits[axis][i] += local.exits[axis][i];
+                }
+            }
+        }
+    } else {
+        accumulate(tbb::blocked_range<uint32_t>(0, num_refs), *bins);
+    }
+
+    /* Sweep the bin boundaries like for object splits: references that end
+       left of a plane count on the left, those that start right of it on the
+       right, and straddling references on both sides */
+    SpatialSplit split;
+    for (int axis = 0; axis < 3; axis++) {
+        if (extents[axis] <= 0.f)
+            continue;
+
+        float right_areas[MAX_BINS];
+        uint32_t right_counts[MAX_BINS];
+        BoundingBox3f right_bbox;
+        uint32_t right_count = 0;
+        for (uint32_t i = num_bins - 1; i > 0; i--) {
+            right_bbox.expandBy(bins->bboxes[axis][i]);
+            right_count += bins->exits[axis][i];
+            right_areas[i] = right_bbox.isValid() ? right_bbox.getSurfaceArea() : 0.f;
+            right_counts[i] = right_count;
+        }
+
+        BoundingBox3f left_bbox;
+        uint32_t left_count = 0;
+        for (uint32_t i = 0; i < num_bins - 1; i++) {
+            left_bbox.expandBy(bins->bboxes[axis][i]);
+            left_count += bins->entries[axis][i];
+            if (left_count == 0 || right_counts[i + 1] == 0)
+                continue;
+            float cost = left_bbox.getSurfaceArea() * left_count + right_areas[i + 1] * right_counts[i + 1];
+            if (cost < split.cost) {
+                split.cost = cost;
+                split.axis = axis;
+                split.pos = bbox.min[axis] + (i + 1) * (extents[axis] / num_bins);
+                split.num_left = left_count;
+                split.num_right = right_counts[i + 1];
+            }
+        }
+    }
+    return split;
+}
+
+BoundingBox3f BVH::clipReference(const PrimRef& ref, int axis, float lo, float hi) const {
+    uint32_t mesh_idx, triangle_idx;
+    resolvePrimitive(ref.prim_id, mesh_idx, triangle_idx);
+    const MatrixXfMap &V = m_meshes[mesh_idx]->getVertexPositions();
+    const MatrixXuMap &F = m_meshes[mesh_idx]->getIndices();
+    Point3f p[3] = { V.col(F(0, triangle_idx)), V.col(F(1, triangle_idx)), V.col(F(2, triangle_idx)) };
+
+    /* Bounds of the triangle vertices inside the slab and of the points
+       where its edges cross the slab planes */
+    BoundingBox3f bbox;
+    for (int i = 0; i < 3; i++) {
+        const Point3f& a = p[i];
+        const Point3f& b = p[(i + 1) % 3];
+        if (a[axis] >= lo && a[axis] <= hi)
+            bbox.expandBy(a);
+        for (float plane : { lo, hi }) {
+            if ((a[axis] < plane && b[axis] > plane) || (a[axis] > plane && b[axis] < plane)) {
+                float t = (plane - a[axis]) / (b[axis] - a[axis]);
+                Point3f q = a + t * (b - a);
+                q[axis] = plane;
+                bbox.expandBy(q);
+            }
+        }
+    }
+
+    /* The reference may already have been clipped by earlier splits */
+    bbox.min = bbox.min.cwiseMax(ref.bbox.min);
+    bbox.max = bbox.max.cwiseMin(ref.bbox.max);
+    return bbox;
+}
+
+void BVH::gatherLeaves(BuildNode* node, std::vector<PrimRef>& refs, uint32_t& num_spatial_splits, float& sah_gain) const {
+    if (node->num_triangles > 0) {
+        node->first = (uint32_t) refs.size();
+        refs.insert(refs.end(), node->refs.begin(), node->refs.end());
+        std::vector<PrimRef>().swap(node->refs);
+        return;
+    }
+    if (node->spatial) {
+        num_spatial_splits++;
+        sah_gain += node->sah_gain;
+    }
+    gatherLeaves(node->children[0].get(), refs, num_spatial_splits, sah_gain);
+    gatherLeaves(node->children[1].get(), refs, num_spatial_splits, sah_gain);
+}
+
+uint32_t BVH::flatten(const BuildNode* build_node, uint32_t depth, uint32_t ref_offset) {
+    uint32_t node_idx = (uint32_t) m_nodes.size();
+    m_nodes.emplace_back();
+    m_num_nodes++;
+    m_depth = std::max(m_depth, depth);
+
+    Node& node = m_nodes[node_idx];
+    node.bbox = build_node->bbox;
+    node.axis = (uint8_t) build_node->axis;
+    node.pad = 0;
+
+    if (build_node->num_triangles > 0) {
+        /* Leaves are forced at the maximum depth regardless of their size */
+        if (build_node->num_triangles > MAX_LEAF_TRIANGLES)
+            throw NoriException("BVH: a leaf at depth %i would hold %i triangles, but at most %i are supported!",
+                depth, build_node->num_triangles, MAX_LEAF_TRIANGLES);
+        node.offset = build_node->first + ref_offset;
+        node.num_triangles = (uint16_t) build_node->num_triangles;
+        m_num_leaf_nodes++;
+        m_max_leaf_triangles = std::max(m_max_leaf_triangles, build_node->num_triangles);
+        m_sah_cost += m_intersection_cost * build_node->num_triangles * build_node->bbox.getSurfaceArea();
+    } else {
+        node.num_triangles = 0;
+        m_sah_cost += m_traversal_cost * build_node->bbox.getSurfaceArea();
+
+        /* The first child directly follows its parent */
+        flatten(build_node->children[0].get(), depth + 1, ref_offset);
+        uint32_t second_child = flatten(build_node->children[1].get(), depth + 1, ref_offset);
+        m_nodes[node_idx].offset = second_child;
+    }
+    return node_idx;
+}
+
+void BVH::refit() {
+    updateBoundingBox();
+    updatePrimitiveOffsets();
+    if (m_cache_file)
+        copyMappedArrays();
+    if (m_nodes.empty() || getPrimitiveCount() != m_prim_ids.size() || m_spatial_splits) {
+        /* The topology changed (or the leaves hold clipped references), nothing to refit */
+        build();
+        return;
+    }
+
+    auto start = high_resolution_clock::now();
+
+    refitRecursive(0, 0);
+
+    /* Subtrees are compared against the growth of the whole scene, so that
+       moving or scaling everything uniformly never triggers a rebuild */
+    float scene_growth = m_build_areas[0] > 0.f ? m_nodes[0].bbox.getSurfaceArea() / m_build_areas[0] : 1.f;
+    std::vector<std::pair<uint32_t, uint32_t>> degraded;
+    findDegraded(0, 0, m_rebuild_threshold * scene_growth, degraded);
+
+    uint32_t rebuilt_triangles = 0;
+    if (!degraded.empty()) {
+        /* Rebuild the degraded subtrees over their own (disjoint) ranges of triangle references */
+        std::vector<std::unique_ptr<BuildNode>> roots(degraded.size());
+        std::vector<uint32_t> ref_offsets(degraded.size());
+        tbb::parallel_for(size_t(0), degraded.size(), [&](size_t i) {
+            uint32_t first, end;
+            subtreeRange(degraded[i].first, first, end);
+
+            std::vector<PrimRef> refs(end - first);
+            for (uint32_t j = 0; j < end - first; j++) {
+                PrimRef& ref = refs[j];
+                uint32_t mesh_idx, triangle_idx;
+                ref.prim_id = m_prim_ids[first + j];
+                resolvePrimitive(ref.prim_id, mesh_idx, triangle_idx);
+                ref.bbox = m_meshes[mesh_idx]->getBoundingBox(triangle_idx);
+                ref.centroid = ref.bbox.getCenter();
+            }
+
+            roots[i].reset(buildRecursive(refs, 0, end - first, degraded[i].second));
+
+            for (uint32_t j = 0; j < end - first; j++)
+                m_prim_ids[first + j] = refs[j].prim_id;
+            ref_offsets[i] = first;
+        });
+
+        std::unordered_map<uint32_t, std::pair<BuildNode*, uint32_t>> rebuilt;
+        for (size_t i = 0; i < degraded.size(); i++) {
+            rebuilt[degraded[i].first] = std::make_pair(roots[i].get(), ref_offsets[i]);
+            uint32_t first, end;
+            subtreeRange(degraded[i].first, first, end);
+            rebuilt_triangles += end - first;
+        }
+
+        /* Copy the tree in depth-first order, splicing in the new subtrees */
+        std::vector<Node, tbb::cache_aligned_allocator<Node>> old_nodes;
+        std::vector<float> old_areas;
+        old_nodes.swap(m_nodes);
+        old_areas.swap(m_build_areas);
+        m_nodes.reserve(old_nodes.size());
+        m_build_areas.reserve(old_nodes.size());
+        m_num_nodes = m_num_leaf_nodes = m_max_leaf_triangles = m_depth = 0;
+        relink(old_nodes, old_areas, 0, 0, rebuilt);
+        mapArrays();
+    }
+
+    m_sah_cost = computeSAHCost();
+
+    printf("BVH refit time: %ldms \n", duration_cast<milliseconds>(high_resolution_clock::now() - start).count());
+    printf("Rebuilt subtrees: %d (%d triangles) \n", (int) degraded.size(), rebuilt_triangles);
+    printf("SAH cost: %f \n", m_sah_cost);
+}
+
+BoundingBox3f BVH::refitRecursive(uint32_t node_idx, uint32_t depth) {
+    Node& node = m_nodes[node_idx];
+    BoundingBox3f bbox;
+
+    if (node.isLeaf()) {
+        for (uint32_t i = node.offset; i < node.offset + node.num_triangles; i++) {
+            uint32_t mesh_idx, triangle_idx;
+            resolvePrimitive(m_prim_ids[i], mesh_idx, triangle_idx);
+            bbox.expandBy(m_meshes[mesh_idx]->getBoundingBox(triangle_idx));
+        }
+    } else if (depth < PARALLEL_REFIT_DEPTH) {
+        BoundingBox3f left, right;
+        tbb::parallel_invoke(
+            [&] { left = refitRecursive(node_idx + 1, depth + 1); },
+            [&] { right = refitRecursive(node.offset, depth + 1); });
+        bbox = BoundingBox3f::merge(left, right);
+    } else {
+        bbox = BoundingBox3f::merge(refitRecursive(node_idx + 1, depth + 1), refitRecursive(node.offset, depth + 1));
+    }
+
+    node.bbox = bbox;
+    return bbox;
+}
+
+void BVH::findDegraded(uint32_t node_idx, uint32_t depth, float threshold,
+    std::vector<std::pair<uint32_t, uint32_t>>& degraded) const {
+    const Node& node = m_nodes[node_idx];
+    if (node.isLeaf())
+        return;
+
+    float build_area = m_build_areas[node_idx];
+    if (build_area > 0.f && node.bbox.getSurfaceArea() > threshold * build_area) {
+        degraded.emplace_back(node_idx, depth);
+        return;
+    }
+
+    findDegraded(node_idx + 1, depth + 1, threshold, degraded);
+    findDegraded(node.offset, depth + 1, threshold, degraded);
+}
+
+uint32_t BVH::relink(const std::vector<Node, tbb::cache_aligned_allocator<Node>>& old_nodes,
+    const std::vector<float>& old_areas, uint32_t old_idx, uint32_t depth,
+    const std::unordered_map<uint32_t, std::pair<BuildNode*, uint32_t>>& rebuilt) {
+    uint32_t node_idx = (uint32_t) m_nodes.size();
+
+    auto it = rebuilt.find(old_idx);
+    if (it != rebuilt.end()) {
+        flatten(it->second.first, depth, it->second.second);
+        for (size_t i = node_idx; i < m_nodes.size(); i++)
+            m_build_areas.push_back(m_nodes[i].bbox.getSurfaceArea());
+        return node_idx;
+    }
+
+    const Node& old_node = old_nodes[old_idx];
+    m_nodes.push_back(old_node);
+    m_build_areas.push_back(old_areas[old_idx]);
+    m_num_nodes++;
+    m_depth = std::max(m_depth, depth);
+
+    if (old_node.isLeaf()) {
+        m_num_leaf_nodes++;
+        m_max_leaf_triangles = std::max(m_max_leaf_triangles, (uint32_t) old_node.num_triangles);
+    } else {
+        relink(old_nodes, old_areas, old_idx + 1, depth + 1, rebuilt);
+        uint32_t second_child = relink(old_nodes, old_areas, old_node.offset, depth + 1, rebuilt);
+        m_nodes[node_idx].offset = second_child;
+    }
+    return node_idx;
+}
+
+void BVH::subtreeRange(uint32_t node_idx, uint32_t& first, uint32_t& end) const {
+    uint32_t left = node_idx, right = node_idx;
+    while (!m_nodes[left].isLeaf())
+        left = left + 1;
+    while (!m_nodes[right].isLeaf())
+        right = m_nodes[right].offset;
+    first = m_nodes[left].offset;
+    end = m_nodes[right].offset + m_nodes[right].num_triangles;
+}
+
+float BVH::computeSAHCost() const {
+    float cost = 0.f;
+    for (const Node& node : m_nodes) {
+        if (node.isLeaf())
+            cost += m_intersection_cost * node.num_triangles * node.bbox.getSurfaceArea();
+        else
+            cost += m_traversal_cost * node.bbox.getSurfaceArea();
+    }
+    return cost / m_nodes[0].bbox.getSurfaceArea();
+}
+
+bool BVH::traverse(Ray3f& ray, RayHit& hit, bool shadowRay) const {
+    if (!m_node_data)
+        return false;
+
+    bool foundIntersection = false;
+    bool dir_is_neg[3] = { ray.dRcp.x() < 0, ray.dRcp.y() < 0, ray.dRcp.z() < 0 };
+
+    uint32_t stack[MAX_DEPTH];
+    uint32_t stack_size = 0;
+    uint32_t node_idx = 0;
+
+    while (true) {
+        const Node& node = m_node_data[node_idx];
+        float nearT;
+        NORI_STAT(nodes_visited, 1);
+        NORI_STAT(box_tests, 1);
+
+        if (node.bbox.raySegmentIntersect(ray, nearT)) {
+            if (node.isLeaf()) {
+                if (intersectLeaf(node.offset, node.num_triangles, ray, hit, shadowRay)) {
+                    if (shadowRay)
+                        return true;
+                    foundIntersection = true;
+                }
+            } else {
+                /* Visit the child on the near side of the split first */
+                if (dir_is_neg[node.axis]) {
+                    stack[stack_size++] = node_idx + 1;
+                    node_idx = node.offset;
+                } else {
+                    stack[stack_size++] = node.offset;
+                    node_idx = node_idx + 1;
+                }
+                continue;
+            }
+        }
+
+        if (stack_size == 0)
+            break;
+        node_idx = stack[--stack_size];
+    }
+
+    return foundIntersection;
+}
+
+void BVH::rayIntersectPacket(const Ray3f* rays_, uint32_t count, Intersection* its, bool* hits) const {
+    /* The near child is chosen once for the whole packet, which
+       requires the directions to lie in the same octant */
+    if (count < 2 || !sameOctant(rays_, count)) {
+        Accel::rayIntersectPacket(rays_, count, its, hits);
+        return;
+    }
+
+    Ray3f rays[MAX_PACKET_SIZE];
+    RayHit packet_hits[MAX_PACKET_SIZE];
+    for (uint32_t i = 0; i < count; ++i)
+        rays[i] = rays_[i];
+
+    traversePacket(rays, count, packet_hits);
+
+    for (uint32_t i = 0; i < count; ++i) {
+        hits[i] = packet_hits[i].hasHit();
+        if (hits[i])
+            computeSurfaceInteraction(packet_hits[i], its[i]);
+    }
+}
+
+bool BVH::sameOctant(const Ray3f* rays, uint32_t count) {
+    for (uint32_t i = 1; i < count; ++i)
+        for (int axis = 0; axis < 3; axis++)
+            if ((rays[i].dRcp[axis] < 0) != (rays[0].dRcp[axis] < 0))
+                return false;
+    return true;
+}
+
+void BVH::traversePacket(Ray3f* rays, uint32_t count, RayHit* hits) const {
+    if (!m_node_data)
+        return;
+
+    PacketBounds bounds = { rays[0].o, rays[0].o, rays[0].dRcp, rays[0].dRcp, rays[0].mint, rays[0].maxt };
+    for (uint32_t i = 1; i < count; ++i) {
+        bounds.o_min = bounds.o_min.cwiseMin(rays[i].o);
+        bounds.o_max = bounds.o_max.cwiseMax(rays[i].o);
+        bounds.rcp_min = bounds.rcp_min.cwiseMin(rays[i].dRcp);
+        bounds.rcp_max = bounds.rcp_max.cwiseMax(rays[i].dRcp);
+        bounds.mint = std::min(bounds.mint, rays[i].mint);
+        bounds.maxt = std::max(bounds.maxt, rays[i].maxt);
+    }
+    bool dir_is_neg[3] = { rays[0].dRcp.x() < 0, rays[0].dRcp.y() < 0, rays[0].dRcp.z() < 0 };
+
+    /* Every entry remembers the first ray that may hit the node */
+    struct StackEntry {
+        uint32_t node_idx;
+        uint32_t first;
+    };
+    StackEntry stack[MAX_DEPTH];
+    uint32_t stack_size = 0;
+    uint32_t node_idx = 0;
+    uint32_t first = 0;
+
+    while (true) {
+        const Node& node = m_node_data[node_idx];
+        float nearT;
+        NORI_STAT(nodes_visited, 1);
+        NORI_STAT(box_tests, 1);
+
+        /* Enter the node with the first active ray that hits it */
+        bool hit = node.bbox.raySegmentIntersect(rays[first], nearT);
+        if (!hit && bounds.intersects(node.bbox)) {
+            while (++first < count) {
+                NORI_STAT(box_tests, 1);
+                if (node.bbox.raySegmentIntersect(rays[first], nearT)) {
+                    hit = true;
+                    break;
+                }
+            }
+        }
+
+        if (hit) {
+            if (node.isLeaf()) {
+                NORI_STAT(box_tests, count - first - 1);
+                for (uint32_t i = first; i < count; ++i) {
+                    if (i == first || node.bbox.raySegmentIntersect(rays[i], nearT))
+                        intersectLeaf(node.offset, node.num_triangles, rays[i], hits[i], false);
+                }
+            } else {
+                /* Visit the child on the near side of the split first */
+                if (dir_is_neg[node.axis]) {
+                    stack[stack_size++] = { node_idx + 1, first };
+                    node_idx = node.offset;
+                } else {
+                    stack[stack_size++] = { node.offset, first };
+                    node_idx = node_idx + 1;
+                }
+                continue;
+            }
+        }
+
+        if (stack_size == 0)
+            break;
+        --stack_size;
+        node_idx = stack[stack_size].node_idx;
+        first = stack[stack_size].first;
+    }
+}
+
+bool BVH::traverseOccluded(const Ray3f& ray, RayHit& occluder) const {
+    if (!m_node_data)
+        return false;
+
+    /* Any hit ends the query, so the children are not ordered */
+    uint32_t stack[MAX_DEPTH];
+    uint32_t stack_size = 0;
+    uint32_t node_idx = 0;
+
+    while (true) {
+        const Node& node = m_node_data[node_idx];
+        float nearT;
+        NORI_STAT(nodes_visited, 1);
+        NORI_STAT(box_tests, 1);
+
+        if (node.bbox.raySegmentIntersect(ray, nearT)) {
+            if (!node.isLeaf()) {
+                stack[stack_size++] = node.offset;
+                node_idx = node_idx + 1;
+                continue;
+            }
+            if (occludedLeaf(node.offset, node.num_triangles, ray, occluder))
+                return true;
+        }
+
+        if (stack_size == 0)
+            return false;
+        node_idx = stack[--stack_size];
+    }
+}
+
+std::string BVH::toString() const {
+    return tfm::format(
+        "BVH[\n"
+        "  bins = %i,\n"
+        "  maxLeafSize = %i,\n"
+        "  traversalCost = %f,\n"
+        "  intersectionCost = %f,\n"
+        "  rebuildThreshold = %f,\n"
+        "  spatialSplits = %s,\n"
+        "  duplicationBudget = %f,\n"
+        "  splitAlpha = %f,\n"
+        "  fastBuild = %s,\n"
+        "  cacheDir = \"%s\",\n"
+        "  occluderCache = %s\n"
+        "]",
+        m_num_bins,
+        m_max_leaf_size,
+        m_traversal_cost,
+        m_intersection_cost,
+        m_rebuild_threshold,
+        m_spatial_splits ? "true" : "false",
+        m_duplication_budget,
+        m_split_alpha,
+        m_fast_build ? "true" : "false",
+        m_cache_dir,
+        m_occluder_cache ? "true" : "false"
+    );
+}
+
+NORI_REGISTER_CLASS(BVH, "bvh");
+NORI_NAMESPACE_END
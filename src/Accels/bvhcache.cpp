@@ -0,0 +1,231 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <nori/bvh.h>
+#include <nori/mesh.h>
+#include <nori/mappedfile.h>
+#include <filesystem/resolver.h>
+#include <fstream>
+#include <cstring>
+#include <cstddef>
+#include <cstdio>
+#include <thread>
+#include <type_traits>
+
+#if defined(PLATFORM_WINDOWS)
+#include <direct.h>
+#include <process.h>
+#else
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+NORI_NAMESPACE_BEGIN
+
+namespace {
+    /// Increase when the file layout or the builder changes
+    constexpr uint32_t CACHE_VERSION = 2;
+
+    /**
+     * Header of a cache file. It is followed by the nodes and the global
+     * primitive ids of the leaves; the header size keeps the nodes aligned.
+     */
+    struct CacheHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t node_size;
+        uint64_t key;
+        uint64_t num_nodes;
+        uint64_t num_refs;
+        uint32_t num_leaf_nodes;
+        uint32_t max_leaf_triangles;
+        uint32_t depth;
+        float sah_cost;
+        uint32_t pad[2];
+    };
+    static_assert(sizeof(CacheHeader) == 64, "Cache header should be 64 bytes");
+
+    const char CACHE_MAGIC[8] = { 'N', 'O', 'R', 'I', 'B', 'V', 'H', '\0' };
+}
+
+uint64_t BVH::computeCacheKey() const {
+    uint64_t key = 0;
+    auto hashValue = [&key](auto value) { key = hashBytes(&value, sizeof(value), key); };
+
+    hashValue(CACHE_VERSION);
+    hashValue((uint32_t) sizeof(Node));
+    hashValue(m_num_bins);
+    hashValue(m_max_leaf_size);
+    hashValue(m_traversal_cost);
+    hashValue(m_intersection_cost);
+    hashValue(m_spatial_splits);
+    hashValue(m_duplication_budget);
+    hashValue(m_split_alpha);
+    hashValue(m_fast_build);
+
+    hashValue(m_num_meshes);
+    for (uint32_t mesh_idx = 0; mesh_idx < m_num_meshes; mesh_idx++) {
+        const MatrixXfMap &V = m_meshes[mesh_idx]->getVertexPositions();
+        const MatrixXuMap &F = m_meshes[mesh_idx]->getIndices();
+        hashValue((uint64_t) V.cols());
+        hashValue((uint64_t) F.cols());
+        key = hashBytes(V.data(), sizeof(float) * V.size(), key);
+        key = hashBytes(F.data(), sizeof(uint32_t) * F.size(), key);
+    }
+    return key;
+}
+
+std::string BVH::cacheFilename(uint64_t key) const {
+    filesystem::path dir(m_cache_dir);
+    if (!dir.is_absolute())
+        dir = (*getFileResolver())[0] / dir;
+    return (dir / filesystem::path(tfm::format("bvh_%016x.cache", key))).str();
+}
+
+bool BVH::loadCache(const std::string& filename, uint64_t key) {
+    /* Traversal reads the nodes straight from the file, so they must be
+       stored exactly like in memory */
+    static_assert(std::is_standard_layout<Node>::value && std::is_trivially_destructible<Node>::value,
+        "BVH nodes are read from cache files byte-wise");
+    static_assert(sizeof(BoundingBox3f) == 24 && offsetof(Node, offset) == 24 &&
+        offsetof(Node, num_triangles) == 28 && offsetof(Node, axis) == 30,
+        "Changing the BVH node layout requires a new cache version");
+    static_assert(sizeof(CacheHeader) % alignof(Node) == 0, "The cache header must keep the nodes aligned");
+
+    m_cache_file.reset(new MappedFile(filename, false));
+    const MappedFile& file = *m_cache_file;
+    if (!file.data() || file.size() < sizeof(CacheHeader)) {
+        m_cache_file.reset();
+        return false;
+    }
+
+    CacheHeader header;
+    memcpy(&header, file.data(), sizeof(CacheHeader));
+    size_t nodes_size = header.num_nodes * sizeof(Node);
+    size_t refs_size = header.num_refs * sizeof(uint32_t);
+    bool valid = memcmp(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) == 0 &&
+        header.version == CACHE_VERSION && header.node_size == sizeof(Node) &&
+        header.key == key && header.num_nodes > 0;
+    if (valid && file.size() != sizeof(CacheHeader) + nodes_size + refs_size) {
+        cerr << "Warning: ignoring truncated BVH cache file \"" << filename << "\"" << endl;
+        valid = false;
+    }
+    /* Mappings start at page boundaries, so this only fails on exotic platforms */
+    if (valid && (uintptr_t) (file.data() + sizeof(CacheHeader)) % alignof(Node) != 0) {
+        cerr << "Warning: ignoring misaligned BVH cache file \"" << filename << "\"" << endl;
+        valid = false;
+    }
+    if (!valid) {
+        m_cache_file.reset();
+        return false;
+    }
+
+    std::vector<Node, tbb::cache_aligned_allocator<Node>>().swap(m_nodes);
+    std::vector<uint32_t>().swap(m_prim_ids);
+    std::vector<float>().swap(m_build_areas);
+    m_node_data = reinterpret_cast<const Node*>(file.data() + sizeof(CacheHeader));
+    m_prim_id_data = reinterpret_cast<const uint32_t*>(file.data() + sizeof(CacheHeader) + nodes_size);
+
+    m_num_nodes = (uint32_t) header.num_nodes;
+    m_num_leaf_nodes = header.num_leaf_nodes;
+    m_max_leaf_triangles = header.max_leaf_triangles;
+    m_depth = header.depth;
+    m_sah_cost = header.sah_cost;
+    return true;
+}
+
+void BVH::mapArrays() {
+    m_node_data = m_nodes.empty() ? nullptr : m_nodes.data();
+    m_prim_id_data = m_prim_ids.empty() ? nullptr : m_prim_ids.data();
+}
+
+void BVH::copyMappedArrays() {
+    if (!m_cache_file)
+        return;
+
+    const CacheHeader* header = reinterpret_cast<const CacheHeader*>(m_cache_file->data());
+    m_nodes.assign(m_node_data, m_node_data + header->num_nodes);
+    m_prim_ids.assign(m_prim_id_data, m_prim_id_data + header->num_refs);
+    m_cache_file.reset();
+    mapArrays();
+
+    m_build_areas.resize(m_nodes.size());
+    for (size_t i = 0; i < m_nodes.size(); i++)
+        m_build_areas[i] = m_nodes[i].bbox.getSurfaceArea();
+}
+
+void BVH::saveCache(const std::string& filename, uint64_t key) const {
+    if (m_nodes.empty())
+        return;
+
+    filesystem::path dir = filesystem::path(filename).parent_path();
+    if (!dir.empty() && !dir.is_directory()) {
+#if defined(PLATFORM_WINDOWS)
+        _mkdir(dir.str().c_str());
+#else
+        mkdir(dir.str().c_str(), 0755);
+#endif
+    }
+
+    CacheHeader header;
+    memset(&header, 0, sizeof(CacheHeader));
+    memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    header.version = CACHE_VERSION;
+    header.node_size = sizeof(Node);
+    header.key = key;
+    header.num_nodes = m_nodes.size();
+    header.num_refs = m_prim_ids.size();
+    header.num_leaf_nodes = m_num_leaf_nodes;
+    header.max_leaf_triangles = m_max_leaf_triangles;
+    header.depth = m_depth;
+    header.sah_cost = m_sah_cost;
+
+    /* Write to a temporary file first, so that concurrent runs never see
+       a partially written cache file. Every writer uses its own temporary
+       file (named after the process and thread), so concurrent writers of
+       the same key cannot interleave their writes */
+#if defined(PLATFORM_WINDOWS)
+    int pid = _getpid();
+#else
+    int pid = (int) getpid();
+#endif
+    std::string tmp_filename = tfm::format("%s.%i-%016x.tmp", filename, pid,
+        (uint64_t) std::hash<std::thread::id>()(std::this_thread::get_id()));
+    {
+        std::ofstream os(tmp_filename, std::ios::binary);
+        os.write((const char *) &header, sizeof(CacheHeader));
+        os.write((const char *) m_nodes.data(), m_nodes.size() * sizeof(Node));
+        os.write((const char *) m_prim_ids.data(), m_prim_ids.size() * sizeof(uint32_t));
+        if (!os) {
+            cerr << "Warning: could not write the BVH cache file \"" << tmp_filename << "\"" << endl;
+            os.close();
+            std::remove(tmp_filename.c_str());
+            return;
+        }
+    }
+#if defined(PLATFORM_WINDOWS)
+    std::remove(filename.c_str());
+#endif
+    if (std::rename(tmp_filename.c_str(), filename.c_str()) != 0) {
+        cerr << "Warning: could not write the BVH cache file \"" << filename << "\"" << endl;
+        std::remove(tmp_filename.c_str());
+    }
+}
+
+NORI_NAMESPACE_END
@@ -0,0 +1,400 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/accel.h>
+#include <Eigen/Geometry>
+#include <nori/timer.h>
+#include <tbb/parallel_for.h>
+#include <tbb/cache_aligned_allocator.h>
+#include <atomic>
+#include <chrono>
+
+using namespace std::chrono;
+
+NORI_NAMESPACE_BEGIN
+
+static constexpr uint32_t MAX_TRIANGLES_PER_NODE = 15;
+static constexpr uint32_t MAX_RECURSION_DEPTH = 10;
+/// Nodes with more triangles distribute and build their children in parallel
+static constexpr uint32_t PARALLEL_BUILD_THRESHOLD = 4096;
+
+/**
+ * \brief Octree acceleration data structure
+ *
+ * Recursively splits the scene bounding box into 8 octants and stores
+ * every triangle in all leaves it overlaps. The children of large nodes
+ * are built in parallel on the TBB thread pool.
+ */
+class Octree : public Accel {
+
+    /// Temporary tree node used during construction
+    struct BuildNode {
+        BoundingBox3f bbox;
+        std::unique_ptr<BuildNode> children[8];
+        std::vector<uint32_t> prim_ids;
+    };
+
+    /**
+     * \brief Node of the flattened octree (32 bytes)
+     *
+     * The 8 children of an interior node are stored next to each other,
+     * starting at \c offset. Leaves reference the triangle range
+     * [offset, offset + num_triangles) of the shared primitive id buffer.
+     */
+    struct alignas(32) Node {
+        BoundingBox3f bbox;
+        uint32_t offset;
+        uint32_t num_triangles; ///< \c INTERIOR_NODE for interior nodes
+
+        bool isLeaf() const { return num_triangles != INTERIOR_NODE; }
+    };
+    static_assert(sizeof(Node) == 32, "Octree nodes should be 32 bytes");
+
+    static constexpr uint32_t INTERIOR_NODE = (uint32_t) -1;
+
+public:
+    Octree(const PropertyList &props) {
+        m_occluder_cache = props.getBoolean("occluderCache", true);
+    }
+
+    void build();
+
+    Accel* createBottomLevel() const {
+        PropertyList props;
+        props.setBoolean("occluderCache", m_occluder_cache);
+        return new Octree(props);
+    }
+
+    std::string toString() const {
+        return tfm::format(
+            "Octree[\n"
+            "  maxTrianglesPerNode = %i,\n"
+            "  maxDepth = %i,\n"
+            "  occluderCache = %s\n"
+            "]",
+            MAX_TRIANGLES_PER_NODE,
+            MAX_RECURSION_DEPTH,
+            m_occluder_cache ? "true" : "false"
+        );
+    }
+
+protected:
+    bool traverse(Ray3f& ray, RayHit& hit, bool shadowRay) const;
+
+    bool traverseOccluded(const Ray3f& ray, RayHit& occluder) const;
+
+private:
+    BuildNode* buildRecursive(const BoundingBox3f& bbox, std::vector<uint32_t>& prim_ids, uint32_t recursion_depth);
+    void flatten(const BuildNode* build_node, uint32_t node_idx);
+    static void subdivideBBox(const BoundingBox3f& parent, BoundingBox3f* bboxes);
+    float computeSAHCost() const;
+
+    std::vector<Node, tbb::cache_aligned_allocator<Node>> m_nodes; ///< Flattened octree, root at index 0
+    std::vector<uint32_t> m_prim_ids; ///< Global primitive id of every leaf reference
+
+    // only statistics (updated concurrently during the build)
+    std::atomic<uint32_t> m_num_nonempty_leaf_nodes{0};
+    std::atomic<uint32_t> m_num_leaf_nodes{0};
+    std::atomic<uint32_t> m_num_nodes{0};
+    std::atomic<uint32_t> m_recursion_depth{0};
+    std::atomic<uint32_t> m_num_triangles_saved{0};
+};
+
+void Octree::build() {
+    if (m_num_meshes == 0)
+        throw NoriException("No mesh found, could not build acceleration structure");
+
+    auto start = high_resolution_clock::now();
+    updatePrimitiveOffsets();
+    // delete old hierarchy if present
+    m_nodes.clear();
+    m_prim_ids.clear();
+    m_num_nonempty_leaf_nodes = m_num_leaf_nodes = m_num_nodes = m_recursion_depth = m_num_triangles_saved = 0;
+
+    // every triangle of the scene is referenced by its global primitive id
+    std::vector<uint32_t> prim_ids(getPrimitiveCount());
+    for (uint32_t i = 0; i < prim_ids.size(); i++) {
+        prim_ids[i] = i;
+    }
+
+    std::unique_ptr<BuildNode> root(buildRecursive(m_bbox, prim_ids, 0));
+
+    // store the tree in one contiguous array, with leaves pointing into a shared index buffer
+    m_nodes.reserve(m_num_nodes);
+    m_prim_ids.reserve(m_num_triangles_saved);
+    m_nodes.emplace_back();
+    flatten(root.get(), 0);
+    root.reset();
+    printf("Octree build time: %ldms \n", duration_cast<milliseconds>(high_resolution_clock::now() - start).count());
+    printf("Num nodes: %d \n", m_num_nodes.load());
+    printf("Num leaf nodes: %d \n", m_num_leaf_nodes.load());
+    printf("Num non-empty leaf nodes: %d \n", m_num_nonempty_leaf_nodes.load());
+    printf("Total number of saved triangles: %d \n", m_num_triangles_saved.load());
+    printf("Avg triangles per node: %f \n", (float)m_num_triangles_saved / (float)m_num_nodes);
+    printf("Recursion depth: %d \n", m_recursion_depth.load());
+    printf("Node memory: %s \n", memString(m_nodes.size() * sizeof(Node) + m_prim_ids.size() * sizeof(uint32_t)).c_str());
+    printf("SAH cost: %f \n", computeSAHCost());
+}
+
+Octree::BuildNode* Octree::buildRecursive(const BoundingBox3f& bbox, std::vector<uint32_t>& prim_ids,
+    uint32_t recursion_depth) {
+    // a node is created in any case
+    m_num_nodes++;
+
+    uint32_t num_triangles = prim_ids.size();
+
+    // return empty node if no triangles are left
+    if (num_triangles == 0) {
+        BuildNode* node = new BuildNode();
+        node->bbox = BoundingBox3f(bbox);
+
+        // add to statistics
+        m_num_leaf_nodes++;
+        return node;
+    }
+
+    // create leaf node if 10 or less triangles are left or if the max recursion depth is reached.
+    if (num_triangles <= MAX_TRIANGLES_PER_NODE || recursion_depth >= MAX_RECURSION_DEPTH) {
+        BuildNode* node = new BuildNode();
+        node->prim_ids = std::move(prim_ids);
+        node->bbox = BoundingBox3f(bbox);
+
+        // add to statistics
+        m_num_leaf_nodes++;
+        m_num_nonempty_leaf_nodes++;
+        m_num_triangles_saved += num_triangles;
+        return node;
+    }
+
+    // create new parent node
+    BuildNode* node = new BuildNode();
+    node->bbox = BoundingBox3f(bbox);
+
+    BoundingBox3f child_bboxes[8] = {};
+    subdivideBBox(bbox, child_bboxes);
+
+    std::vector<std::vector<uint32_t>> child_prim_ids(8);
+
+    // place every triangle in the children it overlaps with
+    // for every child bbox (in parallel for large nodes)
+    auto distribute = [&](uint32_t i) {
+        // for every triangle inside of the parent create triangle bounding box
+        for (uint32_t j = 0; j < num_triangles; j++) {
+            // for every triangle vertex expand triangle bbox
+            uint32_t mesh_idx, triangle_idx;
+            resolvePrimitive(prim_ids[j], mesh_idx, triangle_idx);
+            BoundingBox3f triangle_bbox = m_meshes[mesh_idx]->getBoundingBox(triangle_idx);
+
+            // check if triangle is in bbox, if so put its primitive id into the list of the child
+            if (child_bboxes[i].overlaps(triangle_bbox)) {
+                child_prim_ids[i].emplace_back(prim_ids[j]);
+            }
+        }
+    };
+
+    bool parallel = num_triangles > PARALLEL_BUILD_THRESHOLD;
+    if (parallel)
+        tbb::parallel_for(0u, 8u, distribute);
+    else
+        for (uint32_t i = 0; i < 8; i++)
+            distribute(i);
+
+    // release memory to avoid stack overflow
+    prim_ids = std::vector<uint32_t>();
+
+    auto buildChild = [&](uint32_t i) {
+        node->children[i].reset(buildRecursive(child_bboxes[i], child_prim_ids[i], recursion_depth + 1));
+    };
+
+    if (parallel)
+        tbb::parallel_for(0u, 8u, buildChild);
+    else
+        for (uint32_t i = 0; i < 8; i++)
+            buildChild(i);
+
+    uint32_t depth = m_recursion_depth;
+    while (depth < recursion_depth + 1 && !m_recursion_depth.compare_exchange_weak(depth, recursion_depth + 1)) { }
+    return node;
+}
+
+void Octree::flatten(const BuildNode* build_node, uint32_t node_idx) {
+    m_nodes[node_idx].bbox = build_node->bbox;
+
+    if (!build_node->children[0]) {
+        m_nodes[node_idx].offset = (uint32_t) m_prim_ids.size();
+        m_nodes[node_idx].num_triangles = (uint32_t) build_node->prim_ids.size();
+        m_prim_ids.insert(m_prim_ids.end(), build_node->prim_ids.begin(), build_node->prim_ids.end());
+        return;
+    }
+
+    // reserve 8 consecutive slots for the children, then fill in their subtrees
+    uint32_t first_child = (uint32_t) m_nodes.size();
+    m_nodes.resize(m_nodes.size() + 8);
+    m_nodes[node_idx].offset = first_child;
+    m_nodes[node_idx].num_triangles = INTERIOR_NODE;
+
+    for (uint32_t i = 0; i < 8; i++)
+        flatten(build_node->children[i].get(), first_child + i);
+}
+
+bool Octree::traverse(Ray3f& ray, RayHit& hit, bool shadowRay) const {
+    bool foundIntersection = false;
+    float nearT;
+
+    if (m_nodes.empty() || !m_nodes[0].bbox.raySegmentIntersect(ray, nearT))
+        return false;
+
+    /* Child i covers the upper half of axis k if bit k of i is set. Visiting
+       the children in the order (i ^ dir_mask) is front-to-back: a ray can
+       never pass through two octants that this order does not sort */
+    uint32_t dir_mask = (ray.dRcp.x() < 0 ? 1 : 0) | (ray.dRcp.y() < 0 ? 2 : 0) | (ray.dRcp.z() < 0 ? 4 : 0);
+
+    struct StackEntry {
+        uint32_t node_idx;
+        float nearT; ///< Distance at which the ray enters the node
+    };
+    StackEntry stack[7 * MAX_RECURSION_DEPTH + 1];
+    uint32_t stack_size = 0;
+    stack[stack_size++] = { 0, nearT };
+    PrimitiveCursor cursor(*this);
+
+    while (stack_size > 0) {
+        StackEntry entry = stack[--stack_size];
+
+        // skip nodes that lie behind a hit found after they were pushed
+        if (entry.nearT > ray.maxt)
+            continue;
+
+        const Node& node = m_nodes[entry.node_idx];
+        NORI_STAT(nodes_visited, 1);
+
+        if (node.isLeaf()) {
+            // search through all triangles in node
+            for (uint32_t i = node.offset; i < node.offset + node.num_triangles; ++i) {
+                float u, v, t;
+                uint32_t triangle_idx;
+                const Mesh* mesh = cursor.resolve(m_prim_ids[i], triangle_idx);
+                if (mesh->rayIntersect(triangle_idx, ray, u, v, t) && t < ray.maxt) {
+                    /* An intersection was found! Can terminate
+                       immediately if this is a shadow ray query */
+                    if (shadowRay)
+                        return true;
+                    ray.maxt = t;
+                    hit.t = t;
+                    hit.uv = Point2f(u, v);
+                    hit.mesh = mesh;
+                    hit.f = triangle_idx;
+                    foundIntersection = true;
+                }
+            }
+            continue;
+        }
+
+        // push back to front, so that the nearest child is visited first
+        NORI_STAT(box_tests, 8);
+        for (int i = 7; i >= 0; i--) {
+            uint32_t child_idx = node.offset + (i ^ dir_mask);
+            if (m_nodes[child_idx].bbox.raySegmentIntersect(ray, nearT))
+                stack[stack_size++] = { child_idx, nearT };
+        }
+    }
+
+    return foundIntersection;
+}
+
+bool Octree::traverseOccluded(const Ray3f& ray, RayHit& occluder) const {
+    float nearT;
+    if (m_nodes.empty() || !m_nodes[0].bbox.raySegmentIntersect(ray, nearT))
+        return false;
+
+    /* Any hit ends the query, so the octants are visited in index order */
+    uint32_t stack[7 * MAX_RECURSION_DEPTH + 1];
+    uint32_t stack_size = 0;
+    stack[stack_size++] = 0;
+    PrimitiveCursor cursor(*this);
+
+    while (stack_size > 0) {
+        const Node& node = m_nodes[stack[--stack_size]];
+        NORI_STAT(nodes_visited, 1);
+
+        if (node.isLeaf()) {
+            for (uint32_t i = node.offset; i < node.offset + node.num_triangles; ++i) {
+                float u, v, t;
+                uint32_t triangle_idx;
+                const Mesh* mesh = cursor.resolve(m_prim_ids[i], triangle_idx);
+                if (mesh->rayIntersect(triangle_idx, ray, u, v, t)) {
+                    occluder.mesh = mesh;
+                    occluder.f = triangle_idx;
+                    return true;
+                }
+            }
+            continue;
+        }
+
+        NORI_STAT(box_tests, 8);
+        for (uint32_t i = 0; i < 8; i++) {
+            if (m_nodes[node.offset + i].bbox.raySegmentIntersect(ray, nearT))
+                stack[stack_size++] = node.offset + i;
+        }
+    }
+
+    return false;
+}
+
+float Octree::computeSAHCost() const {
+    /* Same cost model as the default BVH settings (unit traversal and
+       intersection cost), so that the printed numbers can be compared */
+    float cost = 0.f;
+    for (const Node& node : m_nodes)
+        cost += node.bbox.getSurfaceArea() * (node.isLeaf() ? (float) node.num_triangles : 1.f);
+    return cost / m_nodes[0].bbox.getSurfaceArea();
+}
+
+void Octree::subdivideBBox(const nori::BoundingBox3f& parent, nori::BoundingBox3f* bboxes) {
+    Point3f extents = parent.getExtents();
+
+    Point3f x0_y0_z0 = parent.min;
+    Point3f x1_y0_z0 = Point3f(parent.min.x() + extents.x() / 2.f, parent.min.y(), parent.min.z());
+    Point3f x0_y1_z0 = Point3f(parent.min.x(), parent.min.y() + extents.y() / 2.f, parent.min.z());
+    Point3f x1_y1_z0 = Point3f(parent.min.x() + extents.x() / 2.f, parent.min.y() + extents.y() / 2.f, parent.min.z());
+
+    Point3f x0_y0_z1 = Point3f(parent.min.x(), parent.min.y(), parent.min.z() + extents.z() / 2.f);
+    Point3f x1_y0_z1 = Point3f(parent.min.x() + extents.x() / 2.f, parent.min.y(), parent.min.z() + extents.z() / 2.f);
+    Point3f x0_y1_z1 = Point3f(parent.min.x(), parent.min.y() + extents.y() / 2.f, parent.min.z() + extents.z() / 2.f);
+    Point3f x1_y1_z1 = Point3f(parent.min.x() + extents.x() / 2.f, parent.min.y() + extents.y() / 2.f, parent.min.z() + extents.z() / 2.f);
+    Point3f x2_y1_z1 = Point3f(parent.max.x(), parent.min.y() + extents.y() / 2.f, parent.min.z() + extents.z() / 2.f);
+    Point3f x1_y2_z1 = Point3f(parent.min.x() + extents.x() / 2.f, parent.max.y(), parent.min.z() + extents.z() / 2.f);
+    Point3f x2_y2_z1 = Point3f(parent.max.x(), parent.max.y(), parent.min.z() + extents.z() / 2.f);
+
+    Point3f x1_y1_z2 = Point3f(parent.min.x() + extents.x() / 2.f, parent.min.y() + extents.y() / 2.f, parent.max.z());
+    Point3f x2_y1_z2 = Point3f(parent.max.x(), parent.min.y() + extents.y() / 2.f, parent.max.z());
+    Point3f x1_y2_z2 = Point3f(parent.min.x() + extents.x() / 2.f, parent.max.y(), parent.max.z());
+    Point3f x2_y2_z2 = Point3f(parent.max.x(), parent.max.y(), parent.max.z());
+
+    bboxes[0] = BoundingBox3f(x0_y0_z0, x1_y1_z1);
+    bboxes[1] = BoundingBox3f(x1_y0_z0, x2_y1_z1);
+    bboxes[2] = BoundingBox3f(x0_y1_z0, x1_y2_z1);
+    bboxes[3] = BoundingBox3f(x1_y1_z0, x2_y2_z1);
+    bboxes[4] = BoundingBox3f(x0_y0_z1, x1_y1_z2);
+    bboxes[5] = BoundingBox3f(x1_y0_z1, x2_y1_z2);
+    bboxes[6] = BoundingBox3f(x0_y1_z1, x1_y2_z2);
+    bboxes[7] = BoundingBox3f(x1_y1_z1, x2_y2_z2);
+}
+
+NORI_REGISTER_CLASS(Octree, "octree");
+NORI_NAMESPACE_END
@@ -0,0 +1,261 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/twolevel.h>
+#include <chrono>
+
+using namespace std::chrono;
+
+NORI_NAMESPACE_BEGIN
+
+uint32_t TwoLevelAccel::addBottomLevel(Accel* accel) {
+    m_bottom_levels.emplace_back(accel);
+    return (uint32_t) m_bottom_levels.size() - 1;
+}
+
+void TwoLevelAccel::addInstance(uint32_t index, const Transform& toWorld) {
+    InstanceRecord instance;
+    instance.toWorld = toWorld;
+    instance.toLocal = toWorld.inverse();
+    instance.accel_idx = index;
+    m_instances.push_back(instance);
+}
+
+Accel* TwoLevelAccel::createBottomLevel() const {
+    throw NoriException("TwoLevelAccel: two-level structures cannot be nested!");
+}
+
+void TwoLevelAccel::build() {
+    if (m_instances.empty())
+        throw NoriException("No mesh found, could not build acceleration structure");
+
+    /* Only cache occluders if all bottom levels were configured to */
+    m_occluder_cache = true;
+    for (auto& accel : m_bottom_levels) {
+        accel->build();
+        m_occluder_cache &= accel->m_occluder_cache;
+    }
+
+    buildTopLevel();
+}
+
+void TwoLevelAccel::refit() {
+    for (auto& accel : m_bottom_levels)
+        accel->refit();
+
+    buildTopLevel();
+}
+
+void TwoLevelAccel::buildTopLevel() {
+    auto start = high_resolution_clock::now();
+
+    /* World-space bounds of every instance: transform the corners of the local bounds */
+    m_bbox.reset();
+    for (InstanceRecord& instance : m_instances) {
+        const BoundingBox3f& local_bbox = m_bottom_levels[instance.accel_idx]->getBoundingBox();
+        instance.bbox.reset();
+        for (int i = 0; i < 8; i++)
+            instance.bbox.expandBy(instance.toWorld * local_bbox.getCorner(i));
+        m_bbox.expandBy(instance.bbox);
+    }
+
+    uint32_t num_instances = (uint32_t) m_instances.size();
+    m_instance_indices.resize(num_instances);
+    for (uint32_t i = 0; i < num_instances; i++)
+        m_instance_indices[i] = i;
+
+    m_nodes.clear();
+    m_nodes.reserve(2 * num_instances);
+    m_nodes.emplace_back();
+    m_depth = 0;
+    buildRecursive(0, 0, num_instances, 0);
+
+    auto stop = high_resolution_clock::now();
+    auto duration = duration_cast<milliseconds>(stop - start);
+    printf("Top-level build time: %lld ms \n", (long long) duration.count());
+    printf("Top-level instances: %d (%d unique) \n", num_instances, (int) m_bottom_levels.size());
+    printf("Top-level nodes: %d, depth: %d \n", (int) m_nodes.size(), m_depth);
+    printf("Top-level memory: %s \n", memString(m_nodes.size() * sizeof(Node) +
+        m_instances.size() * sizeof(InstanceRecord) + m_instance_indices.size() * sizeof(uint32_t)).c_str());
+}
+
+void TwoLevelAccel::buildRecursive(uint32_t node_idx, uint32_t begin, uint32_t end, uint32_t depth) {
+    m_depth = std::max(m_depth, depth + 1);
+
+    BoundingBox3f bbox, centroid_bbox;
+    for (uint32_t i = begin; i < end; i++) {
+        const BoundingBox3f& instance_bbox = m_instances[m_instance_indices[i]].bbox;
+        bbox.expandBy(instance_bbox);
+        centroid_bbox.expandBy(instance_bbox.getCenter());
+    }
+    m_nodes[node_idx].bbox = bbox;
+
+    if (end - begin <= MAX_LEAF_SIZE || depth + 1 >= MAX_DEPTH) {
+        m_nodes[node_idx].offset = begin;
+        m_nodes[node_idx].num_instances = (uint16_t) (end - begin);
+        return;
+    }
+
+    /* Median split along the axis with the largest centroid extent. The top
+       level is usually small compared to the geometry, so a full SAH build
+       would not pay off */
+    int axis = centroid_bbox.getLargestAxis();
+    uint32_t mid = (begin + end) / 2;
+    std::nth_element(m_instance_indices.begin() + begin, m_instance_indices.begin() + mid,
+        m_instance_indices.begin() + end, [&](uint32_t a, uint32_t b) {
+            return m_instances[a].bbox.getCenter()[axis] < m_instances[b].bbox.getCenter()[axis];
+        });
+
+    m_nodes[node_idx].axis = (uint8_t) axis;
+    m_nodes[node_idx].num_instances = 0;
+
+    m_nodes.emplace_back();
+    buildRecursive(node_idx + 1, begin, mid, depth + 1);
+
+    uint32_t second = (uint32_t) m_nodes.size();
+    m_nodes.emplace_back();
+    m_nodes[node_idx].offset = second;
+    buildRecursive(second, mid, end, depth + 1);
+}
+
+void TwoLevelAccel::computeSurfaceInteraction(const RayHit& hit, Intersection& its) const {
+    /* Compute the surface information in the local space of the
+       instance, then move it to world space */
+    Accel::computeSurfaceInteraction(hit, its);
+
+    const Transform& toWorld = m_instances[hit.instance].toWorld;
+
+    /* The transformation adds its own rounding error to the bound */
+    Eigen::Matrix3f abs_linear = toWorld.getMatrix().topLeftCorner<3, 3>().cwiseAbs();
+    Vector3f abs_translation = toWorld.getMatrix().topRightCorner<3, 1>().cwiseAbs();
+    its.pError = (1.f + roundingError(3)) * (abs_linear * its.pError) +
+        roundingError(3) * (abs_linear * its.p.cwiseAbs() + abs_translation);
+    its.p = toWorld * its.p;
+    its.geoFrame = Frame((toWorld * its.geoFrame.n).normalized());
+    its.shFrame = Frame((toWorld * its.shFrame.n).normalized());
+}
+
+bool TwoLevelAccel::traverse(Ray3f& ray, RayHit& hit, bool shadowRay) const {
+    bool foundIntersection = false;
+    bool dir_is_neg[3] = { ray.dRcp.x() < 0, ray.dRcp.y() < 0, ray.dRcp.z() < 0 };
+
+    uint32_t stack[MAX_DEPTH];
+    uint32_t stack_size = 0;
+    uint32_t node_idx = 0;
+
+    while (true) {
+        const Node& node = m_nodes[node_idx];
+        float nearT;
+        NORI_STAT(nodes_visited, 1);
+        NORI_STAT(box_tests, 1);
+
+        if (node.bbox.raySegmentIntersect(ray, nearT)) {
+            if (node.isLeaf()) {
+                for (uint32_t i = node.offset; i < node.offset + node.num_instances; ++i) {
+                    const InstanceRecord& instance = m_instances[m_instance_indices[i]];
+
+                    /* The transformed direction is not normalized, so
+                       distances along the ray are the same in both spaces */
+                    Ray3f local_ray = instance.toLocal * ray;
+                    if (m_bottom_levels[instance.accel_idx]->traverse(local_ray, hit, shadowRay)) {
+                        if (shadowRay)
+                            return true;
+                        ray.maxt = local_ray.maxt;
+                        hit.instance = m_instance_indices[i];
+                        foundIntersection = true;
+                    }
+                }
+            } else {
+                /* Visit the child on the near side of the split first */
+                if (dir_is_neg[node.axis]) {
+                    stack[stack_size++] = node_idx + 1;
+                    node_idx = node.offset;
+                } else {
+                    stack[stack_size++] = node.offset;
+                    node_idx = node_idx + 1;
+                }
+                continue;
+            }
+        }
+
+        if (stack_size == 0)
+            break;
+        node_idx = stack[--stack_size];
+    }
+
+    return foundIntersection;
+}
+
+bool TwoLevelAccel::traverseOccluded(const Ray3f& ray, RayHit& occluder) const {
+    uint32_t stack[MAX_DEPTH];
+    uint32_t stack_size = 0;
+    uint32_t node_idx = 0;
+
+    while (true) {
+        const Node& node = m_nodes[node_idx];
+        float nearT;
+        NORI_STAT(nodes_visited, 1);
+        NORI_STAT(box_tests, 1);
+
+        if (node.bbox.raySegmentIntersect(ray, nearT)) {
+            if (!node.isLeaf()) {
+                stack[stack_size++] = node.offset;
+                node_idx = node_idx + 1;
+                continue;
+            }
+            for (uint32_t i = node.offset; i < node.offset + node.num_instances; ++i) {
+                const InstanceRecord& instance = m_instances[m_instance_indices[i]];
+                if (m_bottom_levels[instance.accel_idx]->traverseOccluded(instance.toLocal * ray, occluder)) {
+                    occluder.instance = m_instance_indices[i];
+                    return true;
+                }
+            }
+        }
+
+        if (stack_size == 0)
+            return false;
+        node_idx = stack[--stack_size];
+    }
+}
+
+bool TwoLevelAccel::testOccluder(const Ray3f& ray, const RayHit& occluder) const {
+    const InstanceRecord& instance = m_instances[occluder.instance];
+    return m_bottom_levels[instance.accel_idx]->testOccluder(instance.toLocal * ray, occluder);
+}
+
+std::string TwoLevelAccel::toString() const {
+    std::string bottom_levels;
+    for (size_t i = 0; i < m_bottom_levels.size(); ++i) {
+        bottom_levels += std::string("  ") + indent(m_bottom_levels[i]->toString(), 2);
+        if (i + 1 < m_bottom_levels.size())
+            bottom_levels += ",";
+        bottom_levels += "\n";
+    }
+
+    return tfm::format(
+        "TwoLevelAccel[\n"
+        "  instances = %i,\n"
+        "  bottomLevels = {\n"
+        "  %s  }\n"
+        "]",
+        m_instances.size(),
+        indent(bottom_levels, 2)
+    );
+}
+
+NORI_NAMESPACE_END
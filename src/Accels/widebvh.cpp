@@ -0,0 +1,67 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/widebvh.h>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+NORI_NAMESPACE_BEGIN
+
+typedef WideBVH<4> BVH4;
+NORI_REGISTER_CLASS(BVH4, "bvh4");
+
+#if defined(NORI_AVX) && !defined(__AVX__)
+/// Create a BVH8 with AVX box tests, defined in widebvh_avx.cpp
+Accel* createBVH8AVX(const PropertyList &props);
+
+/// Can this CPU run AVX code? (This also requires support by the operating system)
+static bool hasAVX() {
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    bool osxsave = (info[2] & (1 << 27)) != 0, avx = (info[2] & (1 << 28)) != 0;
+    return osxsave && avx && (_xgetbv(0) & 6) == 6;
+#else
+    return __builtin_cpu_supports("avx");
+#endif
+}
+#endif
+
+/// Create a BVH8, whose box tests use AVX if the CPU supports it
+static NoriObject* createBVH8(const PropertyList &props) {
+#if defined(__AVX__)
+    return new WideBVH<8, FloatAVX>(props);
+#elif defined(NORI_AVX)
+    static const bool avx = hasAVX();
+    if (avx)
+        return createBVH8AVX(props);
+    return new WideBVH<8>(props);
+#else
+    return new WideBVH<8>(props);
+#endif
+}
+
+static struct BVH8_ {
+    BVH8_() {
+        NoriObjectFactory::registerClass("bvh8", createBVH8);
+    }
+} BVH8__NORI_;
+
+NORI_NAMESPACE_END
@@ -0,0 +1,56 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* The AVX version of bvh8. Builds that do not target AVX compile it with
+   a target pragma, and widebvh.cpp only creates it after checking the
+   CPU. All headers are included before the pragma, so that inline
+   functions shared with the rest of Nori keep their portable code; only
+   WideBVH<8, FloatAVX> (which exists nowhere else) is compiled for AVX */
+
+#include <nori/bvh.h>
+#include <nori/simd.h>
+#include <tbb/parallel_for.h>
+#include <chrono>
+#include <cmath>
+
+#if defined(NORI_AVX) && !defined(__AVX__)
+
+#if defined(__clang__)
+#  pragma clang attribute push (__attribute__((target("avx"))), apply_to = function)
+#elif defined(__GNUC__)
+#  pragma GCC push_options
+#  pragma GCC target("avx")
+#endif
+
+#include <nori/widebvh.h>
+
+NORI_NAMESPACE_BEGIN
+
+Accel* createBVH8AVX(const PropertyList &props) {
+    return new WideBVH<8, FloatAVX>(props);
+}
+
+NORI_NAMESPACE_END
+
+#if defined(__clang__)
+#  pragma clang attribute pop
+#elif defined(__GNUC__)
+#  pragma GCC pop_options
+#endif
+
+#endif
@@ -9,16 +9,16 @@ public:
 
     }
 
-    Color3f Li(const Scene* scene, Sampler* sampler, const Ray3f& ray) const {
-        Intersection its;
-        if (!scene->rayIntersect(ray, its))
+    Color3f LiFromIntersection(const Scene* scene, Sampler* sampler, const Ray3f&, const Intersection* _its) const {
+        if (!_its)
             return Color3f(0.0f);
+        const Intersection& its = *_its;
 
         Vector3f wi = Warp::squareToCosineHemisphere(sampler->next2D());
         Vector3f shadowRayDir = its.shFrame.toWorld(wi).normalized();
         float pdf = Warp::squareToCosineHemispherePdf(wi);
         float li = 1.0f * shadowRayDir.dot(its.shFrame.n.normalized()) * INV_PI / pdf;
-        return scene->rayIntersect(Ray3f(its.p, shadowRayDir)) ? 0.0f : Color3f(clamp(li, 0.0f, 1.0f));
+        return scene->rayIntersect(its.spawnRay(shadowRayDir)) ? 0.0f : Color3f(clamp(li, 0.0f, 1.0f));
     }
 
     std::string toString() const {
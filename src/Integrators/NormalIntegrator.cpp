@@ -9,10 +9,10 @@ public:
 
     }
 
-    Color3f Li(const Scene* scene, Sampler* sampler, const Ray3f& ray) const {
-        Intersection its;
-        if (!scene->rayIntersect(ray, its))
+    Color3f LiFromIntersection(const Scene*, Sampler*, const Ray3f&, const Intersection* _its) const {
+        if (!_its)
             return Color3f(0.0f);
+        const Intersection& its = *_its;
 
         Normal3f n = its.shFrame.n.cwiseAbs();
         return Color3f(n.x(), n.y(), n.z());
@@ -7,14 +7,17 @@ class PathEms : public Integrator {
 public:
     PathEms(const PropertyList& props) {};
 
-    Color3f Li(const Scene* scene, Sampler* sampler, const Ray3f& _ray) const {
+    Color3f LiFromIntersection(const Scene* scene, Sampler* sampler, const Ray3f& _ray, const Intersection* _its) const {
         Intersection its;
+        bool hit = _its != nullptr;
+        if (hit)
+            its = *_its;
         Color3f lo(0.f), throughout(1.f);
         float eta = 1.f;
         Ray3f ray(_ray);
         bool countEmitter = true;
 
-        for (int b = 0; scene->rayIntersect(ray, its); ++b) {
+        for (int b = 0; hit; ++b) {
             if (its.mesh->isEmitter() && Frame::cosTheta(its.toLocal(-ray.d)) > 0 && countEmitter) {
                 lo += its.mesh->getEmitter()->getRadiance() * throughout;
             }
@@ -30,10 +33,8 @@ public:
                 Normal3f lightN;
                 float pdf;
                 Point3f lightpoint = lightMesh->squareToUniformMesh(sampler, lightN, pdf);
-                Vector3f wi = lightpoint - its.p;
-                float d = wi.norm();
-                wi.normalize();
-                Ray3f shadowRay(its.p, wi, Epsilon, d - Epsilon);
+                Vector3f wi = (lightpoint - its.p).normalized();
+                Ray3f shadowRay = its.spawnRayTo(lightpoint);
 
                 //visible from light?
                 if (!scene->rayIntersect(shadowRay)) {
@@ -59,7 +60,8 @@ public:
                 if (sampler->next1D() > probability) break;
                 throughout /= probability;
             }
-            ray = Ray3f(its.p, its.toWorld(bQR.wo));
+            ray = its.spawnRay(its.toWorld(bQR.wo));
+            hit = scene->rayIntersect(ray, its);
         }
         return lo;
     }
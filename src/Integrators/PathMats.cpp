@@ -7,14 +7,17 @@ class PathMats : public Integrator {
 public:
     PathMats(const PropertyList& props) { }
 
-    Color3f Li(const Scene* scene, Sampler* sampler, const Ray3f& _ray) const {
+    Color3f LiFromIntersection(const Scene* scene, Sampler* sampler, const Ray3f& _ray, const Intersection* _its) const {
         Intersection its;
+        bool hit = _its != nullptr;
+        if (hit)
+            its = *_its;
         Color3f lo(0.f);
         Color3f throughout(1.f);
         float eta = 1.f;
         const int MAX_BOUNCE = 50;
         Ray3f ray(_ray);
-        for (int b = 0; b < MAX_BOUNCE && scene->rayIntersect(ray, its); ++b) {
+        for (int b = 0; b < MAX_BOUNCE && hit; ++b) {
 
             if (its.mesh->isEmitter() && Frame::cosTheta(its.toLocal(-ray.d)) > 0) {
                 lo += its.mesh->getEmitter()->getRadiance() * throughout;
@@ -32,7 +35,12 @@ public:
                 throughout /= probability;
             }
 
-            ray = Ray3f(its.p, its.toWorld(bQR.wo));
+            ray = its.spawnRay(its.toWorld(bQR.wo));
+            RayHit next;
+            hit = scene->rayIntersect(ray, next);
+            //the last bounce only checks whether the path left the scene
+            if (hit && b + 1 < MAX_BOUNCE)
+                scene->computeSurfaceInteraction(next, its);
         }
         return lo;
     }
@@ -8,12 +8,14 @@ NORI_NAMESPACE_BEGIN
     class PathMis : public Integrator {
     public:
         PathMis(const PropertyList& props) {};
-        Color3f Li(const Scene* scene, Sampler* sampler, const Ray3f& _ray) const {
+        Color3f LiFromIntersection(const Scene* scene, Sampler* sampler, const Ray3f& _ray, const Intersection* _its) const {
             Intersection its;
             Color3f li(0.f), throughout(1.f);
             float eta = 1.f;
             Ray3f ray(_ray);
-            bool hitNot = scene->rayIntersect(ray, its);
+            bool hitNot = _its != nullptr;
+            if (hitNot)
+                its = *_its;
             if (hitNot && its.mesh->isEmitter() && Frame::cosTheta(its.toLocal(-ray.d)) > 0.f) {
                 li += its.mesh->getEmitter()->getRadiance() * throughout;
             }
@@ -48,7 +50,7 @@ NORI_NAMESPACE_BEGIN
 
 
                     float w_light = solidAnglePDF / (solidAnglePDF + brdfPDF); // light weight
-                    Ray3f shadowRay(its.p, wo, Epsilon, d - Epsilon);
+                    Ray3f shadowRay = its.spawnRayTo(lightpoint);
 
                     if (!scene->rayIntersect(shadowRay)) {
                         float cos_wo_hitN = std::fmax(wo.dot(its.shFrame.n), 0.f);
@@ -67,16 +69,19 @@ NORI_NAMESPACE_BEGIN
                 
                 //Next iteration info
                 Vector3f wo = its.toWorld(bQR.wo);
-                Ray3f nextRay(its.p, wo);
+                Ray3f nextRay = its.spawnRay(wo);
+                RayHit nextHit;
+                hitNot = scene->rayIntersect(nextRay, nextHit);
+                //surface data is only computed for emitters and if the path goes on
                 Intersection nextIts;
-                hitNot = scene->rayIntersect(nextRay, nextIts);
-                
+
 
                 //next hit mesh is a emitter light:
 
                 //Problems: cosine theta here!!!
 
-                if (hitNot && nextIts.mesh->isEmitter()) {
+                if (hitNot && nextHit.mesh->isEmitter()) {
+                    scene->computeSurfaceInteraction(nextHit, nextIts);
                     lightPDF = chooseLightPDF * nextIts.mesh->squareToUniformMeshPDF();
 
                     //clamp it:
@@ -101,14 +106,15 @@ NORI_NAMESPACE_BEGIN
                         li += w_brdf * throughout * nextIts.mesh->getEmitter()->getRadiance();
                 }
 
-                its = nextIts;
-
                 if (b > 3) {
                     float probility = fmin(throughout.maxCoeff() * eta * eta, 0.99f);
                     if (sampler->next1D() > probility) break;
                     throughout /= probility;
                 }
 
+                if (hitNot && !nextHit.mesh->isEmitter())
+                    scene->computeSurfaceInteraction(nextHit, nextIts);
+                its = nextIts;
                 ray = nextRay;
             }
             return li;
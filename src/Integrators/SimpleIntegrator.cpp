@@ -9,12 +9,12 @@ public:
         lightE = props.getColor("energy");
     }
 
-    Color3f Li(const Scene* scene, Sampler* sampler, const Ray3f& ray) const {
-        Intersection its;
-        if (!scene->rayIntersect(ray, its))
+    Color3f LiFromIntersection(const Scene* scene, Sampler*, const Ray3f&, const Intersection* _its) const {
+        if (!_its)
             return Color3f(0.0f);
+        const Intersection& its = *_its;
         Vector3f shadowRayDir = lightPos - its.p;
-        Ray3f shadowRay(its.p, shadowRayDir.normalized());
+        Ray3f shadowRay = its.spawnRayTo(lightPos);
 
         float cosine = shadowRayDir.normalized().dot(its.shFrame.n.normalized());
         float v = scene->rayIntersect(shadowRay) ? 0.0f : 1.0f;
@@ -9,10 +9,10 @@ public:
 
     }
 
-    Color3f Li(const Scene* scene, Sampler* sampler, const Ray3f& ray) const {
-        Intersection its;
-        if (!scene->rayIntersect(ray, its))
+    Color3f LiFromIntersection(const Scene* scene, Sampler* sampler, const Ray3f& ray, const Intersection* _its) const {
+        if (!_its)
             return Color3f(0.0f);
+        const Intersection& its = *_its;
 
         if (its.mesh->getBSDF()->isDiffuse()) {
             //random numbers
@@ -35,14 +35,9 @@ public:
             Normal3f lightN;
             float pdf;
             Point3f lightpoint = sample_mesh->squareToUniformMesh(sampler, lightN, pdf);
-            Vector3f wi = lightpoint - its.p;
-            float d = wi.norm();
-            wi.normalize();
+            Vector3f wi = (lightpoint - its.p).normalized();
 
-
-            //Important!!!
-            ///Todo: study pbrt and copy the epsilon solution.
-            Ray3f shadowRay(its.p, wi, Epsilon, d - Epsilon);
+            Ray3f shadowRay = its.spawnRayTo(lightpoint);
 
             //float v = scene->rayIntersect(shadowRay) ? 0.0f : 1.0f;
             if (scene->rayIntersect(shadowRay))
@@ -62,7 +57,10 @@ public:
                 BSDFQueryRecord bqr(its.toLocal(-ray.d));
                 Color3f brdf = its.mesh->getBSDF()->sample(bqr, sampler->next2D());
 
-                return 1.0f / 0.95f * brdf * Li(scene, sampler, Ray3f(its.p, its.toWorld(bqr.wo)));
+                Ray3f nextRay = its.spawnRay(its.toWorld(bqr.wo));
+                Intersection nextIts;
+                bool hit = scene->rayIntersect(nextRay, nextIts);
+                return 1.0f / 0.95f * brdf * LiFromIntersection(scene, sampler, nextRay, hit ? &nextIts : nullptr);
             }
             else {
                 return Color3f(0.0f);
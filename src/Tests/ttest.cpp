@@ -9,6 +9,7 @@
 #include <nori/camera.h>
 #include <nori/integrator.h>
 #include <nori/sampler.h>
+#include <nori/allocations.h>
 #include <hypothesis.h>
 #include <pcg32.h>
 
@@ -151,6 +152,11 @@ public:
 
                 cout << "Generating " << m_sampleCount << " paths.. " << endl;
 
+                /* Integrator::Li() must not allocate; register the ray statistics
+                   of this thread first, since that allocates once */
+                RayStats::localCost();
+                uint64_t allocations = 0;
+
                 double mean = 0, variance = 0;
                 for (int k=0; k<m_sampleCount; ++k) {
                     /* Sample a ray from the camera */
@@ -160,7 +166,9 @@ public:
                     Color3f value = camera->sampleRay(ray, pixelSample, sampler->next2D());
 
                     /* Compute the incident radiance */
+                    uint64_t allocationsBefore = AllocationCounter::local();
                     value *= integrator->Li(scene, sampler, ray);
+                    allocations += AllocationCounter::local() - allocationsBefore;
 
                     /* Numerically robust online variance estimation using an
                        algorithm proposed by Donald Knuth (TAOCP vol.2, 3rd ed., p.232) */
@@ -175,6 +183,12 @@ public:
                     result = hypothesis::students_t_test(mean, variance, reference,
                         m_sampleCount, m_significanceLevel, (int) m_references.size());
 
+                if (allocations > 0) {
+                    result.first = false;
+                    result.second += tfm::format("\nFailed: Integrator::Li() made %llu heap allocations.",
+                        (unsigned long long) allocations);
+                }
+
                 if (result.first)
                     ++passed;
                 cout << result.second << endl;
@@ -9,6 +9,7 @@
 #include <Eigen/LU>
 #include <filesystem/resolver.h>
 #include <iomanip>
+#include <cstring>
 
 #if defined(PLATFORM_LINUX)
 #include <malloc.h>
@@ -158,6 +159,33 @@ std::string memString(size_t size, bool precise) {
     return os.str();
 }
 
+uint64_t hashBytes(const void *data, size_t size, uint64_t seed) {
+    /* Mix every 8-byte word with the MurmurHash3 finalizer; the mixing does
+       not depend on the running hash, so consecutive words overlap */
+    auto mix = [](uint64_t k) {
+        k ^= k >> 33; k *= 0xff51afd7ed558ccdULL;
+        k ^= k >> 33; k *= 0xc4ceb9fe1a85ec53ULL;
+        k ^= k >> 33;
+        return k;
+    };
+
+    const uint8_t *bytes = (const uint8_t *) data;
+    uint64_t hash = seed ^ mix(size + 0x9e3779b97f4a7c15ULL);
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, bytes + i, 8);
+        hash = ((hash << 27) | (hash >> 37)) ^ mix(word);
+        hash = hash * 5 + 0x52dce729;
+    }
+    if (i < size) {
+        uint64_t word = 0;
+        memcpy(&word, bytes + i, size - i);
+        hash ^= mix(word);
+    }
+    return mix(hash);
+}
+
 filesystem::resolver *getFileResolver() {
     static filesystem::resolver *resolver = new filesystem::resolver();
     return resolver;
@@ -13,18 +13,25 @@
 #include <nori/sampler.h>
 #include <nori/integrator.h>
 #include <nori/gui.h>
+#include <nori/allocations.h>
+#include <nori/nbin.h>
 #include <tbb/parallel_for.h>
 #include <tbb/blocked_range.h>
 #include <tbb/task_scheduler_init.h>
 #include <filesystem/resolver.h>
 #include <thread>
+#include <atomic>
 
 using namespace nori;
 
 static int threadCount = -1;
 static bool gui = true;
+static int firstFrame = 0, lastFrame = -1;
 
-static void renderBlock(const Scene *scene, Sampler *sampler, ImageBlock &block) {
+/* Heap allocations made while tracing samples (debug builds only) */
+static std::atomic<uint64_t> sampleAllocations(0);
+
+static void renderBlock(const Scene *scene, Sampler *sampler, ImageBlock &block, Bitmap *heatmap) {
     const Camera *camera = scene->getCamera();
     const Integrator *integrator = scene->getIntegrator();
 
@@ -34,25 +41,82 @@ static void renderBlock(const Scene *scene, Sampler *sampler, ImageBlock &block)
     /* Clear the block contents */
     block.clear();
 
-    /* For each pixel and pixel sample sample */
-    for (int y=0; y<size.y(); ++y) {
-        for (int x=0; x<size.x(); ++x) {
+    /* Camera rays of PACKET_SIZE x PACKET_SIZE neighboring pixels are
+       coherent, so they are traced together as a packet before every
+       sample continues on its own */
+    const int PACKET_SIZE = 4;
+    static_assert(PACKET_SIZE * PACKET_SIZE <= Accel::MAX_PACKET_SIZE, "Camera packets are too large");
+
+    Point2f pixelSamples[PACKET_SIZE * PACKET_SIZE];
+    Point2i pixels[PACKET_SIZE * PACKET_SIZE];
+    Color3f values[PACKET_SIZE * PACKET_SIZE];
+    Ray3f rays[PACKET_SIZE * PACKET_SIZE];
+    Intersection its[PACKET_SIZE * PACKET_SIZE];
+    bool hits[PACKET_SIZE * PACKET_SIZE];
+    uint64_t allocations = 0;
+
+    for (int py=0; py<size.y(); py+=PACKET_SIZE) {
+        for (int px=0; px<size.x(); px+=PACKET_SIZE) {
             for (uint32_t i=0; i<sampler->getSampleCount(); ++i) {
-                Point2f pixelSample = Point2f((float) (x + offset.x()), (float) (y + offset.y())) + sampler->next2D();
-                Point2f apertureSample = sampler->next2D();
+                uint32_t count = 0;
+                for (int y=py; y<std::min(py + PACKET_SIZE, size.y()); ++y) {
+                    for (int x=px; x<std::min(px + PACKET_SIZE, size.x()); ++x) {
+                        pixels[count] = Point2i(x + offset.x(), y + offset.y());
+                        pixelSamples[count] = Point2f((float) pixels[count].x(), (float) pixels[count].y()) + sampler->next2D();
+                        Point2f apertureSample = sampler->next2D();
+
+                        /* Sample a ray from the camera */
+                        values[count] = camera->sampleRay(rays[count], pixelSamples[count], apertureSample);
+                        count++;
+                    }
+                }
+
+                /* (The first RayStats query of a thread allocates its record, so it comes first) */
+                uint64_t cost = RayStats::localCost();
+                uint64_t allocationsBefore = AllocationCounter::local();
+                scene->rayIntersectPacket(rays, count, its, hits);
+
+                /* The pixels of a packet share its traversal cost equally */
+                float packetCost = (float) (RayStats::localCost() - cost) / (float) count;
+
+                for (uint32_t j=0; j<count; ++j) {
+                    cost = RayStats::localCost();
+
+                    /* Compute the incident radiance */
+                    Color3f value = values[j] * integrator->LiFromIntersection(scene, sampler, rays[j], hits[j] ? &its[j] : nullptr);
+
+                    /* Store in the image block */
+                    block.put(pixelSamples[j], value);
+
+                    if (heatmap)
+                        heatmap->coeffRef(pixels[j].y(), pixels[j].x()).r() += packetCost + (float) (RayStats::localCost() - cost);
+                }
+                allocations += AllocationCounter::local() - allocationsBefore;
+            }
+        }
+    }
+    sampleAllocations += allocations;
+}
 
-                /* Sample a ray from the camera */
-                Ray3f ray;
-                Color3f value = camera->sampleRay(ray, pixelSample, apertureSample);
+/// Save the traversal cost per sample as EXR and as a false color PNG (blue: cheap, red: most expensive pixel)
+static void saveHeatmap(Bitmap &heatmap, uint32_t sampleCount, const std::string &outputName) {
+    const Color3f ramp[5] = { Color3f(0.f, 0.f, 1.f), Color3f(0.f, 1.f, 1.f), Color3f(0.f, 1.f, 0.f),
+        Color3f(1.f, 1.f, 0.f), Color3f(1.f, 0.f, 0.f) };
 
-                /* Compute the incident radiance */
-                value *= integrator->Li(scene, sampler, ray);
+    float maxCost = 0.f;
+    for (int i = 0; i < (int) heatmap.size(); ++i) {
+        heatmap(i) = Color3f(heatmap(i).r() / (float) sampleCount);
+        maxCost = std::max(maxCost, heatmap(i).r());
+    }
+    heatmap.saveEXR(outputName + "_heatmap");
 
-                /* Store in the image block */
-                block.put(pixelSample, value);
-            }
-        }
+    for (int i = 0; i < (int) heatmap.size(); ++i) {
+        float f = maxCost > 0.f ? 4.f * heatmap(i).r() / maxCost : 0.f;
+        int stop = std::min((int) f, 3);
+        heatmap(i) = ramp[stop] * (1.f - (f - stop)) + ramp[stop + 1] * (f - stop);
     }
+    heatmap.savePNG(outputName + "_heatmap");
+    cout << "Traversal cost heatmap written, max. cost per sample: " << maxCost << endl;
 }
 
 static void render(Scene *scene, const std::string &filename) {
@@ -67,6 +131,17 @@ static void render(Scene *scene, const std::string &filename) {
     ImageBlock result(outputSize, camera->getReconstructionFilter());
     result.clear();
 
+    /* With NORI_RAY_STATS, the traversal cost (nodes visited plus
+       triangles tested) of every pixel is recorded as well */
+    std::unique_ptr<Bitmap> heatmap;
+    if (RayStats::enabled) {
+        heatmap.reset(new Bitmap(outputSize));
+        heatmap->setConstant(Color3f(0.f));
+        RayStats::reset();
+    }
+
+    sampleAllocations = 0;
+
     /* Create a window that visualizes the partially rendered result */
     NoriScreen *screen = nullptr;
     if (gui) {
@@ -101,7 +176,7 @@ static void render(Scene *scene, const std::string &filename) {
                 sampler->prepare(block);
 
                 /* Render all contained pixels */
-                renderBlock(scene, sampler.get(), block);
+                renderBlock(scene, sampler.get(), block, heatmap.get());
 
                 /* The image block has been processed. Now add it to
                    the "big" block that represents the entire image */
@@ -145,11 +220,39 @@ static void render(Scene *scene, const std::string &filename) {
 
     /* Save tonemapped (sRGB) output using the PNG format */
     bitmap->savePNG(outputName);
+
+    if (sampleAllocations > 0)
+        cerr << "Warning: " << sampleAllocations << " heap allocations while tracing samples!" << endl;
+
+    if (heatmap) {
+        cout << RayStats::total().toString() << endl;
+        saveHeatmap(*heatmap, scene->getSampler()->getSampleCount(), outputName);
+    }
+}
+
+/// Load a mesh with the loader named after its extension and store it in the nbin format
+static int convertMesh(const std::string &input, const std::string &output) {
+    try {
+        PropertyList propList;
+        propList.setString("filename", input);
+        std::unique_ptr<Mesh> mesh(static_cast<Mesh *>(
+            NoriObjectFactory::createInstance(filesystem::path(input).extension(), propList)));
+        cout << "Writing \"" << output << "\" .. ";
+        cout.flush();
+        Timer timer;
+        writeNBin(mesh.get(), output);
+        cout << "done. (took " << timer.elapsedString() << ")" << endl;
+    } catch (const std::exception &e) {
+        cerr << "Fatal error: " << e.what() << endl;
+        return -1;
+    }
+    return 0;
 }
 
 int main(int argc, char **argv) {
     if (argc < 2) {
-        cerr << "Syntax: " << argv[0] << " <scene.xml> [--no-gui] [--threads N]" <<  endl;
+        cerr << "Syntax: " << argv[0] << " <scene.xml> [--no-gui] [--threads N] [--frames FIRST:LAST]" <<  endl;
+        cerr << "        " << argv[0] << " --convert <mesh.obj> <mesh.nbin>" << endl;
         return -1;
     }
 
@@ -176,6 +279,30 @@ int main(int argc, char **argv) {
             gui = false;
             continue;
         }
+        else if (token == "--convert") {
+            if (i+2 >= argc) {
+                cerr << "\"--convert\" argument expects an input and an output mesh filename following it." << endl;
+                return -1;
+            }
+            return convertMesh(argv[i+1], argv[i+2]);
+        }
+        else if (token == "--frames") {
+            /* Multi-frame mode: render an animation sequence */
+            std::vector<std::string> range = i+1 < argc ? tokenize(argv[i+1], ":") : std::vector<std::string>();
+            if (range.size() != 2) {
+                cerr << "\"--frames\" argument expects a frame range FIRST:LAST following it." << endl;
+                return -1;
+            }
+            firstFrame = toInt(range[0]);
+            lastFrame = toInt(range[1]);
+            i++;
+            if (firstFrame < 0 || lastFrame < firstFrame) {
+                cerr << "\"--frames\" argument expects a frame range FIRST:LAST following it." << endl;
+                return -1;
+            }
+
+            continue;
+        }
 
         filesystem::path path(argv[i]);
 
@@ -234,8 +361,24 @@ int main(int argc, char **argv) {
         try {
             std::unique_ptr<NoriObject> root(loadFromXML(sceneName));
             /* When the XML root object is a scene, start rendering it .. */
-            if (root->getClassType() == NoriObject::EScene)
-                render(static_cast<Scene *>(root.get()), sceneName);
+            if (root->getClassType() == NoriObject::EScene) {
+                Scene *scene = static_cast<Scene *>(root.get());
+                if (lastFrame < 0) {
+                    render(scene, sceneName);
+                } else {
+                    /* Render every frame to its own image, refitting the
+                       acceleration structure in between */
+                    std::string baseName = sceneName.substr(0, sceneName.find_last_of("."));
+                    gui = false;
+                    for (int frame = firstFrame; frame <= lastFrame; ++frame) {
+                        cout << "Frame " << frame << " .. " << endl;
+                        Timer timer;
+                        scene->setFrame(frame);
+                        cout << "Scene update took " << timer.elapsedString() << endl;
+                        render(scene, tfm::format("%s_%04i.exr", baseName, frame));
+                    }
+                }
+            }
         } catch (const std::exception &e) {
             cerr << e.what() << endl;
             return -1;
@@ -0,0 +1,76 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <nori/mappedfile.h>
+
+#if defined(PLATFORM_WINDOWS)
+#include <fstream>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+NORI_NAMESPACE_BEGIN
+
+MappedFile::MappedFile(const std::string &filename, bool sequential) {
+#if defined(PLATFORM_WINDOWS)
+    (void) sequential;
+    std::ifstream is(filename, std::ios::binary | std::ios::ate);
+    if (!is)
+        return;
+    m_buffer.resize((size_t) is.tellg());
+    is.seekg(0);
+    if (!is.read(m_buffer.data(), m_buffer.size()))
+        return;
+    m_data = m_buffer.empty() ? nullptr : m_buffer.data();
+    m_size = m_buffer.size();
+    m_valid = true;
+#else
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        return;
+    struct stat sb;
+    if (fstat(fd, &sb) == 0) {
+        if (sb.st_size == 0) {
+            m_valid = true;
+        } else {
+            void *ptr = mmap(nullptr, (size_t) sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (ptr != MAP_FAILED) {
+                if (sequential)
+                    madvise(ptr, (size_t) sb.st_size, MADV_SEQUENTIAL);
+                m_data = (const char *) ptr;
+                m_size = (size_t) sb.st_size;
+                m_valid = true;
+            }
+        }
+    }
+    close(fd);
+#endif
+}
+
+MappedFile::~MappedFile() {
+#if !defined(PLATFORM_WINDOWS)
+    if (m_data)
+        munmap((void *) m_data, m_size);
+#endif
+}
+
+NORI_NAMESPACE_END
@@ -7,7 +7,9 @@
 #include <nori/mesh.h>
 #include <nori/bsdf.h>
 #include <nori/emitter.h>
+#include <nori/instance.h>
 #include <nori/warp.h>
+#include <nori/raystats.h>
 #include <Eigen/Geometry>
 
 NORI_NAMESPACE_BEGIN
@@ -17,6 +19,8 @@ Mesh::Mesh() { }
 Mesh::~Mesh() {
     delete m_bsdf;
     delete m_emitter;
+    for (Instance *instance : m_instances)
+        delete instance;
 }
 
 void Mesh::activate() {
@@ -26,75 +30,137 @@ void Mesh::activate() {
             NoriObjectFactory::createInstance("diffuse", PropertyList()));
     }
 
+    /* Light sampling works on the mesh geometry in world space */
+    if (isEmitter() && !m_instances.empty())
+        throw NoriException("Mesh \"%s\": emitters cannot be instanced!", m_name);
+
     //generate cdf if emitted
-    if(isEmitter()){
-        dpdf.reserve(getTriangleCount());
-        for(size_t i = 0; i < getTriangleCount(); ++i){
-            dpdf.append(surfaceArea(i));
-        }
-        dpdf.normalize();
+    if(isEmitter())
+        computeEmitterPDF();
+}
+
+void Mesh::computeEmitterPDF() {
+    dpdf.clear();
+    dpdf.reserve(getTriangleCount());
+    for(size_t i = 0; i < getTriangleCount(); ++i){
+        dpdf.append(surfaceArea(i));
     }
+    dpdf.normalize();
+}
+
+void Mesh::mapArrays() {
+    mapArrays(m_V.data(), m_N.size() > 0 ? m_N.data() : nullptr,
+              m_UV.size() > 0 ? m_UV.data() : nullptr, m_F.data(),
+              (uint32_t) m_V.cols(), (uint32_t) m_F.cols());
+}
+
+void Mesh::mapArrays(const float *V, const float *N, const float *UV, const uint32_t *F,
+                     uint32_t vertexCount, uint32_t triangleCount) {
+    /* Eigen maps are rebound by constructing them again in place */
+    new (&m_VMap) MatrixXfMap(V, 3, vertexCount);
+    new (&m_NMap) MatrixXfMap(N, 3, N ? vertexCount : 0);
+    new (&m_UVMap) MatrixXfMap(UV, 2, UV ? vertexCount : 0);
+    new (&m_FMap) MatrixXuMap(F, 3, triangleCount);
+}
+
+bool Mesh::setFrame(int frame) {
+    if (!loadFrame(frame))
+        return false;
+
+    /* The triangle areas changed along with the vertex positions */
+    if (isEmitter())
+        computeEmitterPDF();
+    return true;
 }
 
 float Mesh::surfaceArea(uint32_t index) const {
-    uint32_t i0 = m_F(0, index), i1 = m_F(1, index), i2 = m_F(2, index);
+    uint32_t i0 = m_FMap(0, index), i1 = m_FMap(1, index), i2 = m_FMap(2, index);
 
-    const Point3f p0 = m_V.col(i0), p1 = m_V.col(i1), p2 = m_V.col(i2);
+    const Point3f p0 = m_VMap.col(i0), p1 = m_VMap.col(i1), p2 = m_VMap.col(i2);
 
     return 0.5f * Vector3f((p1 - p0).cross(p2 - p0)).norm();
 }
 
 bool Mesh::rayIntersect(uint32_t index, const Ray3f &ray, float &u, float &v, float &t) const {
-    uint32_t i0 = m_F(0, index), i1 = m_F(1, index), i2 = m_F(2, index);
-    const Point3f p0 = m_V.col(i0), p1 = m_V.col(i1), p2 = m_V.col(i2);
-
-    /* Find vectors for two edges sharing v[0] */
-    Vector3f edge1 = p1 - p0, edge2 = p2 - p0;
-
-    /* Begin calculating determinant - also used to calculate U parameter */
-    Vector3f pvec = ray.d.cross(edge2);
+    NORI_STAT(triangle_tests, 1);
+    uint32_t i0 = m_FMap(0, index), i1 = m_FMap(1, index), i2 = m_FMap(2, index);
+    return rayIntersect(m_VMap.col(i0), m_VMap.col(i1), m_VMap.col(i2), ray, u, v, t);
+}
 
-    /* If determinant is near zero, ray lies in plane of triangle */
-    float det = edge1.dot(pvec);
+bool Mesh::rayIntersect(const Point3f &p0, const Point3f &p1, const Point3f &p2,
+        const Ray3f &ray, float &u, float &v, float &t) {
+    /* Permute the axes so that the largest direction component becomes z */
+    int kz = 0;
+    if (std::abs(ray.d.y()) > std::abs(ray.d[kz])) kz = 1;
+    if (std::abs(ray.d.z()) > std::abs(ray.d[kz])) kz = 2;
+    int kx = kz == 2 ? 0 : kz + 1, ky = kx == 2 ? 0 : kx + 1;
+
+    /* Translate the vertices to the ray origin and shear them, so that the ray runs along +z */
+    float sx = -ray.d[kx] * ray.dRcp[kz], sy = -ray.d[ky] * ray.dRcp[kz], sz = ray.dRcp[kz];
+    Vector3f p0t = p0 - ray.o, p1t = p1 - ray.o, p2t = p2 - ray.o;
+    float x0 = p0t[kx] + sx * p0t[kz], y0 = p0t[ky] + sy * p0t[kz];
+    float x1 = p1t[kx] + sx * p1t[kz], y1 = p1t[ky] + sy * p1t[kz];
+    float x2 = p2t[kx] + sx * p2t[kz], y2 = p2t[ky] + sy * p2t[kz];
+
+    /* Edge functions; the sign of each one tells on which side of the edge the ray passes */
+    float e0 = x1 * y2 - y1 * x2;
+    float e1 = x2 * y0 - y2 * x0;
+    float e2 = x0 * y1 - y0 * x1;
+
+    /* Fall back to double precision when the ray hits an edge exactly */
+    if (e0 == 0.f || e1 == 0.f || e2 == 0.f) {
+        e0 = (float) ((double) x1 * (double) y2 - (double) y1 * (double) x2);
+        e1 = (float) ((double) x2 * (double) y0 - (double) y2 * (double) x0);
+        e2 = (float) ((double) x0 * (double) y1 - (double) y0 * (double) x1);
+    }
 
-    if (det > -1e-8f && det < 1e-8f)
+    if ((e0 < 0.f || e1 < 0.f || e2 < 0.f) && (e0 > 0.f || e1 > 0.f || e2 > 0.f))
         return false;
-    float inv_det = 1.0f / det;
-
-    /* Calculate distance from v[0] to ray origin */
-    Vector3f tvec = ray.o - p0;
-
-    /* Calculate U parameter and test bounds */
-    u = tvec.dot(pvec) * inv_det;
-    if (u < 0.0 || u > 1.0)
+    float det = e0 + e1 + e2;
+    if (det == 0.f)
         return false;
 
-    /* Prepare to test V parameter */
-    Vector3f qvec = tvec.cross(edge1);
-
-    /* Calculate V parameter and test bounds */
-    v = ray.d.dot(qvec) * inv_det;
-    if (v < 0.0 || u + v > 1.0)
+    /* Scaled distance; the division by the determinant is deferred until the hit is certain */
+    float z0 = sz * p0t[kz], z1 = sz * p1t[kz], z2 = sz * p2t[kz];
+    float t_scaled = e0 * z0 + e1 * z1 + e2 * z2;
+    if (det < 0.f && (t_scaled >= 0.f || t_scaled < ray.maxt * det))
+        return false;
+    if (det > 0.f && (t_scaled <= 0.f || t_scaled > ray.maxt * det))
         return false;
 
-    /* Ray intersects triangle -> compute t */
-    t = edge2.dot(qvec) * inv_det;
+    float inv_det = 1.f / det;
+    u = e1 * inv_det;
+    v = e2 * inv_det;
+    t = t_scaled * inv_det;
+
+    /* Reject hits that could lie behind the origin because of the rounding error of t */
+    float max_z = std::max(std::max(std::abs(z0), std::abs(z1)), std::abs(z2));
+    float max_x = std::max(std::max(std::abs(x0), std::abs(x1)), std::abs(x2));
+    float max_y = std::max(std::max(std::abs(y0), std::abs(y1)), std::abs(y2));
+    float max_e = std::max(std::max(std::abs(e0), std::abs(e1)), std::abs(e2));
+    float delta_z = roundingError(3) * max_z;
+    float delta_x = roundingError(5) * (max_x + max_z);
+    float delta_y = roundingError(5) * (max_y + max_z);
+    float delta_e = 2.f * (roundingError(2) * max_x * max_y + delta_y * max_x + delta_x * max_y);
+    float delta_t = 3.f * (roundingError(3) * max_e * max_z + delta_e * max_z + delta_z * max_e) * std::abs(inv_det);
+    if (t <= delta_t)
+        return false;
 
     return t >= ray.mint && t <= ray.maxt;
 }
 
 BoundingBox3f Mesh::getBoundingBox(uint32_t index) const {
-    BoundingBox3f result(m_V.col(m_F(0, index)));
-    result.expandBy(m_V.col(m_F(1, index)));
-    result.expandBy(m_V.col(m_F(2, index)));
+    BoundingBox3f result(m_VMap.col(m_FMap(0, index)));
+    result.expandBy(m_VMap.col(m_FMap(1, index)));
+    result.expandBy(m_VMap.col(m_FMap(2, index)));
     return result;
 }
 
 Point3f Mesh::getCentroid(uint32_t index) const {
     return (1.0f / 3.0f) *
-        (m_V.col(m_F(0, index)) +
-         m_V.col(m_F(1, index)) +
-         m_V.col(m_F(2, index)));
+        (m_VMap.col(m_FMap(0, index)) +
+         m_VMap.col(m_FMap(1, index)) +
+         m_VMap.col(m_FMap(2, index)));
 }
 
 void Mesh::addChild(NoriObject *obj) {
@@ -115,6 +181,10 @@ void Mesh::addChild(NoriObject *obj) {
             }
             break;
 
+        case EInstance:
+            m_instances.push_back(static_cast<Instance *>(obj));
+            break;
+
         default:
             throw NoriException("Mesh::addChild(<%s>) is not supported!",
                                 classTypeName(obj->getClassType()));
@@ -128,16 +198,45 @@ std::string Mesh::toString() const {
         "  vertexCount = %i,\n"
         "  triangleCount = %i,\n"
         "  bsdf = %s,\n"
-        "  emitter = %s\n"
+        "  emitter = %s,\n"
+        "  instances = %i\n"
         "]",
         m_name,
-        m_V.cols(),
-        m_F.cols(),
+        m_VMap.cols(),
+        m_FMap.cols(),
         m_bsdf ? indent(m_bsdf->toString()) : std::string("null"),
-        m_emitter ? indent(m_emitter->toString()) : std::string("null")
+        m_emitter ? indent(m_emitter->toString()) : std::string("null"),
+        m_instances.size()
     );
 }
 
+Ray3f Intersection::spawnRay(const Vector3f &d) const {
+    /* Offset along the normal by the error bound projected onto it */
+    const Normal3f &n = geoFrame.n;
+    float dist = n.cwiseAbs().dot(pError);
+    Vector3f offset = dist * n;
+    if (d.dot(n) < 0.f)
+        offset = -offset;
+
+    /* Round away from p, so that the offset origin can not snap back onto the surface */
+    Point3f o = p + offset;
+    for (int i = 0; i < 3; ++i) {
+        if (offset[i] > 0.f)
+            o[i] = std::nextafter(o[i], std::numeric_limits<float>::infinity());
+        else if (offset[i] < 0.f)
+            o[i] = std::nextafter(o[i], -std::numeric_limits<float>::infinity());
+    }
+    return Ray3f(o, d);
+}
+
+Ray3f Intersection::spawnRayTo(const Point3f &target) const {
+    Ray3f ray = spawnRay(target - p);
+    ray.d = target - ray.o;
+    ray.update();
+    ray.maxt = 1.f - ShadowEpsilon;
+    return ray;
+}
+
 std::string Intersection::toString() const {
     if (!mesh)
         return "Intersection[invalid]";
@@ -149,6 +248,7 @@ std::string Intersection::toString() const {
         "  uv = %s,\n"
         "  shFrame = %s,\n"
         "  geoFrame = %s,\n"
+        "  pError = %s,\n"
         "  mesh = %s\n"
         "]",
         p.toString(),
@@ -156,6 +256,7 @@ std::string Intersection::toString() const {
         uv.toString(),
         indent(shFrame.toString()),
         indent(geoFrame.toString()),
+        pError.toString(),
         mesh ? mesh->toString() : std::string("null")
     );
 }
@@ -167,12 +268,12 @@ Point3f Mesh::squareToUniformMesh(Sampler *sampler, Normal3f &n, float &pdf) con
     //important: use another random number!
     size_t tri_idx = dpdf.sample(sampler->next1D());
 
-    uint32_t idx0 = m_F(0, tri_idx), idx1 = m_F(1, tri_idx), idx2 = m_F(2, tri_idx);
-    Point3f p0 = m_V.col(idx0), p1 = m_V.col(idx1), p2 = m_V.col(idx2);
+    uint32_t idx0 = m_FMap(0, tri_idx), idx1 = m_FMap(1, tri_idx), idx2 = m_FMap(2, tri_idx);
+    Point3f p0 = m_VMap.col(idx0), p1 = m_VMap.col(idx1), p2 = m_VMap.col(idx2);
 
     float alpha = 1.0f - sqrt(1.0f - ep1), beta = ep2 * sqrt(1.0f - ep1), gamma = 1.0f - alpha - beta;
-    if(m_N.size() > 0){
-        n = alpha * m_N.col(idx0) + beta * m_N.col(idx1) + gamma * m_N.col(idx2);
+    if(m_NMap.size() > 0){
+        n = alpha * m_NMap.col(idx0) + beta * m_NMap.col(idx1) + gamma * m_NMap.col(idx2);
     }else{
         n = Normal3f((p1 - p0).cross(p2 - p0));
     }
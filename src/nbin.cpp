@@ -0,0 +1,235 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+*/
+
+#include <nori/nbin.h>
+#include <nori/timer.h>
+#include <nori/mappedfile.h>
+#include <filesystem/resolver.h>
+#include <fstream>
+#include <cstring>
+
+NORI_NAMESPACE_BEGIN
+
+namespace {
+    /// Increase when the file layout changes
+    constexpr uint32_t NBIN_VERSION = 1;
+
+    /// The arrays start at multiples of this many bytes
+    constexpr uint64_t NBIN_ALIGNMENT = 64;
+
+    /**
+     * Header of an nbin file. The arrays follow at the given byte offsets
+     * (zero for missing normals or texture coordinates): 3 floats per
+     * vertex position and normal, 2 per texture coordinate, 3 indices
+     * per face and the <tt>num_triangles+1</tt> running sums of the
+     * triangle areas.
+     */
+    struct NBinHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t pad0;
+        uint64_t num_vertices;
+        uint64_t num_triangles;
+        float bbox_min[3];
+        float bbox_max[3];
+        uint64_t positions;
+        uint64_t normals;
+        uint64_t texcoords;
+        uint64_t indices;
+        uint64_t area_cdf;
+        uint32_t pad1[8];
+    };
+    static_assert(sizeof(NBinHeader) == 128, "nbin header should be 128 bytes");
+
+    const char NBIN_MAGIC[8] = { 'N', 'O', 'R', 'I', 'N', 'B', 'I', 'N' };
+
+    /// The arrays are stored little-endian and mapped as they are
+    bool isLittleEndian() {
+        uint32_t value = 1;
+        char first;
+        memcpy(&first, &value, 1);
+        return first == 1;
+    }
+}
+
+/**
+ * \brief Mesh stored in the binary "nbin" format (see \ref writeNBin())
+ *
+ * The arrays are used directly from the memory mapped file, so loading
+ * only has to validate the indices and concurrent render processes share
+ * the pages. A
+ * \c toWorld transformation is supported, but the mesh then has to be
+ * copied and transformed; use instances to place shared geometry.
+ */
+class NBinMesh : public Mesh {
+public:
+    NBinMesh(const PropertyList &propList) {
+        filesystem::path filename =
+            getFileResolver()->resolve(propList.getString("filename"));
+        Transform trafo = propList.getTransform("toWorld", Transform());
+
+        if (!isLittleEndian())
+            throw NoriException("nbin files can only be used on little-endian machines!");
+
+        /* The renderer accesses the arrays in random order */
+        m_file.reset(new MappedFile(filename.str(), false));
+        if (!m_file->isValid())
+            throw NoriException("Unable to open nbin file \"%s\"!", filename);
+
+        Timer timer;
+
+        NBinHeader header;
+        if (m_file->size() < sizeof(NBinHeader))
+            throw NoriException("nbin file \"%s\" is truncated!", filename);
+        memcpy(&header, m_file->data(), sizeof(NBinHeader));
+        if (memcmp(header.magic, NBIN_MAGIC, sizeof(NBIN_MAGIC)) != 0)
+            throw NoriException("\"%s\" is not an nbin file!", filename);
+        if (header.version != NBIN_VERSION)
+            throw NoriException("nbin file \"%s\" has version %i, but only version %i is supported!",
+                filename, header.version, NBIN_VERSION);
+        if (header.num_vertices > UINT32_MAX || header.num_triangles > UINT32_MAX)
+            throw NoriException("nbin file \"%s\" is too large!", filename);
+
+        uint32_t nVertices = (uint32_t) header.num_vertices;
+        uint32_t nTriangles = (uint32_t) header.num_triangles;
+        const float *V = array<float>(header.positions, 3 * (uint64_t) nVertices, filename);
+        const float *N = array<float>(header.normals, 3 * (uint64_t) nVertices, filename);
+        const float *UV = array<float>(header.texcoords, 2 * (uint64_t) nVertices, filename);
+        const uint32_t *F = array<uint32_t>(header.indices, 3 * (uint64_t) nTriangles, filename);
+        const float *cdf = array<float>(header.area_cdf, (uint64_t) nTriangles + 1, filename);
+        if (!V || !F || !cdf)
+            throw NoriException("nbin file \"%s\" is missing vertex positions or faces!", filename);
+
+        /* Out-of-range indices or a decreasing area distribution would be read without checks later on */
+        for (uint64_t i = 0; i < 3 * (uint64_t) nTriangles; ++i)
+            if (F[i] >= nVertices)
+                throw NoriException("nbin file \"%s\" is corrupt (face index out of range)!", filename);
+        if (cdf[0] != 0.0f)
+            throw NoriException("nbin file \"%s\" is corrupt (invalid area distribution)!", filename);
+        for (uint32_t i = 0; i < nTriangles; ++i)
+            if (!(cdf[i + 1] >= cdf[i]))
+                throw NoriException("nbin file \"%s\" is corrupt (invalid area distribution)!", filename);
+
+        if (trafo.getMatrix().isIdentity()) {
+            mapArrays(V, N, UV, F, nVertices, nTriangles);
+            m_bbox = BoundingBox3f(Point3f(header.bbox_min[0], header.bbox_min[1], header.bbox_min[2]),
+                                   Point3f(header.bbox_max[0], header.bbox_max[1], header.bbox_max[2]));
+            m_areaCDF = cdf;
+        } else {
+            /* The positions, normals and triangle areas change */
+            m_V = MatrixXfMap(V, 3, nVertices);
+            m_F = MatrixXuMap(F, 3, nTriangles);
+            m_bbox.reset();
+            for (uint32_t i = 0; i < nVertices; ++i) {
+                Point3f p = trafo * Point3f(m_V.col(i));
+                m_V.col(i) = p;
+                m_bbox.expandBy(p);
+            }
+            if (N) {
+                m_N = MatrixXfMap(N, 3, nVertices);
+                for (uint32_t i = 0; i < nVertices; ++i)
+                    m_N.col(i) = (trafo * Normal3f(m_N.col(i))).normalized();
+            }
+            if (UV)
+                m_UV = MatrixXfMap(UV, 2, nVertices);
+            mapArrays();
+        }
+
+        m_name = filename.str();
+        /* A single write, since the parser loads meshes concurrently */
+        cout << tfm::format("Loading \"%s\" .. done. (V=%i, F=%i, took %s, %s mapped)\n",
+            filename, nVertices, nTriangles, timer.elapsedString(), memString(m_file->size()));
+    }
+
+protected:
+    /// Reuse the stored area distribution unless the mesh was transformed
+    void computeEmitterPDF() override {
+        if (!m_areaCDF) {
+            Mesh::computeEmitterPDF();
+            return;
+        }
+        dpdf.setCDF(m_areaCDF, getTriangleCount());
+        dpdf.normalize();
+    }
+
+private:
+    /// Return the array of \c count values at byte \c offset, \c nullptr if the offset is zero
+    template <typename T> const T *array(uint64_t offset, uint64_t count,
+            const filesystem::path &filename) const {
+        if (offset == 0)
+            return nullptr;
+        if (offset % alignof(T) != 0 || offset > m_file->size() ||
+            count > (m_file->size() - offset) / sizeof(T))
+            throw NoriException("nbin file \"%s\" is truncated!", filename);
+        return (const T *) (m_file->data() + offset);
+    }
+
+    std::unique_ptr<MappedFile> m_file;   ///< Storage of the arrays
+    const float *m_areaCDF = nullptr;     ///< Stored triangle area distribution
+};
+
+void writeNBin(const Mesh *mesh, const std::string &filename) {
+    if (!isLittleEndian())
+        throw NoriException("nbin files can only be written on little-endian machines!");
+
+    const MatrixXfMap &V = mesh->getVertexPositions();
+    const MatrixXfMap &N = mesh->getVertexNormals();
+    const MatrixXfMap &UV = mesh->getVertexTexCoords();
+    const MatrixXuMap &F = mesh->getIndices();
+
+    /* Same running sums as in Mesh::computeEmitterPDF() */
+    std::vector<float> cdf(F.cols() + 1, 0.0f);
+    for (uint32_t i = 0; i < (uint32_t) F.cols(); ++i)
+        cdf[i + 1] = cdf[i] + mesh->surfaceArea(i);
+
+    NBinHeader header;
+    memset(&header, 0, sizeof(NBinHeader));
+    memcpy(header.magic, NBIN_MAGIC, sizeof(NBIN_MAGIC));
+    header.version = NBIN_VERSION;
+    header.num_vertices = (uint64_t) V.cols();
+    header.num_triangles = (uint64_t) F.cols();
+    const BoundingBox3f &bbox = mesh->getBoundingBox();
+    for (int i = 0; i < 3; ++i) {
+        header.bbox_min[i] = bbox.min[i];
+        header.bbox_max[i] = bbox.max[i];
+    }
+
+    struct Array { const void *data; uint64_t size; uint64_t *offset; };
+    Array arrays[] = {
+        { V.data(),   sizeof(float) * (uint64_t) V.size(),    &header.positions },
+        { N.data(),   sizeof(float) * (uint64_t) N.size(),    &header.normals },
+        { UV.data(),  sizeof(float) * (uint64_t) UV.size(),   &header.texcoords },
+        { F.data(),   sizeof(uint32_t) * (uint64_t) F.size(), &header.indices },
+        { cdf.data(), sizeof(float) * (uint64_t) cdf.size(),  &header.area_cdf }
+    };
+
+    uint64_t offset = sizeof(NBinHeader);
+    for (Array &array : arrays) {
+        /* Positions and faces are stored even if they are empty */
+        if (array.size == 0 && &array != &arrays[0] && &array != &arrays[3])
+            continue;
+        offset = (offset + NBIN_ALIGNMENT - 1) / NBIN_ALIGNMENT * NBIN_ALIGNMENT;
+        *array.offset = offset;
+        offset += array.size;
+    }
+
+    std::ofstream os(filename, std::ios::binary);
+    os.write((const char *) &header, sizeof(NBinHeader));
+    uint64_t written = sizeof(NBinHeader);
+    const char padding[NBIN_ALIGNMENT] = { };
+    for (const Array &array : arrays) {
+        if (*array.offset == 0)
+            continue;
+        os.write(padding, (std::streamsize) (*array.offset - written));
+        os.write((const char *) array.data, (std::streamsize) array.size);
+        written = *array.offset + array.size;
+    }
+    if (!os)
+        throw NoriException("Unable to write nbin file \"%s\"!", filename);
+}
+
+NORI_REGISTER_CLASS(NBinMesh, "nbin");
+NORI_NAMESPACE_END
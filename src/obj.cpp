@@ -6,9 +6,14 @@
 
 #include <nori/mesh.h>
 #include <nori/timer.h>
+#include <nori/mappedfile.h>
 #include <filesystem/resolver.h>
-#include <unordered_map>
-#include <fstream>
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <cstring>
 
 NORI_NAMESPACE_BEGIN
 
@@ -18,145 +23,459 @@ NORI_NAMESPACE_BEGIN
 class WavefrontOBJ : public Mesh {
 public:
     WavefrontOBJ(const PropertyList &propList) {
-        typedef std::unordered_map<OBJVertex, uint32_t, OBJVertexHash> VertexMap;
+        m_filename = propList.getString("filename");
+        m_toWorld = propList.getTransform("toWorld", Transform());
+        m_frame = propList.getInteger("frame", 0);
+        load(m_frame);
+    }
 
-        filesystem::path filename =
-            getFileResolver()->resolve(propList.getString("filename"));
+protected:
+    /**
+     * \brief Load the OBJ file of an animation frame
+     *
+     * Animated meshes use a printf-style pattern with an integer
+     * placeholder as their filename (e.g. <tt>"anim/frame_%04i.obj"</tt>),
+     * which is expanded with the frame number.
+     */
+    void load(int frame) {
+        std::string name = m_filename;
+        if (isAnimated())
+            name = tfm::format(m_filename.c_str(), frame);
+        filesystem::path filename = getFileResolver()->resolve(name);
 
-        std::ifstream is(filename.str());
-        if (is.fail())
+        MappedFile file(filename.str());
+        if (!file.isValid())
             throw NoriException("Unable to open OBJ file \"%s\"!", filename);
-        Transform trafo = propList.getTransform("toWorld", Transform());
 
-        cout << "Loading \"" << filename << "\" .. ";
-        cout.flush();
         Timer timer;
 
+        /* Split the file into chunks that end at line breaks and parse them in parallel */
+        std::vector<OBJChunk> chunks;
+        const char *data = file.data(), *fileEnd = data + file.size();
+        for (const char *start = data; start < fileEnd; ) {
+            const char *end = start + std::min((size_t) (fileEnd - start), CHUNK_SIZE);
+            const char *eol = (const char *) memchr(end, '\n', fileEnd - end);
+            end = eol ? eol + 1 : fileEnd;
+            chunks.emplace_back();
+            chunks.back().begin = start;
+            chunks.back().end = end;
+            start = end;
+        }
+
+        tbb::parallel_for(size_t(0), chunks.size(), [&](size_t i) {
+            OBJChunk &chunk = chunks[i];
+            OBJParser parser(data, chunk.begin, chunk.end, filename.str());
+            parse(parser, m_toWorld, chunk);
+        });
+
+        /* Stitch the chunks together. Face vertices refer to attributes by
+           their index in the whole file, so they don't need to be adjusted */
         std::vector<Vector3f>   positions;
         std::vector<Vector2f>   texcoords;
         std::vector<Vector3f>   normals;
-        std::vector<uint32_t>   indices;
         std::vector<OBJVertex>  vertices;
-        VertexMap vertexMap;
+        concat(chunks, &OBJChunk::positions, positions);
+        concat(chunks, &OBJChunk::texcoords, texcoords);
+        concat(chunks, &OBJChunk::normals, normals);
+        concat(chunks, &OBJChunk::vertices, vertices);
 
-        std::string line_str;
-        while (std::getline(is, line_str)) {
-            std::istringstream line(line_str);
+        m_bbox.reset();
+        uint64_t usedPositions = 0, usedTexcoords = 0, usedNormals = 0;
+        for (const OBJChunk &chunk : chunks) {
+            m_bbox.expandBy(chunk.bbox);
+            usedPositions = std::max(usedPositions, chunk.usedPositions);
+            usedTexcoords = std::max(usedTexcoords, chunk.usedTexcoords);
+            usedNormals = std::max(usedNormals, chunk.usedNormals);
+        }
+        chunks.clear();
 
-            std::string prefix;
-            line >> prefix;
+        /* Texture coordinates and normals are ignored if the file has none */
+        checkIndices(vertices, &OBJVertex::p, usedPositions, positions, "position", filename);
+        if (!normals.empty())
+            checkIndices(vertices, &OBJVertex::n, usedNormals, normals, "normal", filename);
+        if (!texcoords.empty())
+            checkIndices(vertices, &OBJVertex::uv, usedTexcoords, texcoords, "texture coordinate", filename);
 
-            if (prefix == "v") {
-                Point3f p;
-                line >> p.x() >> p.y() >> p.z();
-                p = trafo * p;
-                m_bbox.expandBy(p);
-                positions.push_back(p);
-            } else if (prefix == "vt") {
-                Point2f tc;
-                line >> tc.x() >> tc.y();
-                texcoords.push_back(tc);
-            } else if (prefix == "vn") {
-                Normal3f n;
-                line >> n.x() >> n.y() >> n.z();
-                normals.push_back((trafo * n).normalized());
-            } else if (prefix == "f") {
-                std::string v1, v2, v3, v4;
-                line >> v1 >> v2 >> v3 >> v4;
-                OBJVertex verts[6];
-                int nVertices = 3;
+        /* Deduplicate the face vertices. They are sorted into buckets by
+           their position index, and every bucket is scanned in file order,
+           so that each vertex is represented by its first occurrence */
+        size_t nPositions = positions.size(), nFaceVertices = vertices.size();
+        std::vector<std::atomic<uint32_t>> cursor(nPositions);
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, nFaceVertices, BLOCK_SIZE),
+            [&](const tbb::blocked_range<size_t> &range) {
+                for (size_t i = range.begin(); i != range.end(); ++i)
+                    cursor[vertices[i].p].fetch_add(1, std::memory_order_relaxed);
+            }
+        );
 
-                verts[0] = OBJVertex(v1);
-                verts[1] = OBJVertex(v2);
-                verts[2] = OBJVertex(v3);
+        std::vector<uint32_t> bucketStart(nPositions + 1, 0);
+        for (size_t i = 0; i < nPositions; ++i) {
+            bucketStart[i + 1] = bucketStart[i] + cursor[i].load(std::memory_order_relaxed);
+            cursor[i].store(bucketStart[i], std::memory_order_relaxed);
+        }
 
-                if (!v4.empty()) {
-                    /* This is a quad, split into two triangles */
-                    verts[3] = OBJVertex(v4);
-                    verts[4] = verts[0];
-                    verts[5] = verts[2];
-                    nVertices = 6;
-                }
-                /* Convert to an indexed vertex list */
-                for (int i=0; i<nVertices; ++i) {
-                    const OBJVertex &v = verts[i];
-                    VertexMap::const_iterator it = vertexMap.find(v);
-                    if (it == vertexMap.end()) {
-                        vertexMap[v] = (uint32_t) vertices.size();
-                        indices.push_back((uint32_t) vertices.size());
-                        vertices.push_back(v);
-                    } else {
-                        indices.push_back(it->second);
+        std::vector<uint32_t> bucket(nFaceVertices);
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, nFaceVertices, BLOCK_SIZE),
+            [&](const tbb::blocked_range<size_t> &range) {
+                for (size_t i = range.begin(); i != range.end(); ++i)
+                    bucket[cursor[vertices[i].p].fetch_add(1, std::memory_order_relaxed)] = (uint32_t) i;
+            }
+        );
+        std::vector<std::atomic<uint32_t>>().swap(cursor);
+
+        std::vector<uint32_t> first(nFaceVertices);
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, nPositions, BLOCK_SIZE / 8),
+            [&](const tbb::blocked_range<size_t> &range) {
+                for (size_t p = range.begin(); p != range.end(); ++p) {
+                    uint32_t *begin = bucket.data() + bucketStart[p],
+                             *end = bucket.data() + bucketStart[p + 1];
+                    std::sort(begin, end);
+
+                    /* The distinct vertices found so far are moved to the front */
+                    uint32_t *distinctEnd = begin;
+                    for (uint32_t *it = begin; it != end; ++it) {
+                        uint32_t *match = begin;
+                        while (match != distinctEnd && !(vertices[*match] == vertices[*it]))
+                            ++match;
+                        if (match == distinctEnd)
+                            *distinctEnd++ = *it;
+                        first[*it] = *match;
                     }
                 }
             }
-        }
+        );
+        std::vector<uint32_t>().swap(bucketStart);
 
-        m_F.resize(3, indices.size()/3);
-        memcpy(m_F.data(), indices.data(), sizeof(uint32_t)*indices.size());
+        /* Number the distinct vertices in file order with a prefix sum over blocks */
+        size_t nBlocks = (nFaceVertices + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        std::vector<uint32_t> blockStart(nBlocks + 1, 0);
+        tbb::parallel_for(size_t(0), nBlocks, [&](size_t block) {
+            uint32_t count = 0;
+            for (size_t i = block * BLOCK_SIZE; i < std::min(nFaceVertices, (block + 1) * BLOCK_SIZE); ++i)
+                count += first[i] == i;
+            blockStart[block + 1] = count;
+        });
+        for (size_t block = 0; block < nBlocks; ++block)
+            blockStart[block + 1] += blockStart[block];
 
-        m_V.resize(3, vertices.size());
-        for (uint32_t i=0; i<vertices.size(); ++i)
-            m_V.col(i) = positions.at(vertices[i].p-1);
+        /* The buckets are no longer needed, reuse them for the vertex numbers */
+        std::vector<uint32_t> &vertexIndex = bucket;
+        tbb::parallel_for(size_t(0), nBlocks, [&](size_t block) {
+            uint32_t index = blockStart[block];
+            for (size_t i = block * BLOCK_SIZE; i < std::min(nFaceVertices, (block + 1) * BLOCK_SIZE); ++i) {
+                if (first[i] == i)
+                    vertexIndex[i] = index++;
+            }
+        });
 
-        if (!normals.empty()) {
-            m_N.resize(3, vertices.size());
-            for (uint32_t i=0; i<vertices.size(); ++i)
-                m_N.col(i) = normals.at(vertices[i].n-1);
-        }
+        uint32_t nVertices = blockStart[nBlocks];
+        m_F.resize(3, nFaceVertices / 3);
+        m_V.resize(3, nVertices);
+        m_N.resize(3, normals.empty() ? 0 : nVertices);
+        m_UV.resize(2, texcoords.empty() ? 0 : nVertices);
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, nFaceVertices, BLOCK_SIZE),
+            [&](const tbb::blocked_range<size_t> &range) {
+                for (size_t i = range.begin(); i != range.end(); ++i) {
+                    uint32_t index = vertexIndex[first[i]];
+                    m_F.data()[i] = index;
+                    if (first[i] != i)
+                        continue;
+                    const OBJVertex &v = vertices[i];
+                    m_V.col(index) = positions[v.p];
+                    if (m_N.size() > 0)
+                        m_N.col(index) = normals[v.n];
+                    if (m_UV.size() > 0)
+                        m_UV.col(index) = texcoords[v.uv];
+                }
+            }
+        );
 
-        if (!texcoords.empty()) {
-            m_UV.resize(2, vertices.size());
-            for (uint32_t i=0; i<vertices.size(); ++i)
-                m_UV.col(i) = texcoords.at(vertices[i].uv-1);
-        }
+        mapArrays();
 
         m_name = filename.str();
-        cout << "done. (V=" << m_V.cols() << ", F=" << m_F.cols() << ", took "
-             << timer.elapsedString() << " and "
-             << memString(m_F.size() * sizeof(uint32_t) +
-                          sizeof(float) * (m_V.size() + m_N.size() + m_UV.size()))
-             << ")" << endl;
+        /* A single write, since the parser loads meshes concurrently */
+        cout << tfm::format("Loading \"%s\" .. done. (V=%i, F=%i, took %s and %s)\n",
+            filename, m_V.cols(), m_F.cols(), timer.elapsedString(),
+            memString(m_F.size() * sizeof(uint32_t) +
+                      sizeof(float) * (m_V.size() + m_N.size() + m_UV.size())));
     }
 
-protected:
-    /// Vertex indices used by the OBJ format
-    struct OBJVertex {
-        uint32_t p = (uint32_t) -1;
-        uint32_t n = (uint32_t) -1;
-        uint32_t uv = (uint32_t) -1;
+    /// Return the attribute with the given (zero-based) index, throw if there is none
+    template <typename T> static const T &lookup(const std::vector<T> &values, uint32_t index,
+            const char *kind, const filesystem::path &filename) {
+        if (index >= values.size())
+            throw NoriException("OBJ file \"%s\": a face refers to %s %i, but there are only %i!",
+                filename, kind, (int64_t) index + 1, values.size());
+        return values[index];
+    }
 
-        inline OBJVertex() { }
+    bool isAnimated() const { return m_filename.find('%') != std::string::npos; }
 
-        inline OBJVertex(const std::string &string) {
-            std::vector<std::string> tokens = tokenize(string, "/", true);
+    bool loadFrame(int frame) {
+        if (!isAnimated() || frame == m_frame)
+            return false;
 
-            if (tokens.size() < 1 || tokens.size() > 3)
-                throw NoriException("Invalid vertex data: \"%s\"", string);
+        MatrixXu F = m_F;
+        load(frame);
+        if (m_F.cols() != F.cols() || m_F != F)
+            throw NoriException("OBJ file \"%s\": the faces of frame %i differ from the previous frame!",
+                m_filename, frame);
+        m_frame = frame;
+        return true;
+    }
 
-            p = toUInt(tokens[0]);
+    static constexpr uint32_t INVALID_INDEX = (uint32_t) -1;
 
-            if (tokens.size() >= 2 && !tokens[1].empty())
-                uv = toUInt(tokens[1]);
+    /// Size of the chunks that are parsed in parallel (rounded up to the next line break)
+    static constexpr size_t CHUNK_SIZE = 1 << 20;
 
-            if (tokens.size() >= 3 && !tokens[2].empty())
-                n = toUInt(tokens[2]);
-        }
+    /// Number of face vertices that are processed together when deduplicating
+    static constexpr size_t BLOCK_SIZE = 65536;
+
+    /// Vertex indices used by the OBJ format (zero-based)
+    struct OBJVertex {
+        uint32_t p = INVALID_INDEX;
+        uint32_t n = INVALID_INDEX;
+        uint32_t uv = INVALID_INDEX;
 
         inline bool operator==(const OBJVertex &v) const {
             return v.p == p && v.n == n && v.uv == uv;
         }
     };
 
-    /// Hash function for OBJVertex
-    struct OBJVertexHash {
-        std::size_t operator()(const OBJVertex &v) const {
-            size_t hash = std::hash<uint32_t>()(v.p);
-            hash = hash * 37 + std::hash<uint32_t>()(v.uv);
-            hash = hash * 37 + std::hash<uint32_t>()(v.n);
-            return hash;
+    /**
+     * \brief Tokenizer working directly on the (memory mapped) file contents
+     *
+     * Numbers are parsed in place, without copying lines or tokens into
+     * strings. A parser reads the lines in <tt>[begin, end)</tt>, which
+     * must start at a line of the file; errors report the line number
+     * within the whole file.
+     */
+    class OBJParser {
+    public:
+        OBJParser(const char *data, const char *begin, const char *end, const std::string &filename)
+            : m_data(data), m_cur(begin), m_end(end), m_filename(filename) { }
+
+        static bool isSpace(char c) {
+            return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
         }
+
+        /// Move to the first token of the next line that is not empty, return \c false at the end
+        bool nextLine() {
+            if (m_started) {
+                const char *eol = (const char *) memchr(m_cur, '\n', m_end - m_cur);
+                m_cur = eol ? eol + 1 : m_end;
+            }
+            m_started = true;
+            while (m_cur < m_end) {
+                while (m_cur < m_end && isSpace(*m_cur))
+                    m_cur++;
+                if (m_cur < m_end && *m_cur != '\n')
+                    return true;
+                if (m_cur < m_end)
+                    m_cur++;
+            }
+            return false;
+        }
+
+        /// Return the character \c offset positions ahead ('\n' past the end)
+        char peek(size_t offset) const {
+            return offset < (size_t) (m_end - m_cur) ? m_cur[offset] : '\n';
+        }
+
+        void skip(size_t count) { m_cur += count; }
+
+        /// Is there another token on the current line?
+        bool hasToken() {
+            skipSpaces();
+            return m_cur < m_end && *m_cur != '\n';
+        }
+
+        float parseFloat() {
+            skipSpaces();
+            const char *start = m_cur;
+            /* Unlike stream extraction, from_chars() does not accept a leading '+' */
+            if (m_cur < m_end && *m_cur == '+')
+                m_cur++;
+            float value;
+#if defined(__cpp_lib_to_chars)
+            std::from_chars_result result = std::from_chars(m_cur, m_end, value);
+            if (result.ec != std::errc() || (result.ptr < m_end && !isSpace(*result.ptr) && *result.ptr != '\n'))
+                error("invalid number", start);
+            m_cur = result.ptr;
+#else
+            /* strtof() needs a terminated string */
+            char buffer[64];
+            size_t length = 0;
+            while (m_cur + length < m_end && length + 1 < sizeof(buffer) &&
+                   !isSpace(m_cur[length]) && m_cur[length] != '\n')
+                buffer[length] = m_cur[length], length++;
+            buffer[length] = '\0';
+            char *end_ptr = nullptr;
+            value = std::strtof(buffer, &end_ptr);
+            if (length == 0 || *end_ptr != '\0')
+                error("invalid number", start);
+            m_cur += length;
+#endif
+            return value;
+        }
+
+        /// Parse a face vertex "p", "p/uv", "p//n" or "p/uv/n"
+        OBJVertex parseVertex() {
+            skipSpaces();
+            const char *start = m_cur;
+            OBJVertex v;
+            v.p = parseIndex(start);
+            if (m_cur < m_end && *m_cur == '/') {
+                m_cur++;
+                if (m_cur < m_end && *m_cur != '/')
+                    v.uv = parseIndex(start);
+                if (m_cur < m_end && *m_cur == '/') {
+                    m_cur++;
+                    v.n = parseIndex(start);
+                }
+            }
+            if (m_cur < m_end && !isSpace(*m_cur) && *m_cur != '\n')
+                error("invalid vertex data", start);
+            return v;
+        }
+
+    private:
+        void skipSpaces() {
+            while (m_cur < m_end && isSpace(*m_cur))
+                m_cur++;
+        }
+
+        /// Parse a one-based index, return it zero-based
+        uint32_t parseIndex(const char *token) {
+            uint64_t value = 0;
+            const char *start = m_cur;
+            while (m_cur < m_end && *m_cur >= '0' && *m_cur <= '9' && value <= INVALID_INDEX)
+                value = value * 10 + (uint64_t) (*m_cur++ - '0');
+            if (m_cur == start || value == 0 || value > INVALID_INDEX)
+                error("invalid vertex data", token);
+            return (uint32_t) (value - 1);
+        }
+
+        [[noreturn]] void error(const char *what, const char *token) const {
+            const char *end = token;
+            while (end < m_end && !isSpace(*end) && *end != '\n')
+                end++;
+            /* Only count the lines when they are needed */
+            size_t line = std::count(m_data, token, '\n') + 1;
+            throw NoriException("OBJ file \"%s\", line %i: %s \"%s\"!", m_filename, line, what,
+                std::string(token, end));
+        }
+
+        const char *m_data;
+        const char *m_cur;
+        const char *m_end;
+        std::string m_filename;
+        bool m_started = false;
+    };
+
+    /// Attributes and face vertices parsed from a part of the file
+    struct OBJChunk {
+        const char *begin = nullptr;
+        const char *end = nullptr;
+        std::vector<Vector3f>  positions;
+        std::vector<Vector2f>  texcoords;
+        std::vector<Vector3f>  normals;
+        std::vector<OBJVertex> vertices;   ///< Three per triangle
+        BoundingBox3f bbox;
+        /// One more than the largest index referenced by a face vertex
+        uint64_t usedPositions = 0, usedTexcoords = 0, usedNormals = 0;
     };
+
+    /// Parse the lines of a chunk
+    static void parse(OBJParser &parser, const Transform &trafo, OBJChunk &chunk) {
+        while (parser.nextLine()) {
+            char c0 = parser.peek(0), c1 = parser.peek(1);
+
+            if (c0 == 'v' && OBJParser::isSpace(c1)) {
+                parser.skip(1);
+                Point3f p;
+                p.x() = parser.parseFloat();
+                p.y() = parser.parseFloat();
+                p.z() = parser.parseFloat();
+                p = trafo * p;
+                chunk.bbox.expandBy(p);
+                chunk.positions.push_back(p);
+            } else if (c0 == 'v' && c1 == 't' && OBJParser::isSpace(parser.peek(2))) {
+                parser.skip(2);
+                Point2f tc;
+                tc.x() = parser.parseFloat();
+                tc.y() = parser.parseFloat();
+                chunk.texcoords.push_back(tc);
+            } else if (c0 == 'v' && c1 == 'n' && OBJParser::isSpace(parser.peek(2))) {
+                parser.skip(2);
+                Normal3f n;
+                n.x() = parser.parseFloat();
+                n.y() = parser.parseFloat();
+                n.z() = parser.parseFloat();
+                chunk.normals.push_back((trafo * n).normalized());
+            } else if (c0 == 'f' && OBJParser::isSpace(c1)) {
+                parser.skip(1);
+                OBJVertex verts[6];
+                int nVertices = 3;
+
+                verts[0] = parser.parseVertex();
+                verts[1] = parser.parseVertex();
+                verts[2] = parser.parseVertex();
+
+                /* Vertices beyond the fourth are ignored */
+                if (parser.hasToken()) {
+                    /* This is a quad, split into two triangles */
+                    verts[3] = parser.parseVertex();
+                    verts[4] = verts[0];
+                    verts[5] = verts[2];
+                    nVertices = 6;
+                }
+
+                /* Missing indices are INVALID_INDEX and count as out of range */
+                for (int i=0; i<nVertices; ++i) {
+                    const OBJVertex &v = verts[i];
+                    chunk.usedPositions = std::max(chunk.usedPositions, (uint64_t) v.p + 1);
+                    chunk.usedTexcoords = std::max(chunk.usedTexcoords, (uint64_t) v.uv + 1);
+                    chunk.usedNormals = std::max(chunk.usedNormals, (uint64_t) v.n + 1);
+                    chunk.vertices.push_back(v);
+                }
+            }
+        }
+    }
+
+    /// Move the attributes of all chunks into one array, in file order
+    template <typename T> static void concat(std::vector<OBJChunk> &chunks,
+            std::vector<T> OBJChunk::*member, std::vector<T> &result) {
+        if (chunks.size() == 1) {
+            result.swap(chunks[0].*member);
+            return;
+        }
+        std::vector<size_t> offset(chunks.size() + 1, 0);
+        for (size_t i = 0; i < chunks.size(); ++i)
+            offset[i + 1] = offset[i] + (chunks[i].*member).size();
+
+        result.resize(offset.back());
+        tbb::parallel_for(size_t(0), chunks.size(), [&](size_t i) {
+            std::vector<T> &values = chunks[i].*member;
+            std::copy(values.begin(), values.end(), result.begin() + offset[i]);
+            std::vector<T>().swap(values);
+        });
+    }
+
+    /// Throw for the first face vertex whose attribute index is out of range
+    template <typename T> static void checkIndices(const std::vector<OBJVertex> &vertices,
+            uint32_t OBJVertex::*index, uint64_t used, const std::vector<T> &values,
+            const char *kind, const filesystem::path &filename) {
+        if (used <= values.size())
+            return;
+        for (const OBJVertex &v : vertices)
+            lookup(values, v.*index, kind, filename);
+    }
+
+    std::string m_filename; ///< Filename (or pattern for animated meshes)
+    Transform m_toWorld;    ///< Transformation applied to every frame
+    int m_frame;            ///< Frame that is currently loaded
 };
 
 NORI_REGISTER_CLASS(WavefrontOBJ, "obj");
@@ -8,7 +8,10 @@
 #include <nori/proplist.h>
 #include <Eigen/Geometry>
 #include <pugixml.hpp>
+#include <tbb/task_group.h>
 #include <fstream>
+#include <deque>
+#include <exception>
 #include <set>
 
 NORI_NAMESPACE_BEGIN
@@ -55,6 +58,8 @@ NoriObject *loadFromXML(const std::string &filename) {
         ESampler              = NoriObject::ESampler,
         ETest                 = NoriObject::ETest,
         EReconstructionFilter = NoriObject::EReconstructionFilter,
+        EAccel                = NoriObject::EAccel,
+        EInstance             = NoriObject::EInstance,
 
         /* Properties */
         EBoolean = NoriObject::EClassTypeCount,
@@ -87,6 +92,8 @@ NoriObject *loadFromXML(const std::string &filename) {
     tags["sampler"]    = ESampler;
     tags["rfilter"]    = EReconstructionFilter;
     tags["test"]       = ETest;
+    tags["accel"]      = EAccel;
+    tags["instance"]   = EInstance;
     tags["boolean"]    = EBoolean;
     tags["integer"]    = EInteger;
     tags["float"]      = EFloat;
@@ -117,12 +124,77 @@ NoriObject *loadFromXML(const std::string &filename) {
 
     Eigen::Affine3f transform;
 
+    /* Meshes are constructed (which loads their files) by tasks while the
+       parser continues. Their parent waits for the tasks and then adds
+       its children in the order of the file. The tasks refer to local
+       variables, so they are always waited for before returning. */
+    struct PendingMesh {
+        NoriObject *result = nullptr;
+        std::exception_ptr error;
+        ptrdiff_t offset;
+    };
+    std::deque<PendingMesh> pendingMeshes;
+    tbb::task_group meshTasks;
+    struct TaskGuard {
+        tbb::task_group &tasks;
+        ~TaskGuard() {
+            try {
+                tasks.wait();
+            } catch (...) { }
+        }
+    } taskGuard { meshTasks };
+
+    /* A parsed child: either an object or a mesh that is being constructed */
+    struct Child {
+        NoriObject *object = nullptr;
+        PendingMesh *pending = nullptr;
+    };
+
+    /* Helper function: wait for a mesh task, report its error with the XML position of the mesh */
+    auto finishMesh = [&](PendingMesh &pending) -> NoriObject * {
+        meshTasks.wait();
+        if (pending.error) {
+            try {
+                std::rethrow_exception(pending.error);
+            } catch (const NoriException &e) {
+                throw NoriException("Error while parsing \"%s\": %s (at %s)", filename,
+                                    e.what(), offset(pending.offset));
+            }
+        }
+        return pending.result;
+    };
+
+    /* Helper function to instantiate an object, add its children and activate it */
+    auto createObject = [](const std::string &type, const PropertyList &propList, int tag,
+                           const std::vector<NoriObject *> &children) -> NoriObject * {
+        NoriObject *result = NoriObjectFactory::createInstance(type, propList);
+
+        if (result->getClassType() != tag) {
+            throw NoriException(
+                "Unexpectedly constructed an object "
+                "of type <%s> (expected type <%s>): %s",
+                NoriObject::classTypeName(result->getClassType()),
+                NoriObject::classTypeName((NoriObject::EClassType) tag),
+                result->toString());
+        }
+
+        /* Add all children */
+        for (auto ch: children) {
+            result->addChild(ch);
+            ch->setParent(result);
+        }
+
+        /* Activate / configure the object */
+        result->activate();
+        return result;
+    };
+
     /* Helper function to parse a Nori XML node (recursive) */
-    std::function<NoriObject *(pugi::xml_node &, PropertyList &, int)> parseTag = [&](
-        pugi::xml_node &node, PropertyList &list, int parentTag) -> NoriObject * {
+    std::function<Child(pugi::xml_node &, PropertyList &, int)> parseTag = [&](
+        pugi::xml_node &node, PropertyList &list, int parentTag) -> Child {
         /* Skip over comments */
         if (node.type() == pugi::node_comment || node.type() == pugi::node_declaration)
-            return nullptr;
+            return Child();
 
         if (node.type() != pugi::node_element)
             throw NoriException(
@@ -158,45 +230,47 @@ NoriObject *loadFromXML(const std::string &filename) {
 
         if (tag == EScene)
             node.append_attribute("type") = "scene";
+        else if (tag == EInstance && !node.attribute("type"))
+            node.append_attribute("type") = "instance";
         else if (tag == ETransform)
             transform.setIdentity();
 
         PropertyList propList;
-        std::vector<NoriObject *> children;
+        std::vector<Child> parsedChildren;
         for (pugi::xml_node &ch: node.children()) {
-            NoriObject *child = parseTag(ch, propList, tag);
-            if (child)
-                children.push_back(child);
+            Child child = parseTag(ch, propList, tag);
+            if (child.object || child.pending)
+                parsedChildren.push_back(child);
         }
 
-        NoriObject *result = nullptr;
+        /* Wait for the meshes among the children; the first error in the file is reported */
+        std::vector<NoriObject *> children;
+        for (const Child &child : parsedChildren)
+            children.push_back(child.pending ? finishMesh(*child.pending) : child.object);
+
+        Child result;
         try {
             if (currentIsObject) {
                 check_attributes(node, { "type" });
-
-                /* This is an object, first instantiate it */
-                result = NoriObjectFactory::createInstance(
-                    node.attribute("type").value(),
-                    propList
-                );
-
-                if (result->getClassType() != (int) tag) {
-                    throw NoriException(
-                        "Unexpectedly constructed an object "
-                        "of type <%s> (expected type <%s>): %s",
-                        NoriObject::classTypeName(result->getClassType()),
-                        NoriObject::classTypeName((NoriObject::EClassType) tag),
-                        result->toString());
-                }
-
-                /* Add all children */
-                for (auto ch: children) {
-                    result->addChild(ch);
-                    ch->setParent(result);
+                std::string type = node.attribute("type").value();
+
+                if (tag == EMesh) {
+                    /* Load the mesh in a task, the parser continues */
+                    pendingMeshes.emplace_back();
+                    PendingMesh *pending = &pendingMeshes.back();
+                    pending->offset = node.offset_debug();
+                    meshTasks.run([=] {
+                        try {
+                            pending->result = createObject(type, propList, tag, children);
+                        } catch (...) {
+                            pending->error = std::current_exception();
+                        }
+                    });
+                    result.pending = pending;
+                } else {
+                    /* This is an object, first instantiate it */
+                    result.object = createObject(type, propList, tag, children);
                 }
-
-                /* Activate / configure the object */
-                result->activate();
             } else {
                 /* This is a property */
                 switch (tag) {
@@ -301,7 +375,8 @@ NoriObject *loadFromXML(const std::string &filename) {
     };
 
     PropertyList list;
-    return parseTag(*doc.begin(), list, EInvalid);
+    Child root = parseTag(*doc.begin(), list, EInvalid);
+    return root.pending ? finishMesh(*root.pending) : root.object;
 }
 
 NORI_NAMESPACE_END
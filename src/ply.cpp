@@ -0,0 +1,401 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+*/
+
+#include <nori/mesh.h>
+#include <nori/timer.h>
+#include <nori/mappedfile.h>
+#include <filesystem/resolver.h>
+#include <algorithm>
+#include <charconv>
+#include <cctype>
+#include <cstring>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Loader for Stanford PLY triangle meshes
+ *
+ * Reads ASCII and binary (little- or big-endian) files. The \c vertex
+ * element provides the positions and optionally normals (\c nx, \c ny,
+ * \c nz) and texture coordinates (\c u/\c v, \c s/\c t or
+ * \c texture_u/\c texture_v); the \c face element provides a list of
+ * vertex indices per polygon, which is split into a fan of triangles.
+ * Other elements and properties are skipped. The data is written
+ * straight into the mesh matrices as it is read.
+ */
+class PLYMesh : public Mesh {
+public:
+    PLYMesh(const PropertyList &propList) {
+        filesystem::path filename =
+            getFileResolver()->resolve(propList.getString("filename"));
+        Transform trafo = propList.getTransform("toWorld", Transform());
+        m_name = filename.str();
+
+        MappedFile file(filename.str());
+        if (!file.isValid())
+            throw NoriException("Unable to open PLY file \"%s\"!", filename);
+
+        Timer timer;
+
+        PLYReader reader(file.data(), file.data() + file.size(), filename.str());
+        std::vector<Element> elements = reader.parseHeader();
+
+        const Element *vertexElement = nullptr;
+        for (const Element &element : elements) {
+            if (element.name == "vertex")
+                vertexElement = &element;
+        }
+        if (!vertexElement)
+            throw NoriException("PLY file \"%s\" has no vertex element!", filename);
+        uint32_t nVertices = vertexElement->count;
+
+        m_bbox.reset();
+        m_N.resize(3, 0);
+        m_UV.resize(2, 0);
+        m_F.resize(3, 0);
+        uint32_t nTriangles = 0;
+
+        for (const Element &element : elements) {
+            if (&element == vertexElement)
+                readVertices(reader, element, trafo);
+            else if (element.name == "face")
+                nTriangles = readFaces(reader, element, nVertices);
+            else
+                reader.skip(element);
+        }
+
+        m_F.conservativeResize(3, nTriangles);
+        mapArrays();
+
+        /* A single write, since the parser loads meshes concurrently */
+        cout << tfm::format("Loading \"%s\" .. done. (V=%i, F=%i, took %s and %s)\n",
+            filename, m_V.cols(), m_F.cols(), timer.elapsedString(),
+            memString(m_F.size() * sizeof(uint32_t) +
+                      sizeof(float) * (m_V.size() + m_N.size() + m_UV.size())));
+    }
+
+protected:
+    enum EType { EInt8, EUInt8, EInt16, EUInt16, EInt32, EUInt32, EFloat32, EFloat64, EInvalid };
+
+    enum EFormat { EASCII, EBinaryLittleEndian, EBinaryBigEndian };
+
+    struct Property {
+        std::string name;
+        EType type;                  ///< Type of the value (of the entries for lists)
+        EType countType = EInvalid;  ///< Type of the entry count, \c EInvalid if this isn't a list
+    };
+
+    struct Element {
+        std::string name;
+        uint32_t count;
+        std::vector<Property> properties;
+    };
+
+    /// Vertex attributes that are stored in the mesh
+    enum EAttribute { EX, EY, EZ, ENX, ENY, ENZ, EU, EV, EAttributeCount };
+
+    /**
+     * \brief Reads the header and the values of a PLY file in place
+     *
+     * Errors in ASCII files report the line number.
+     */
+    class PLYReader {
+    public:
+        PLYReader(const char *begin, const char *end, const std::string &filename)
+            : m_data(begin), m_cur(begin), m_end(end), m_filename(filename) { }
+
+        /// Parse the header and move to the first data value
+        std::vector<Element> parseHeader() {
+            std::vector<Element> elements;
+            bool hasFormat = false;
+            for (size_t line = 0; ; ++line) {
+                if (m_cur == m_end)
+                    throw NoriException("PLY file \"%s\": the header is incomplete!", m_filename);
+                const char *eol = (const char *) memchr(m_cur, '\n', m_end - m_cur);
+                const char *lineEnd = eol ? eol : m_end;
+                while (lineEnd > m_cur && std::isspace((unsigned char) lineEnd[-1]))
+                    lineEnd--;
+                std::string text(m_cur, lineEnd);
+                std::vector<std::string> tokens = tokenize(text, " \t\r");
+                m_cur = eol ? eol + 1 : m_end;
+
+                if (line == 0) {
+                    if (tokens.size() != 1 || tokens[0] != "ply")
+                        throw NoriException("\"%s\" is not a PLY file!", m_filename);
+                } else if (tokens.empty() || tokens[0] == "comment" || tokens[0] == "obj_info") {
+                    continue;
+                } else if (tokens[0] == "format" && tokens.size() == 3) {
+                    if (tokens[1] == "ascii")
+                        m_format = EASCII;
+                    else if (tokens[1] == "binary_little_endian")
+                        m_format = EBinaryLittleEndian;
+                    else if (tokens[1] == "binary_big_endian")
+                        m_format = EBinaryBigEndian;
+                    else
+                        throw NoriException("PLY file \"%s\": unknown format \"%s\"!", m_filename, tokens[1]);
+                    hasFormat = true;
+                } else if (tokens[0] == "element" && tokens.size() == 3) {
+                    Element element;
+                    element.name = tokens[1];
+                    element.count = toUInt(tokens[2]);
+                    elements.push_back(element);
+                } else if (tokens[0] == "property" && !elements.empty() &&
+                           (tokens.size() == 3 || (tokens.size() == 5 && tokens[1] == "list"))) {
+                    Property property;
+                    property.name = tokens.back();
+                    property.type = parseType(tokens[tokens.size() - 2]);
+                    if (tokens.size() == 5)
+                        property.countType = parseType(tokens[2]);
+                    elements.back().properties.push_back(property);
+                } else if (tokens[0] == "end_header") {
+                    break;
+                } else {
+                    throw NoriException("PLY file \"%s\", line %i: invalid header line \"%s\"!",
+                        m_filename, line + 1, text);
+                }
+            }
+            if (!hasFormat)
+                throw NoriException("PLY file \"%s\": the header does not specify the format!", m_filename);
+
+            /* Little-endian machines read little-endian files as they are */
+            uint32_t one = 1;
+            char firstByte;
+            memcpy(&firstByte, &one, 1);
+            m_swap = m_format == (firstByte == 1 ? EBinaryBigEndian : EBinaryLittleEndian);
+            return elements;
+        }
+
+        /// Read a value of the given type
+        template <typename T> T read(EType type) {
+            if (m_format == EASCII)
+                return readASCII<T>(type);
+            switch (type) {
+                case EInt8:    return (T) readBinary<int8_t>();
+                case EUInt8:   return (T) readBinary<uint8_t>();
+                case EInt16:   return (T) readBinary<int16_t>();
+                case EUInt16:  return (T) readBinary<uint16_t>();
+                case EInt32:   return (T) readBinary<int32_t>();
+                case EUInt32:  return (T) readBinary<uint32_t>();
+                case EFloat32: return (T) readBinary<float>();
+                default:       return (T) readBinary<double>();
+            }
+        }
+
+        /// Read the number of entries of a list property and check it
+        uint32_t readCount(EType type) {
+            int64_t count = read<int64_t>(type);
+            if (count < 0 || count > UINT32_MAX)
+                error("invalid list size");
+            return (uint32_t) count;
+        }
+
+        /// Skip over a property value
+        void skip(const Property &property) {
+            if (property.countType == EInvalid) {
+                read<double>(property.type);
+                return;
+            }
+            uint32_t count = readCount(property.countType);
+            for (uint32_t i = 0; i < count; ++i)
+                read<double>(property.type);
+        }
+
+        /// Skip over all values of an element
+        void skip(const Element &element) {
+            for (uint32_t i = 0; i < element.count; ++i) {
+                for (const Property &property : element.properties)
+                    skip(property);
+            }
+        }
+
+        [[noreturn]] void error(const char *what) const {
+            if (m_format != EASCII)
+                throw NoriException("PLY file \"%s\", byte %i: %s!", m_filename, (size_t) (m_cur - m_data), what);
+            size_t line = std::count(m_data, m_cur, '\n') + 1;
+            throw NoriException("PLY file \"%s\", line %i: %s!", m_filename, line, what);
+        }
+
+    private:
+        EType parseType(const std::string &name) const {
+            static const char *names[][2] = {
+                { "char", "int8" }, { "uchar", "uint8" }, { "short", "int16" },
+                { "ushort", "uint16" }, { "int", "int32" }, { "uint", "uint32" },
+                { "float", "float32" }, { "double", "float64" }
+            };
+            for (int i = 0; i < EInvalid; ++i) {
+                if (name == names[i][0] || name == names[i][1])
+                    return (EType) i;
+            }
+            throw NoriException("PLY file \"%s\": unknown property type \"%s\"!", m_filename, name);
+        }
+
+        template <typename S> S readBinary() {
+            if ((size_t) (m_end - m_cur) < sizeof(S))
+                error("unexpected end of file");
+            char bytes[sizeof(S)];
+            memcpy(bytes, m_cur, sizeof(S));
+            if (m_swap)
+                std::reverse(bytes, bytes + sizeof(S));
+            m_cur += sizeof(S);
+            S value;
+            memcpy(&value, bytes, sizeof(S));
+            return value;
+        }
+
+        template <typename T> T readASCII(EType type) {
+            while (m_cur < m_end && std::isspace((unsigned char) *m_cur))
+                m_cur++;
+            if (m_cur == m_end)
+                error("unexpected end of file");
+            const char *start = m_cur;
+            if (type == EFloat32 || type == EFloat64) {
+                double value;
+#if defined(__cpp_lib_to_chars)
+                std::from_chars_result result = std::from_chars(m_cur, m_end, value);
+                if (result.ec != std::errc())
+                    error("invalid number");
+                m_cur = result.ptr;
+#else
+                char buffer[64];
+                size_t length = 0;
+                while (m_cur + length < m_end && length + 1 < sizeof(buffer) &&
+                       !std::isspace((unsigned char) m_cur[length]))
+                    buffer[length] = m_cur[length], length++;
+                buffer[length] = '\0';
+                char *end_ptr = nullptr;
+                value = std::strtod(buffer, &end_ptr);
+                if (end_ptr == buffer)
+                    error("invalid number");
+                m_cur += end_ptr - buffer;
+#endif
+                if (m_cur < m_end && !std::isspace((unsigned char) *m_cur)) {
+                    m_cur = start;
+                    error("invalid number");
+                }
+                return (T) value;
+            }
+            int64_t value;
+            std::from_chars_result result = std::from_chars(m_cur, m_end, value);
+            if (result.ec != std::errc() || (result.ptr < m_end && !std::isspace((unsigned char) *result.ptr)))
+                error("invalid integer");
+            m_cur = result.ptr;
+            return (T) value;
+        }
+
+        const char *m_data;
+        const char *m_cur;
+        const char *m_end;
+        std::string m_filename;
+        EFormat m_format = EASCII;
+        bool m_swap = false;
+    };
+
+    /// Read the vertex element into \c m_V, \c m_N and \c m_UV
+    void readVertices(PLYReader &reader, const Element &element, const Transform &trafo);
+
+    /// Read the face element into \c m_F, return the number of triangles
+    uint32_t readFaces(PLYReader &reader, const Element &element, uint32_t nVertices);
+};
+
+void PLYMesh::readVertices(PLYReader &reader, const Element &element, const Transform &trafo) {
+    static const char *names[][4] = {
+        { "x" }, { "y" }, { "z" }, { "nx" }, { "ny" }, { "nz" },
+        { "u", "s", "texture_u", "texture_s" }, { "v", "t", "texture_v", "texture_t" }
+    };
+
+    /* Attribute stored by every property, or EAttributeCount */
+    std::vector<int> attribute(element.properties.size(), EAttributeCount);
+    bool present[EAttributeCount] = { };
+    for (size_t i = 0; i < element.properties.size(); ++i) {
+        const Property &property = element.properties[i];
+        for (int a = 0; a < EAttributeCount && property.countType == EInvalid; ++a) {
+            for (const char *name : names[a]) {
+                if (name && property.name == name && !present[a]) {
+                    attribute[i] = a;
+                    present[a] = true;
+                }
+            }
+        }
+    }
+    if (!present[EX] || !present[EY] || !present[EZ])
+        throw NoriException("PLY file \"%s\": the vertices have no positions!", m_name);
+    bool hasNormals = present[ENX] && present[ENY] && present[ENZ];
+    bool hasTexcoords = present[EU] && present[EV];
+
+    m_V.resize(3, element.count);
+    m_N.resize(3, hasNormals ? element.count : 0);
+    m_UV.resize(2, hasTexcoords ? element.count : 0);
+
+    float values[EAttributeCount] = { };
+    for (uint32_t i = 0; i < element.count; ++i) {
+        for (size_t j = 0; j < element.properties.size(); ++j) {
+            if (attribute[j] == EAttributeCount)
+                reader.skip(element.properties[j]);
+            else
+                values[attribute[j]] = reader.read<float>(element.properties[j].type);
+        }
+
+        Point3f p = trafo * Point3f(values[EX], values[EY], values[EZ]);
+        m_bbox.expandBy(p);
+        m_V.col(i) = p;
+        if (hasNormals)
+            m_N.col(i) = (trafo * Normal3f(values[ENX], values[ENY], values[ENZ])).normalized();
+        if (hasTexcoords)
+            m_UV.col(i) = Point2f(values[EU], values[EV]);
+    }
+}
+
+uint32_t PLYMesh::readFaces(PLYReader &reader, const Element &element, uint32_t nVertices) {
+    int indexProperty = -1;
+    for (size_t i = 0; i < element.properties.size(); ++i) {
+        const Property &property = element.properties[i];
+        if (property.countType != EInvalid &&
+            (property.name == "vertex_indices" || property.name == "vertex_index"))
+            indexProperty = (int) i;
+    }
+    if (indexProperty < 0)
+        throw NoriException("PLY file \"%s\": the faces have no vertex indices!", m_name);
+
+    /* Most faces are triangles; grow the matrix if there are other polygons */
+    uint32_t nTriangles = 0;
+    m_F.resize(3, element.count);
+
+    for (uint32_t i = 0; i < element.count; ++i) {
+        for (size_t j = 0; j < element.properties.size(); ++j) {
+            const Property &property = element.properties[j];
+            if ((int) j != indexProperty) {
+                reader.skip(property);
+                continue;
+            }
+
+            uint32_t count = reader.readCount(property.countType);
+            uint32_t first = 0, previous = 0;
+            for (uint32_t k = 0; k < count; ++k) {
+                int64_t index = reader.read<int64_t>(property.type);
+                if (index < 0 || index >= nVertices)
+                    throw NoriException("PLY file \"%s\": a face refers to vertex %i, but there are only %i!",
+                        m_name, index, nVertices);
+
+                /* Split the polygon into a fan of triangles */
+                if (k == 0) {
+                    first = (uint32_t) index;
+                } else if (k >= 2) {
+                    if (nTriangles == m_F.cols())
+                        m_F.conservativeResize(3, std::max<Eigen::Index>(2 * m_F.cols(), 16));
+                    m_F(0, nTriangles) = first;
+                    m_F(1, nTriangles) = previous;
+                    m_F(2, nTriangles) = (uint32_t) index;
+                    nTriangles++;
+                }
+                previous = (uint32_t) index;
+            }
+        }
+    }
+    return nTriangles;
+}
+
+NORI_REGISTER_CLASS(PLYMesh, "ply");
+NORI_NAMESPACE_END
@@ -0,0 +1,76 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <nori/raystats.h>
+#include <mutex>
+
+NORI_NAMESPACE_BEGIN
+
+namespace {
+    /* Records are never freed, threads that exit keep contributing to the total */
+    std::mutex records_mutex;
+    std::vector<std::unique_ptr<RayStats>> records;
+}
+
+RayStats* RayStats::registerThread() {
+    std::lock_guard<std::mutex> lock(records_mutex);
+    records.emplace_back(new RayStats());
+    return records.back().get();
+}
+
+RayStats RayStats::total() {
+    std::lock_guard<std::mutex> lock(records_mutex);
+    RayStats result;
+    for (const auto& record : records) {
+        for (int type = 0; type < ERayTypeCount; type++)
+            result.rays[type] += record->rays[type];
+        result.nodes_visited += record->nodes_visited;
+        result.box_tests += record->box_tests;
+        result.triangle_tests += record->triangle_tests;
+    }
+    return result;
+}
+
+void RayStats::reset() {
+    std::lock_guard<std::mutex> lock(records_mutex);
+    for (const auto& record : records)
+        *record = RayStats();
+}
+
+std::string RayStats::toString() const {
+    uint64_t num_rays = rays[EPrimaryRay] + rays[EShadowRay] + rays[EIndirectRay];
+    double per_ray = 1.0 / (double) std::max<uint64_t>(num_rays, 1);
+    return tfm::format(
+        "Ray statistics:\n"
+        "  Primary rays: %llu\n"
+        "  Shadow rays: %llu\n"
+        "  Indirect rays: %llu\n"
+        "  Nodes visited: %llu (%.2f per ray)\n"
+        "  Box tests: %llu (%.2f per ray)\n"
+        "  Triangle tests: %llu (%.2f per ray)",
+        (unsigned long long) rays[EPrimaryRay],
+        (unsigned long long) rays[EShadowRay],
+        (unsigned long long) rays[EIndirectRay],
+        (unsigned long long) nodes_visited, nodes_visited * per_ray,
+        (unsigned long long) box_tests, box_tests * per_ray,
+        (unsigned long long) triangle_tests, triangle_tests * per_ray
+    );
+}
+
+NORI_NAMESPACE_END
@@ -10,12 +10,12 @@
 #include <nori/sampler.h>
 #include <nori/camera.h>
 #include <nori/emitter.h>
+#include <nori/instance.h>
+#include <nori/twolevel.h>
 
 NORI_NAMESPACE_BEGIN
 
-Scene::Scene(const PropertyList &) {
-    m_accel = new Accel();
-}
+Scene::Scene(const PropertyList &) { }
 
 Scene::~Scene() {
     delete m_accel;
@@ -25,6 +25,41 @@ Scene::~Scene() {
 }
 
 void Scene::activate() {
+    if (!m_accel) {
+        /* Create a default (binned SAH BVH) acceleration structure */
+        m_accel = static_cast<Accel*>(
+            NoriObjectFactory::createInstance("bvh", PropertyList()));
+    }
+
+    bool instancing = false;
+    for (Mesh *mesh : m_meshes) {
+        if (mesh->getInstances().empty())
+            m_accel->addMesh(mesh);
+        else
+            instancing = true;
+    }
+
+    if (instancing) {
+        /* Two levels: one shared structure per instanced mesh, and the
+           remaining meshes in the selected structure as a single instance */
+        TwoLevelAccel *accel = new TwoLevelAccel();
+        for (Mesh *mesh : m_meshes) {
+            if (mesh->getInstances().empty())
+                continue;
+            Accel *bottom_level = m_accel->createBottomLevel();
+            bottom_level->addMesh(mesh);
+            uint32_t index = accel->addBottomLevel(bottom_level);
+            for (const Instance *instance : mesh->getInstances())
+                accel->addInstance(index, instance->getToWorld());
+        }
+
+        if (m_accel->getBoundingBox().isValid())
+            accel->addInstance(accel->addBottomLevel(m_accel), Transform());
+        else
+            delete m_accel;
+        m_accel = accel;
+    }
+
     m_accel->build();
 
     if (!m_integrator)
@@ -43,11 +78,18 @@ void Scene::activate() {
     cout << endl;
 }
 
+void Scene::setFrame(int frame) {
+    bool changed = false;
+    for (Mesh *mesh : m_meshes)
+        changed |= mesh->setFrame(frame);
+    if (changed)
+        m_accel->refit();
+}
+
 void Scene::addChild(NoriObject *obj) {
     switch (obj->getClassType()) {
         case EMesh: {
                 Mesh *mesh = static_cast<Mesh *>(obj);
-                m_accel->addMesh(mesh);
                 m_meshes.push_back(mesh);
                 if (mesh->isEmitter()) m_emitted_meshses.push_back(mesh);
             }
@@ -60,6 +102,12 @@ void Scene::addChild(NoriObject *obj) {
             }
             break;
 
+        case EAccel:
+            if (m_accel)
+                throw NoriException("There can only be one acceleration structure per scene!");
+            m_accel = static_cast<Accel *>(obj);
+            break;
+
         case ESampler:
             if (m_sampler)
                 throw NoriException("There can only be one sampler per scene!");
@@ -98,12 +146,14 @@ std::string Scene::toString() const {
         "  integrator = %s,\n"
         "  sampler = %s\n"
         "  camera = %s,\n"
+        "  accel = %s,\n"
         "  meshes = {\n"
         "  %s  }\n"
         "]",
         indent(m_integrator->toString()),
         indent(m_sampler->toString()),
         indent(m_camera->toString()),
+        indent(m_accel->toString()),
         indent(meshes, 2)
     );
 }